@@ -0,0 +1,560 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* How the driver classifies, filters and keeps copies of the packets it queues for reading, and when it indicates the
+ * ones written. Everything in here works on plain packet bytes and counts rather than NDIS structures, so that it can
+ * be tested on its own on hosts other than Windows. */
+
+#pragma once
+
+#include "wintun.h"
+
+#ifndef _KERNEL_MODE
+#    include <assert.h>
+#    ifndef ASSERT
+#        define ASSERT(expr) assert(expr)
+#    endif
+#    ifndef _WIN32
+#        define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#        define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+#        define _In_reads_(count)
+#        define _Inout_updates_(count)
+#        define _Must_inspect_result_
+#    endif
+#endif
+
+#define TUN_IPPROTO_TCP 6
+#define TUN_IPPROTO_UDP 17
+
+/* Transmit queue lanes, served in strict priority order, one for each TUN_PRIORITY_LANES. */
+typedef enum _TUN_LANE_ID
+{
+    TUN_LANE_HIGH = 0,
+    TUN_LANE_NORMAL,
+    TUN_LANE_LOW,
+    TUN_LANE_COUNT
+} TUN_LANE_ID;
+
+/* Returns the IP precedence of a packet, the top three bits of its IPv4 TOS or IPv6 traffic class, 0 if it is
+ * neither. */
+static UCHAR
+TunIpPrecedence(_In_reads_bytes_(2) const UCHAR *Ip)
+{
+    switch (Ip[0] >> 4)
+    {
+    case 4:
+        return Ip[1] >> 5;
+    case 6:
+        return (Ip[0] >> 1) & 7;
+    }
+    return 0;
+}
+
+/* Returns the transport protocol of an IP packet at least 20 bytes long, for reporting its checksum as verified, or 0
+ * for an IPv4 fragment: that carries only part of the segment its TCP or UDP checksum covers, so just its IP header
+ * checksum can be vouched for. An IPv6 fragment already shows its fragment header as the protocol. */
+static UCHAR
+TunIpChecksumProtocol(_In_reads_bytes_(20) const UCHAR *Ip)
+{
+    if (Ip[0] >> 4 != 4)
+        return Ip[6];
+    return (Ip[6] & 0x3f) || Ip[7] /* More fragments, or a fragment offset */ ? 0 : Ip[9];
+}
+
+/* Returns the lane of an 802.1p user priority or IP precedence. 802.1Q ranks background (1) below best effort (0) and
+ * everything else above it, so only 1, e.g. DSCP CS1, goes to the low lane. Voice, internetwork control and network
+ * control (5 to 7, e.g. EF and CS5 to CS7) go to the high lane, and the rest, 0 and 2 to 4, to the normal lane. */
+static TUN_LANE_ID
+TunLaneOfPriority(_In_ UCHAR Priority)
+{
+    static const TUN_LANE_ID priority_lane[8] = { TUN_LANE_NORMAL, TUN_LANE_LOW,  TUN_LANE_NORMAL, TUN_LANE_NORMAL,
+                                                  TUN_LANE_NORMAL, TUN_LANE_HIGH, TUN_LANE_HIGH,   TUN_LANE_HIGH };
+    return priority_lane[Priority & 7];
+}
+
+/* Returns the lane whose oldest NBL is dropped next to bring the queue back within its limits, or TUN_LANE_COUNT if
+ * none need be: first any lane over its own limit, then, while the queue as a whole, counting NBLs still being copied
+ * out, holds more than MaxTotal, the least important lane that is not empty. */
+static TUN_LANE_ID
+TunLaneToDrop(
+    _In_reads_(TUN_LANE_COUNT) const LONG *NumNbl,
+    _In_reads_(TUN_LANE_COUNT) const LONG *MaxNbls,
+    _In_ ULONG Total,
+    _In_ ULONG MaxTotal)
+{
+    TUN_LANE_ID lane_id;
+    for (lane_id = TUN_LANE_HIGH; lane_id < TUN_LANE_COUNT; ++lane_id)
+    {
+        if (NumNbl[lane_id] > MaxNbls[lane_id])
+            return lane_id;
+    }
+    if (Total <= MaxTotal)
+        return TUN_LANE_COUNT;
+    for (lane_id = TUN_LANE_COUNT; lane_id-- > TUN_LANE_HIGH;)
+    {
+        if (NumNbl[lane_id] > 0)
+            return lane_id;
+    }
+    return TUN_LANE_COUNT;
+}
+
+#define TUN_RECEIVE_BATCH_NBLS 64 /* Staged NBLs indicated without waiting for any more writers */
+
+/* What a writer does about the NBLs it just staged for indication. */
+typedef enum _TUN_RECEIVE_ACTION
+{
+    TUN_RECEIVE_INDICATE, /* Become the indicator and indicate everything staged */
+    TUN_RECEIVE_WAIT,     /* Leave them to the writers still under way, arming the deadline */
+    TUN_RECEIVE_LEAVE     /* Leave them to the indicator, or to the deadline already armed */
+} TUN_RECEIVE_ACTION;
+
+/* Returns what a writer does after staging its NBLs, which brought the NBLs staged to Staged, while Writers others are
+ * still building theirs. An indicator picks up anything staged meanwhile. Without one, the writer indicates right away
+ * once there is a full batch or nobody else is about to add to it, and otherwise leaves it to the last of the others,
+ * with a deadline in case they fail or take too long. */
+static TUN_RECEIVE_ACTION
+TunReceiveAction(_In_ LONG Staged, _In_ LONG Writers, _In_ BOOLEAN Indicating, _In_ BOOLEAN DeadlineArmed)
+{
+    if (Indicating)
+        return TUN_RECEIVE_LEAVE;
+    if (Staged >= TUN_RECEIVE_BATCH_NBLS || Writers <= 0)
+        return TUN_RECEIVE_INDICATE;
+    return DeadlineArmed ? TUN_RECEIVE_LEAVE : TUN_RECEIVE_WAIT;
+}
+
+/* A copy of a queued packet, taken when the adapter paused, that is handed out ahead of the lanes afterwards, or a copy
+ * of a packet queued in a TUN_COPY_RING, which leaves Next unused. */
+typedef struct _TUN_PACKET_COPY
+{
+    struct _TUN_PACKET_COPY *Next;
+    ULONG Size;
+    ULONG OriginalSize; /* Exceeds Size if the copy was cut to a tap's snap length */
+    UCHAR Priority;
+    UCHAR Data[];
+} TUN_PACKET_COPY;
+
+#define TunCopyFootprint(size) (((ULONG)sizeof(TUN_PACKET_COPY) + (size) + 7) & ~7UL)
+
+/* Packet copies queued back to back in a buffer allocated up front, so that queueing one never allocates. They run from
+ * Head to Tail, going on from 0 at Wrap if Tail went round. Tail catches up with Head from behind only once the ring is
+ * empty, which puts both back at 0, so a copy must leave a gap before Head. */
+typedef struct _TUN_COPY_RING
+{
+    UCHAR *Buffer;
+    ULONG Size, Head, Tail, Wrap;
+    LONG Count, MaxCount;
+} TUN_COPY_RING;
+
+/* Sets up an empty ring in Buffer, which must fit at least one copy of the largest size queued. */
+static VOID
+TunCopyRingInit(_Out_ TUN_COPY_RING *Ring, _In_ UCHAR *Buffer, _In_ ULONG Size, _In_ LONG MaxCount)
+{
+    Ring->Buffer = Buffer;
+    Ring->Size = Ring->Wrap = Size;
+    Ring->Head = Ring->Tail = 0;
+    Ring->Count = 0;
+    Ring->MaxCount = MaxCount;
+}
+
+/* Returns where the next copy of Size bytes goes, or NULL if the ring is full. The copy is only queued by
+ * TunCopyRingCommit, so it may be abandoned meanwhile. */
+static TUN_PACKET_COPY *
+TunCopyRingReserve(_In_ const TUN_COPY_RING *Ring, _In_ ULONG Size)
+{
+    ULONG footprint = TunCopyFootprint(Size);
+    if (Ring->Count >= Ring->MaxCount)
+        return NULL;
+    if (Ring->Tail < Ring->Head)
+        return Ring->Head - Ring->Tail > footprint ? (TUN_PACKET_COPY *)(Ring->Buffer + Ring->Tail) : NULL;
+    if (Ring->Size - Ring->Tail >= footprint)
+        return (TUN_PACKET_COPY *)(Ring->Buffer + Ring->Tail);
+    return Ring->Head > footprint ? (TUN_PACKET_COPY *)Ring->Buffer : NULL;
+}
+
+/* Queues a copy reserved by TunCopyRingReserve once its Size is filled in. */
+static VOID
+TunCopyRingCommit(_Inout_ TUN_COPY_RING *Ring, _In_ const TUN_PACKET_COPY *Copy)
+{
+    ULONG offset = (ULONG)((const UCHAR *)Copy - Ring->Buffer);
+    if (offset != Ring->Tail)
+        Ring->Wrap = Ring->Tail;
+    Ring->Tail = offset + TunCopyFootprint(Copy->Size);
+    Ring->Count++;
+}
+
+static TUN_PACKET_COPY *
+TunCopyRingFirst(_In_ const TUN_COPY_RING *Ring)
+{
+    return Ring->Count ? (TUN_PACKET_COPY *)(Ring->Buffer + Ring->Head) : NULL;
+}
+
+/* Dequeues the copy TunCopyRingFirst returns, once done with it. */
+static VOID
+TunCopyRingPop(_Inout_ TUN_COPY_RING *Ring)
+{
+    Ring->Head += TunCopyFootprint(TunCopyRingFirst(Ring)->Size);
+    if (!--Ring->Count)
+    {
+        Ring->Head = Ring->Tail = 0;
+        Ring->Wrap = Ring->Size;
+    }
+    else if (Ring->Head == Ring->Wrap)
+    {
+        Ring->Head = 0;
+        Ring->Wrap = Ring->Size;
+    }
+}
+
+#define TUN_ACK_FLOWS 128 /* Must be a power of two */
+#define TUN_ACK_KEY_SIZE 36 /* IPv6 source and destination addresses followed by TCP ports */
+
+/* The newest pure ACK queued for a flow, for as long as it stays queued. */
+typedef struct _TUN_ACK_FLOW
+{
+    VOID *Nbl; /* The NET_BUFFER_LIST carrying it, NULL once it leaves the queue */
+    ULONG Ack; /* Acknowledgment number, host order */
+    UCHAR Lane;
+    UCHAR KeySize;
+    UCHAR Key[TUN_ACK_KEY_SIZE];
+} TUN_ACK_FLOW;
+
+/* Returns TRUE for an IP packet that is a lone TCP segment carrying nothing but an acknowledgment: no payload, no
+ * options (SACK blocks included), and no flag other than ACK. Its flow key and acknowledgment number are returned
+ * along. */
+_Must_inspect_result_
+static BOOLEAN
+TunAckClassify(
+    _In_reads_bytes_(Size) const UCHAR *Ip,
+    _In_ ULONG Size,
+    _Out_writes_bytes_(TUN_ACK_KEY_SIZE) UCHAR *Key,
+    _Out_ UCHAR *KeySize,
+    _Out_ ULONG *Ack)
+{
+    const UCHAR *tcp;
+    if (Size < 40)
+        return FALSE;
+    switch (Ip[0] >> 4)
+    {
+    case 4: {
+        ULONG ihl = (Ip[0] & 0xf) * 4;
+        if (ihl < 20 || Size != ihl + 20 || ((ULONG)Ip[2] << 8 | Ip[3]) != Size || Ip[9] != TUN_IPPROTO_TCP ||
+            (Ip[6] & 0x3f) || Ip[7] /* More fragments, or a fragment offset */)
+            return FALSE;
+        RtlCopyMemory(Key, Ip + 12, 8);
+        *KeySize = 8;
+        tcp = Ip + ihl;
+        break;
+    }
+    case 6:
+        if (Size != 60 || ((ULONG)Ip[4] << 8 | Ip[5]) != 20 || Ip[6] != TUN_IPPROTO_TCP)
+            return FALSE;
+        RtlCopyMemory(Key, Ip + 8, 32);
+        *KeySize = 32;
+        tcp = Ip + 40;
+        break;
+    default:
+        return FALSE;
+    }
+    if (tcp[12] >> 4 != 5 || tcp[13] != 0x10 /* ACK */)
+        return FALSE;
+    RtlCopyMemory(Key + *KeySize, tcp, 4);
+    *KeySize += 4;
+    *Ack = (ULONG)tcp[8] << 24 | (ULONG)tcp[9] << 16 | (ULONG)tcp[10] << 8 | tcp[11];
+    return TRUE;
+}
+
+/* Records the pure ACK TunAckClassify found in Nbl, just queued in Lane, as the newest of its flow. Returns the entry
+ * of Flows that now holds it, and sets Superseded to the older ACK of the flow it makes redundant, if that is still
+ * queued in the same lane. Only an ACK that acknowledges more supersedes one: duplicate ACKs tell the sender of loss,
+ * so each of them is kept. */
+static TUN_ACK_FLOW *
+TunAckRecord(
+    _Inout_updates_(TUN_ACK_FLOWS) TUN_ACK_FLOW *Flows,
+    _In_ VOID *Nbl,
+    _In_ UCHAR Lane,
+    _In_reads_bytes_(KeySize) const UCHAR *Key,
+    _In_ UCHAR KeySize,
+    _In_ ULONG Ack,
+    _Out_ VOID **Superseded)
+{
+    ULONG hash = 2166136261;
+    for (ULONG i = 0; i < KeySize; ++i)
+        hash = (hash ^ Key[i]) * 16777619;
+    TUN_ACK_FLOW *flow = &Flows[hash & (TUN_ACK_FLOWS - 1)];
+    *Superseded = NULL;
+    if (flow->Nbl && flow->Lane == Lane && flow->KeySize == KeySize && RtlEqualMemory(flow->Key, Key, KeySize) &&
+        (LONG)(Ack - flow->Ack) > 0)
+        *Superseded = flow->Nbl;
+    flow->Nbl = Nbl;
+    flow->Ack = Ack;
+    flow->Lane = Lane;
+    flow->KeySize = KeySize;
+    RtlCopyMemory(flow->Key, Key, KeySize);
+    return flow;
+}
+
+/* Checks that a filter program terminates, keeps its jumps and scratch memory accesses in range, and never divides
+ * by a zero constant, so TunFilterRun needs no checks beyond packet bounds and division by X. */
+_Must_inspect_result_
+static BOOLEAN
+TunFilterValidate(_In_reads_(Count) const TUN_FILTER_INSN *Insns, _In_ ULONG Count)
+{
+    if (!Count || Count > TUN_FILTER_MAX_INSNS)
+        return FALSE;
+    for (ULONG pc = 0; pc < Count; ++pc)
+    {
+        const TUN_FILTER_INSN *insn = &Insns[pc];
+        ULONG remaining = Count - pc - 1;
+        switch (insn->Code)
+        {
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_H | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_B | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_IND:
+        case TUN_BPF_LD | TUN_BPF_H | TUN_BPF_IND:
+        case TUN_BPF_LD | TUN_BPF_B | TUN_BPF_IND:
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_LEN:
+        case TUN_BPF_LD | TUN_BPF_IMM:
+        case TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_IMM:
+        case TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_LEN:
+        case TUN_BPF_LDX | TUN_BPF_B | TUN_BPF_MSH:
+        case TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_SUB | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_MUL | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_OR | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_AND | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_RSH | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_XOR | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_SUB | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_MUL | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_OR | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_AND | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_RSH | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_XOR | TUN_BPF_X:
+        case TUN_BPF_ALU | TUN_BPF_NEG:
+        case TUN_BPF_RET | TUN_BPF_K:
+        case TUN_BPF_RET | TUN_BPF_A:
+        case TUN_BPF_MISC | TUN_BPF_TAX:
+        case TUN_BPF_MISC | TUN_BPF_TXA:
+            break;
+        case TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_K:
+        case TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_K:
+            if (!insn->K)
+                return FALSE;
+            break;
+        case TUN_BPF_LD | TUN_BPF_MEM:
+        case TUN_BPF_LDX | TUN_BPF_MEM:
+        case TUN_BPF_ST:
+        case TUN_BPF_STX:
+            if (insn->K >= TUN_FILTER_MEMWORDS)
+                return FALSE;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JA:
+            if (insn->K >= remaining)
+                return FALSE;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_K:
+        case TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_K:
+        case TUN_BPF_JMP | TUN_BPF_JGE | TUN_BPF_K:
+        case TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_K:
+        case TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_X:
+        case TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_X:
+        case TUN_BPF_JMP | TUN_BPF_JGE | TUN_BPF_X:
+        case TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_X:
+            if (insn->Jt >= remaining || insn->Jf >= remaining)
+                return FALSE;
+            break;
+        default:
+            return FALSE;
+        }
+    }
+    /* Jumps only go forward, so ending in a return is all it takes for every path to end in one. */
+    return (Insns[Count - 1].Code & 0x07) == TUN_BPF_RET;
+}
+
+/* Runs a filter program TunFilterValidate accepted over the first Size bytes of a Length byte packet. Returns its
+ * verdict, along with the return instruction that produced it, or that of the load that went out of bounds. */
+static ULONG
+TunFilterRun(
+    _In_ const TUN_FILTER_INSN *Insns,
+    _In_reads_bytes_(Size) const UCHAR *Data,
+    _In_ ULONG Size,
+    _In_ ULONG Length,
+    _Out_ ULONG *Pc)
+{
+    ULONG a = 0, x = 0, mem[TUN_FILTER_MEMWORDS] = { 0 };
+    for (ULONG pc = 0;; ++pc)
+    {
+        const TUN_FILTER_INSN *insn = &Insns[pc];
+        ULONG k = insn->K;
+        ULONG64 off;
+        *Pc = pc;
+        switch (insn->Code)
+        {
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_IND:
+            off = insn->Code & TUN_BPF_IND ? (ULONG64)x + k : k;
+            if (off + 4 > Size)
+                return 0;
+            a = (ULONG)Data[off] << 24 | (ULONG)Data[off + 1] << 16 | (ULONG)Data[off + 2] << 8 | Data[off + 3];
+            break;
+        case TUN_BPF_LD | TUN_BPF_H | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_H | TUN_BPF_IND:
+            off = insn->Code & TUN_BPF_IND ? (ULONG64)x + k : k;
+            if (off + 2 > Size)
+                return 0;
+            a = (ULONG)Data[off] << 8 | Data[off + 1];
+            break;
+        case TUN_BPF_LD | TUN_BPF_B | TUN_BPF_ABS:
+        case TUN_BPF_LD | TUN_BPF_B | TUN_BPF_IND:
+            off = insn->Code & TUN_BPF_IND ? (ULONG64)x + k : k;
+            if (off + 1 > Size)
+                return 0;
+            a = Data[off];
+            break;
+        case TUN_BPF_LD | TUN_BPF_W | TUN_BPF_LEN:
+            a = Length;
+            break;
+        case TUN_BPF_LD | TUN_BPF_IMM:
+            a = k;
+            break;
+        case TUN_BPF_LD | TUN_BPF_MEM:
+            a = mem[k];
+            break;
+        case TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_IMM:
+            x = k;
+            break;
+        case TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_LEN:
+            x = Length;
+            break;
+        case TUN_BPF_LDX | TUN_BPF_MEM:
+            x = mem[k];
+            break;
+        case TUN_BPF_LDX | TUN_BPF_B | TUN_BPF_MSH:
+            if (k >= Size)
+                return 0;
+            x = (Data[k] & 0xf) << 2;
+            break;
+        case TUN_BPF_ST:
+            mem[k] = a;
+            break;
+        case TUN_BPF_STX:
+            mem[k] = x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_K:
+            a += k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_SUB | TUN_BPF_K:
+            a -= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_MUL | TUN_BPF_K:
+            a *= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_K:
+            a /= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_K:
+            a %= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_OR | TUN_BPF_K:
+            a |= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_AND | TUN_BPF_K:
+            a &= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_K:
+            a = k < 32 ? a << k : 0;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_RSH | TUN_BPF_K:
+            a = k < 32 ? a >> k : 0;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_XOR | TUN_BPF_K:
+            a ^= k;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_X:
+            a += x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_SUB | TUN_BPF_X:
+            a -= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_MUL | TUN_BPF_X:
+            a *= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_X:
+            if (!x)
+                return 0;
+            a /= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_X:
+            if (!x)
+                return 0;
+            a %= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_OR | TUN_BPF_X:
+            a |= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_AND | TUN_BPF_X:
+            a &= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_X:
+            a = x < 32 ? a << x : 0;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_RSH | TUN_BPF_X:
+            a = x < 32 ? a >> x : 0;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_XOR | TUN_BPF_X:
+            a ^= x;
+            break;
+        case TUN_BPF_ALU | TUN_BPF_NEG:
+            a = (ULONG)-(LONG)a;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JA:
+            pc += k;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_K:
+            pc += a == k ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_K:
+            pc += a > k ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JGE | TUN_BPF_K:
+            pc += a >= k ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_K:
+            pc += a & k ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_X:
+            pc += a == x ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_X:
+            pc += a > x ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JGE | TUN_BPF_X:
+            pc += a >= x ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_X:
+            pc += a & x ? insn->Jt : insn->Jf;
+            break;
+        case TUN_BPF_RET | TUN_BPF_K:
+            return k;
+        case TUN_BPF_RET | TUN_BPF_A:
+            return a;
+        case TUN_BPF_MISC | TUN_BPF_TAX:
+            x = a;
+            break;
+        case TUN_BPF_MISC | TUN_BPF_TXA:
+            a = x;
+            break;
+        default:
+            ASSERT(FALSE); /* Rejected by TunFilterValidate */
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,491 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Round-trips, fuzzes and times the exchange helpers of wintun.h: the v1 and v2 formats and mux runs. Run with
+ * --bench to time them instead. */
+
+#include "../wintun.h"
+#include "test.h"
+
+#define BUFFER_SIZE (1 << 20)
+
+static TUN_ALIGN(TUN_EXCH_ALIGNMENT) UCHAR Buffer[BUFFER_SIZE];
+
+/* Fills in an IP header of the given version, and the rest of the packet with a pattern Seed picks. */
+static void
+FillPacket(UCHAR *Data, ULONG Size, UCHAR Version, ULONG Seed)
+{
+    for (ULONG i = 0; i < Size; ++i)
+        Data[i] = (UCHAR)(Seed + i * 31);
+    if (Size)
+        Data[0] = (UCHAR)(Version << 4 | (Data[0] & 0xf));
+}
+
+static BOOLEAN
+CheckPacket(const UCHAR *Data, ULONG Size, ULONG Seed)
+{
+    for (ULONG i = 1; i < Size; ++i)
+    {
+        if (Data[i] != (UCHAR)(Seed + i * 31))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Sizes valid for the version: at least a header, and everything from there up to the largest packet. */
+static ULONG
+RandomSize(UCHAR Version, ULONG Max)
+{
+    ULONG min = Version == 6 ? 40 : 20;
+    return min + TestRandom() % (Max - min + 1);
+}
+
+/* The validation rules spelled out packet by packet, to hold the batched validators to. */
+static BOOLEAN
+ReferenceValidate(const UCHAR *Buffer, ULONG Size, LONG Format, ULONG *Count)
+{
+    ULONG header = Format == TUN_EXCH_FORMAT_V2 ? sizeof(TUN_PACKET_V2) : sizeof(TUN_PACKET);
+    ULONG offset = 0;
+    *Count = 0;
+    if (Size > TUN_EXCH_MAX_BUFFER_SIZE)
+        return FALSE;
+    while (Size - offset >= header)
+    {
+        ULONG p_size = Format == TUN_EXCH_FORMAT_V2 ? ((const TUN_PACKET_V2 *)(Buffer + offset))->Size
+                                                   : ((const TUN_PACKET *)(Buffer + offset))->Size;
+        if (p_size > TUN_EXCH_MAX_IP_PACKET_SIZE)
+            return FALSE;
+        ULONG p_aligned =
+            Format == TUN_EXCH_FORMAT_V2 ? TunPacketV2Align(header + p_size) : TunPacketAlign(header + p_size);
+        if (Size - offset < p_aligned || !TunIpVersion(Buffer + offset + header, p_size))
+            return FALSE;
+        offset += p_aligned;
+        ++*Count;
+    }
+    return offset == Size;
+}
+
+static void
+TestV1RoundTrip(void)
+{
+    TUN_EXCH_WRITER writer;
+    ULONG sizes[4096], count = 0, total;
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    for (UCHAR *data;; ++count)
+    {
+        UCHAR version = count % 3 ? 4 : 6;
+        if (count == sizeof(sizes) / sizeof(sizes[0]))
+            break;
+        sizes[count] = RandomSize(version, 1500);
+        data = TunExchWriterReserve(&writer, sizes[count], count & 1 ? TUN_PACKET_FLAG_CHECKSUM_VALID : 0);
+        if (!data)
+            break;
+        FillPacket(data, sizes[count], version, count);
+    }
+    CHECK(count == writer.Count && count > 100);
+    CHECK(writer.Used % TUN_EXCH_ALIGNMENT == 0);
+    CHECK(TunExchValidate(Buffer, writer.Used, &total) && total == count);
+
+    TUN_EXCH_READER reader;
+    const TUN_PACKET *p;
+    ULONG i = 0;
+    TunExchReaderInit(&reader, Buffer, writer.Used);
+    for (; (p = TunExchReaderNext(&reader)) != NULL; ++i)
+    {
+        CHECK(((size_t)p->Data % TUN_EXCH_ALIGNMENT) == 0);
+        CHECK(p->Size == sizes[i] && CheckPacket(p->Data, p->Size, i));
+        CHECK(p->Flags == (i & 1 ? TUN_PACKET_FLAG_CHECKSUM_VALID : 0u) && !p->Priority && !p->OriginalSize);
+        CHECK(TunPacketIpVersion(p) == (i % 3 ? 4 : 6));
+    }
+    CHECK(i == count && reader.Next == reader.End);
+
+    /* Packets too large for the format, or for what is left of the bundle, are refused without using it up. */
+    ULONG used = writer.Used;
+    CHECK(!TunExchWriterReserve(&writer, TUN_EXCH_MAX_IP_PACKET_SIZE + 1, 0));
+    CHECK(!TunExchWriterReserve(&writer, BUFFER_SIZE, 0));
+    CHECK(writer.Used == used);
+}
+
+static void
+TestV1Invalid(void)
+{
+    TUN_EXCH_WRITER writer;
+    ULONG count;
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    FillPacket(TunExchWriterReserve(&writer, 20, 0), 20, 4, 0);
+    FillPacket(TunExchWriterReserve(&writer, 40, 0), 40, 6, 1);
+    ULONG second = TunPacketAlign(sizeof(TUN_PACKET) + 20);
+    TUN_PACKET *p = (TUN_PACKET *)(Buffer + second);
+    CHECK(TunExchValidate(Buffer, writer.Used, &count) && count == 2);
+
+    /* Headers too short for the version, and unknown versions. */
+    p->Size = 39;
+    CHECK(!TunExchValidate(Buffer, second + TunPacketAlign(sizeof(TUN_PACKET) + 39), NULL));
+    p->Size = 40;
+    p->Data[0] = 0x50;
+    CHECK(!TunExchValidate(Buffer, writer.Used, NULL));
+    p->Data[0] = 0x60;
+    p->Size = 0;
+    CHECK(!TunExchValidate(Buffer, second + sizeof(TUN_PACKET), NULL));
+    p->Size = TUN_EXCH_MAX_IP_PACKET_SIZE + 1;
+    CHECK(!TunExchValidate(Buffer, writer.Used, NULL));
+    p->Size = 40;
+
+    /* Oversized and empty bundles. */
+    CHECK(!TunExchValidate(Buffer, TUN_EXCH_MAX_BUFFER_SIZE + 1, NULL));
+    CHECK(TunExchValidate(Buffer, 0, &count) && count == 0);
+    CHECK(TunExchValidate(Buffer, writer.Used, &count) && count == 2);
+}
+
+/* Every cut of a bundle that does not fall between two packets must be refused, and read only up to the cut. */
+static void
+TestTruncated(LONG Format)
+{
+    TUN_EXCH_WRITER writer;
+    ULONG boundaries[4096 / sizeof(TUN_PACKET_V2)], count = 0;
+    TunExchWriterInit(&writer, Buffer, 4096);
+    for (UCHAR *data;; ++count)
+    {
+        ULONG size = RandomSize(4, 200);
+        boundaries[count] = writer.Used;
+        data = Format == TUN_EXCH_FORMAT_V2 ? TunExchV2WriterReserve(&writer, size, 0)
+                                            : TunExchWriterReserve(&writer, size, 0);
+        if (!data)
+            break;
+        FillPacket(data, size, 4, count);
+    }
+    for (ULONG cut = 0, next = 0; cut <= writer.Used; ++cut)
+    {
+        UCHAR *copy = TestExactCopy(Buffer, cut);
+        ULONG total, expected;
+        BOOLEAN boundary = next <= count && cut == boundaries[next];
+        BOOLEAN valid = Format == TUN_EXCH_FORMAT_V2 ? TunExchV2Validate(copy, cut, &total)
+                                                     : TunExchValidate(copy, cut, &total);
+        CHECK(valid == boundary && valid == ReferenceValidate(copy, cut, Format, &expected));
+        CHECK(!valid || total == next);
+        if (Format == TUN_EXCH_FORMAT_V1)
+        {
+            TUN_EXCH_READER reader;
+            ULONG read = 0;
+            TunExchReaderInit(&reader, copy, cut);
+            while (TunExchReaderNext(&reader))
+                ++read;
+            CHECK(read == (boundary ? next : next - 1));
+        }
+        if (boundary)
+            ++next;
+        free(copy);
+    }
+}
+
+/* Bundles whose size is off the alignment, packets whose padding is cut, and v2 offsets that are off the alignment
+ * are all refused. */
+static void
+TestMisaligned(void)
+{
+    TUN_EXCH_WRITER writer;
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    FillPacket(TunExchWriterReserve(&writer, 21, 0), 21, 4, 0);
+    CHECK(writer.Used == TunPacketAlign(sizeof(TUN_PACKET) + 21));
+    for (ULONG off = 1; off < TUN_EXCH_ALIGNMENT; ++off)
+        CHECK(!TunExchValidate(Buffer, writer.Used - off, NULL) && !TunExchValidate(Buffer, writer.Used + off, NULL));
+
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    FillPacket(TunExchV2WriterReserve(&writer, 21, 0), 21, 4, 0);
+    CHECK(writer.Used == TunPacketV2Align(sizeof(TUN_PACKET_V2) + 21) && writer.Used % TUN_EXCH_V2_ALIGNMENT == 0);
+    CHECK(TunExchV2Validate(Buffer, writer.Used, NULL));
+    for (ULONG off = 1; off < TUN_EXCH_V2_ALIGNMENT; ++off)
+        CHECK(!TunExchV2Validate(Buffer, writer.Used - off, NULL));
+
+    /* A v2 read buffer: one packet, then its offset and the count. */
+    ULONG *index = (ULONG *)(Buffer + writer.Used), count;
+    index[0] = 0;
+    index[1] = 1;
+    ULONG size = writer.Used + 2 * sizeof(ULONG);
+    const ULONG *found = TunExchV2Index(Buffer, size, &count);
+    CHECK(found == index && count == 1 && TunExchV2Packet(Buffer, found, 0) == (const TUN_PACKET_V2 *)Buffer);
+    for (ULONG off = 1; off < TUN_EXCH_V2_ALIGNMENT; ++off)
+    {
+        CHECK(!TunExchV2Packet(Buffer, found, off));
+        CHECK(!TunExchV2Index(Buffer, size - off, &count));
+    }
+    CHECK(!TunExchV2Packet(Buffer, found, writer.Used));
+    index[1] = size / sizeof(ULONG); /* More offsets than the buffer holds */
+    CHECK(!TunExchV2Index(Buffer, size, &count));
+}
+
+static void
+TestV2RoundTrip(void)
+{
+    TUN_EXCH_WRITER writer;
+    ULONG sizes[4096], count = 0, total;
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer) / 2);
+    for (UCHAR *data;; ++count)
+    {
+        UCHAR version = count % 2 ? 4 : 6;
+        if (count == sizeof(sizes) / sizeof(sizes[0]))
+            break;
+        sizes[count] = RandomSize(version, 1500);
+        data = TunExchV2WriterReserve(&writer, sizes[count], TUN_PACKET_FLAG_CHECKSUM_VALID);
+        if (!data)
+            break;
+        FillPacket(data, sizes[count], version, count);
+    }
+    CHECK(count > 100 && writer.Count == count);
+    CHECK(TunExchV2Validate(Buffer, writer.Used, &total) && total == count);
+
+    /* Turn the bundle into a read buffer, as TunReadFinish does, and look its packets up from the last. */
+    ULONG *index = (ULONG *)(Buffer + writer.Used), offset = 0;
+    for (ULONG i = 0; i < count; ++i)
+    {
+        index[i] = offset;
+        offset += TunPacketV2Align(sizeof(TUN_PACKET_V2) + sizes[i]);
+    }
+    index[count] = count;
+    ULONG size = writer.Used + (count + 1) * sizeof(ULONG), listed;
+    const ULONG *found = TunExchV2Index(Buffer, size, &listed);
+    CHECK(found == index && listed == count);
+    for (ULONG i = count; found && i-- > 0;)
+    {
+        const TUN_PACKET_V2 *p = TunExchV2Packet(Buffer, found, found[i]);
+        CHECK(p && p->Size == sizes[i] && p->Flags == TUN_PACKET_FLAG_CHECKSUM_VALID && !p->Priority);
+        CHECK(p && CheckPacket(p->Data, p->Size, i) && TunIpVersion(p->Data, p->Size) == (i % 2 ? 4 : 6));
+    }
+}
+
+static void
+TestMuxRoundTrip(void)
+{
+    static const ULONG luid_indices[] = { 7, 3, 7, 1000 };
+    TUN_EXCH_WRITER writer;
+    ULONG run = 0, counts[4];
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    for (ULONG r = 0; r < 4; ++r)
+    {
+        CHECK(TunExchMuxWriterBegin(&writer, luid_indices[r], &run));
+        counts[r] = r == 1 ? 0 : 1 + TestRandom() % 50;
+        for (ULONG i = 0; i < counts[r]; ++i)
+            FillPacket(TunExchWriterReserve(&writer, 100 + i, 0), 100 + i, 4, r * 100 + i);
+        TunExchMuxWriterEnd(&writer, run);
+    }
+
+    /* The empty run is dropped again, the others are read back in order. */
+    TUN_EXCH_READER reader, packets;
+    const TUN_MUX_RUN *header;
+    ULONG r = 0;
+    TunExchReaderInit(&reader, Buffer, writer.Used);
+    for (; (header = TunExchMuxReaderNext(&reader, &packets)) != NULL; ++r)
+    {
+        r += r == 1;
+        ULONG count, i = 0;
+        CHECK(header->LuidIndex == luid_indices[r] && !header->Count && !header->Reserved);
+        CHECK(TunExchValidate(packets.Next, header->Size, &count) && count == counts[r]);
+        for (const TUN_PACKET *p; (p = TunExchReaderNext(&packets)) != NULL; ++i)
+            CHECK(p->Size == 100 + i && CheckPacket(p->Data, p->Size, r * 100 + i));
+        CHECK(i == counts[r]);
+    }
+    CHECK(r == 4 && reader.Next == reader.End);
+
+    /* A run claiming more than the buffer holds, a cut run header, and a run whose packets are cut. */
+    TUN_MUX_RUN *first = (TUN_MUX_RUN *)Buffer;
+    ULONG size = first->Size;
+    first->Size = writer.Used;
+    TunExchReaderInit(&reader, Buffer, writer.Used);
+    CHECK(!TunExchMuxReaderNext(&reader, &packets));
+    first->Size = size;
+    TunExchReaderInit(&reader, Buffer, sizeof(TUN_MUX_RUN) - 1);
+    CHECK(!TunExchMuxReaderNext(&reader, &packets));
+    TunExchReaderInit(&reader, Buffer, sizeof(TUN_MUX_RUN) + size - 1);
+    CHECK(!TunExchMuxReaderNext(&reader, &packets));
+    first->Size = size - TUN_EXCH_ALIGNMENT;
+    TunExchReaderInit(&reader, Buffer, writer.Used);
+    CHECK((header = TunExchMuxReaderNext(&reader, &packets)) != NULL);
+    CHECK(header && !TunExchValidate(packets.Next, header->Size, NULL));
+    first->Size = size;
+
+    /* A bundle without room for a run header refuses to start one. */
+    TunExchWriterInit(&writer, Buffer, sizeof(TUN_MUX_RUN) - 1);
+    CHECK(!TunExchMuxWriterBegin(&writer, 1, &run) && writer.Used == 0);
+}
+
+/* Flips, overwrites and cuts bytes of valid bundles, and holds the validators to the reference on the result. */
+static void
+TestSubmitWriteSlots(void)
+{
+    ULONG first = 0, last = 0;
+    TUN_SUBMIT_WRITE write = { 0, 1 };
+    CHECK(TunSubmitWriteSlots(&write, 4096, 4, &first, &last) && first == 0 && last == 0);
+    write = (TUN_SUBMIT_WRITE){ 4096, 8192 };
+    CHECK(TunSubmitWriteSlots(&write, 4096, 4, &first, &last) && first == 1 && last == 2);
+    write = (TUN_SUBMIT_WRITE){ 4096, 8193 };
+    CHECK(TunSubmitWriteSlots(&write, 4096, 4, &first, &last) && first == 1 && last == 3);
+    write = (TUN_SUBMIT_WRITE){ 12288, 4096 };
+    CHECK(TunSubmitWriteSlots(&write, 4096, 4, &first, &last) && first == 3 && last == 3);
+
+    write = (TUN_SUBMIT_WRITE){ 4096, 0 };
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 4, &first, &last));
+    write = (TUN_SUBMIT_WRITE){ 4000, 16 };
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 4, &first, &last));
+    write = (TUN_SUBMIT_WRITE){ 12288, 4097 };
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 4, &first, &last));
+    write = (TUN_SUBMIT_WRITE){ 16384, 1 };
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 4, &first, &last));
+    write = (TUN_SUBMIT_WRITE){ 0xfffff000, 0x2000 }; /* Wraps around */
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 4, &first, &last));
+    write = (TUN_SUBMIT_WRITE){ 0, 1 }; /* Nothing mapped yet */
+    CHECK(!TunSubmitWriteSlots(&write, 4096, 0, &first, &last));
+}
+
+static void
+TestFuzz(LONG Format, ULONG Rounds)
+{
+    for (ULONG round = 0; round < Rounds; ++round)
+    {
+        TUN_EXCH_WRITER writer;
+        TunExchWriterInit(&writer, Buffer, 512 + TestRandom() % 4096);
+        for (UCHAR *data;;)
+        {
+            UCHAR version = TestRandom() % 2 ? 4 : 6;
+            ULONG size = RandomSize(version, 300);
+            data = Format == TUN_EXCH_FORMAT_V2 ? TunExchV2WriterReserve(&writer, size, 0)
+                                                : TunExchWriterReserve(&writer, size, 0);
+            if (!data)
+                break;
+            FillPacket(data, size, version, round);
+        }
+        ULONG size = writer.Used;
+        for (ULONG mutations = 1 + TestRandom() % 4; mutations--;)
+        {
+            switch (TestRandom() % 4)
+            {
+            case 0:
+                Buffer[TestRandom() % writer.Used] ^= (UCHAR)(1 << TestRandom() % 8);
+                break;
+            case 1:
+                Buffer[TestRandom() % writer.Used] = (UCHAR)TestRandom();
+                break;
+            case 2:
+                size = TestRandom() % (writer.Used + 1);
+                break;
+            case 3: {
+                /* Hit a size field on purpose, as those are what the walk depends on. */
+                ULONG at = (TestRandom() % writer.Used) & ~(ULONG)(TUN_EXCH_V2_ALIGNMENT - 1);
+                Buffer[at] = (UCHAR)TestRandom();
+                break;
+            }
+            }
+        }
+        UCHAR *copy = TestExactCopy(Buffer, size);
+        ULONG count = 0, expected;
+        BOOLEAN valid = Format == TUN_EXCH_FORMAT_V2 ? TunExchV2Validate(copy, size, &count)
+                                                     : TunExchValidate(copy, size, &count);
+        CHECK(valid == ReferenceValidate(copy, size, Format, &expected));
+        CHECK(!valid || count == expected);
+        if (Format == TUN_EXCH_FORMAT_V1)
+        {
+            TUN_EXCH_READER reader;
+            const TUN_PACKET *p;
+            TunExchReaderInit(&reader, copy, size);
+            while ((p = TunExchReaderNext(&reader)) != NULL)
+                CHECK((const UCHAR *)p->Data + p->Size <= copy + size);
+            CHECK(reader.Next <= copy + size);
+        }
+        else
+        {
+            /* The same bytes as a v2 read buffer, which ends in an index instead. */
+            const ULONG *index = TunExchV2Index(copy, size & ~(ULONG)(sizeof(ULONG) - 1), &count);
+            for (ULONG i = 0; index && i < count; ++i)
+            {
+                const TUN_PACKET_V2 *p = TunExchV2Packet(copy, index, index[i]);
+                CHECK(!p || (const UCHAR *)p->Data + p->Size <= (const UCHAR *)index);
+            }
+        }
+        free(copy);
+    }
+}
+
+static void
+Bench(void)
+{
+    TUN_EXCH_WRITER writer;
+    ULONG count = 0, sizes[] = { 40, 576, 1420 };
+    for (ULONG s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (LONG format = TUN_EXCH_FORMAT_V1; format <= TUN_EXCH_FORMAT_V2; ++format)
+        {
+            ULONG rounds = 2000, n = 0;
+            double start = TestNow();
+            for (ULONG i = 0; i < rounds; ++i)
+            {
+                TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+                for (UCHAR *data; (data = format == TUN_EXCH_FORMAT_V2
+                                              ? TunExchV2WriterReserve(&writer, sizes[s], 0)
+                                              : TunExchWriterReserve(&writer, sizes[s], 0)) != NULL;)
+                    data[0] = 0x45;
+            }
+            double pack = (TestNow() - start) / rounds / writer.Count;
+            start = TestNow();
+            for (ULONG i = 0; i < rounds; ++i)
+                n += format == TUN_EXCH_FORMAT_V2 ? TunExchV2Validate(Buffer, writer.Used, &count)
+                                                  : TunExchValidate(Buffer, writer.Used, &count);
+            double validate = (TestNow() - start) / rounds / writer.Count;
+            CHECK(n == rounds && count == writer.Count);
+            printf(
+                "v%d %4u-byte packets, %6u per buffer: pack %6.2f ns/packet, validate %6.2f ns/packet\n",
+                (int)format,
+                (unsigned)sizes[s],
+                (unsigned)writer.Count,
+                pack,
+                validate);
+        }
+    }
+
+    /* Mux runs of 32 packets, walked run by run and packet by packet. */
+    ULONG run, packets = 0, rounds = 2000;
+    TunExchWriterInit(&writer, Buffer, sizeof(Buffer));
+    for (ULONG luid_index = 0; TunExchMuxWriterBegin(&writer, luid_index, &run); ++luid_index)
+    {
+        for (ULONG i = 0; i < 32 && TunExchWriterReserve(&writer, 40, 0); ++i)
+            ++packets;
+        TunExchMuxWriterEnd(&writer, run);
+        if (writer.Used == run)
+            break;
+    }
+    double start = TestNow();
+    ULONG walked = 0;
+    for (ULONG i = 0; i < rounds; ++i)
+    {
+        TUN_EXCH_READER reader, run_reader;
+        TunExchReaderInit(&reader, Buffer, writer.Used);
+        while (TunExchMuxReaderNext(&reader, &run_reader))
+        {
+            while (TunExchReaderNext(&run_reader))
+                ++walked;
+        }
+    }
+    CHECK(walked == packets * rounds);
+    printf("mux 40-byte packets in runs of 32: walk %6.2f ns/packet\n", (TestNow() - start) / rounds / packets);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        Bench();
+        return TestReport("exch bench");
+    }
+    TestV1RoundTrip();
+    TestV1Invalid();
+    TestV2RoundTrip();
+    TestMuxRoundTrip();
+    TestTruncated(TUN_EXCH_FORMAT_V1);
+    TestTruncated(TUN_EXCH_FORMAT_V2);
+    TestMisaligned();
+    TestSubmitWriteSlots();
+    TestFuzz(TUN_EXCH_FORMAT_V1, 20000);
+    TestFuzz(TUN_EXCH_FORMAT_V2, 20000);
+    return TestReport("exch");
+}
@@ -0,0 +1,627 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Runs the packet classification, filtering and receive batching of packet.h against hand-built and fuzzed packets and
+ * simulated writers. */
+
+#include "../packet.h"
+#include "test.h"
+
+#define INSN(code, jt, jf, k) \
+    { \
+        (USHORT)(code), (UCHAR)(jt), (UCHAR)(jf), (ULONG)(k) \
+    }
+
+/* Builds an IPv4 TCP segment with IHL 5 + Options words, and returns its size. */
+static ULONG
+BuildTcp4(UCHAR *Packet, ULONG Options, USHORT DstPort, ULONG Payload)
+{
+    ULONG ihl = 20 + Options * 4, size = ihl + 20 + Payload;
+    memset(Packet, 0, size);
+    Packet[0] = (UCHAR)(0x40 | (5 + Options));
+    Packet[2] = (UCHAR)(size >> 8);
+    Packet[3] = (UCHAR)size;
+    Packet[8] = 64;
+    Packet[9] = 6;
+    memcpy(Packet + 12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+    Packet[ihl] = 0x12;
+    Packet[ihl + 1] = 0x34;
+    Packet[ihl + 2] = (UCHAR)(DstPort >> 8);
+    Packet[ihl + 3] = (UCHAR)DstPort;
+    Packet[ihl + 12] = 5 << 4;
+    Packet[ihl + 13] = 0x10;
+    return size;
+}
+
+/* ip proto tcp and not a later fragment and tcp dst port 22, as tcpdump compiles it for raw IP. */
+static const TUN_FILTER_INSN Ssh[] = {
+    INSN(TUN_BPF_LD | TUN_BPF_B | TUN_BPF_ABS, 0, 0, 9),
+    INSN(TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_K, 0, 6, 6),
+    INSN(TUN_BPF_LD | TUN_BPF_H | TUN_BPF_ABS, 0, 0, 6),
+    INSN(TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_K, 4, 0, 0x1fff),
+    INSN(TUN_BPF_LDX | TUN_BPF_B | TUN_BPF_MSH, 0, 0, 0),
+    INSN(TUN_BPF_LD | TUN_BPF_H | TUN_BPF_IND, 0, 0, 2),
+    INSN(TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_K, 0, 1, 22),
+    INSN(TUN_BPF_RET | TUN_BPF_K, 0, 0, 0xffff),
+    INSN(TUN_BPF_RET | TUN_BPF_K, 0, 0, 0),
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static void
+TestFilterRun(void)
+{
+    UCHAR packet[128];
+    ULONG size, pc;
+    CHECK(TunFilterValidate(Ssh, COUNT(Ssh)));
+
+    size = BuildTcp4(packet, 0, 22, 10);
+    CHECK(TunFilterRun(Ssh, packet, size, size, &pc) == 0xffff && pc == 7);
+    size = BuildTcp4(packet, 3, 22, 0);
+    CHECK(TunFilterRun(Ssh, packet, size, size, &pc) == 0xffff && pc == 7);
+    size = BuildTcp4(packet, 0, 80, 10);
+    CHECK(TunFilterRun(Ssh, packet, size, size, &pc) == 0 && pc == 8);
+    packet[9] = 17;
+    CHECK(TunFilterRun(Ssh, packet, size, size, &pc) == 0 && pc == 8);
+    size = BuildTcp4(packet, 0, 22, 10);
+    packet[7] = 1; /* Fragment offset */
+    CHECK(TunFilterRun(Ssh, packet, size, size, &pc) == 0 && pc == 8);
+    packet[7] = 0;
+
+    /* Loads past what the driver could copy of the packet drop it, blaming the load. */
+    CHECK(TunFilterRun(Ssh, packet, 23, size, &pc) == 0 && pc == 5);
+    CHECK(TunFilterRun(Ssh, packet, 9, size, &pc) == 0 && pc == 0);
+    CHECK(TunFilterRun(Ssh, packet, 0, size, &pc) == 0 && pc == 0);
+
+    /* The length is the packet's, not the part of it that was copied. */
+    static const TUN_FILTER_INSN len[] = {
+        INSN(TUN_BPF_LD | TUN_BPF_W | TUN_BPF_LEN, 0, 0, 0),
+        INSN(TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_K, 0, 1, 1000),
+        INSN(TUN_BPF_RET | TUN_BPF_A, 0, 0, 0),
+        INSN(TUN_BPF_RET | TUN_BPF_K, 0, 0, 0),
+    };
+    CHECK(TunFilterValidate(len, COUNT(len)));
+    CHECK(TunFilterRun(len, packet, size, 1500, &pc) == 1500 && pc == 2);
+    CHECK(TunFilterRun(len, packet, size, 1000, &pc) == 0 && pc == 3);
+
+    /* Scratch memory, X, shifts past the word, negation and division by a zero X. */
+    static const TUN_FILTER_INSN alu[] = {
+        INSN(TUN_BPF_LD | TUN_BPF_IMM, 0, 0, 7),
+        INSN(TUN_BPF_ST, 0, 0, 15),
+        INSN(TUN_BPF_LDX | TUN_BPF_MEM, 0, 0, 15),
+        INSN(TUN_BPF_ALU | TUN_BPF_MUL | TUN_BPF_X, 0, 0, 0),
+        INSN(TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_K, 0, 0, 40),
+        INSN(TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_X, 0, 0, 0),
+        INSN(TUN_BPF_ALU | TUN_BPF_NEG, 0, 0, 0),
+        INSN(TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_K, 0, 0, 1000),
+        INSN(TUN_BPF_MISC | TUN_BPF_TAX, 0, 0, 0),
+        INSN(TUN_BPF_LD | TUN_BPF_MEM, 0, 0, 0),
+        INSN(TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_X, 0, 0, 0),
+        INSN(TUN_BPF_RET | TUN_BPF_A, 0, 0, 0),
+    };
+    CHECK(TunFilterValidate(alu, COUNT(alu)));
+    CHECK(TunFilterRun(alu, packet, size, size, &pc) == 0 && pc == 11);
+    TUN_FILTER_INSN div_zero[COUNT(alu)];
+    memcpy(div_zero, alu, sizeof(alu));
+    div_zero[8] = (TUN_FILTER_INSN)INSN(TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_IMM, 0, 0, 0);
+    CHECK(TunFilterRun(div_zero, packet, size, size, &pc) == 0 && pc == 10);
+    div_zero[10] = (TUN_FILTER_INSN)INSN(TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_K, 0, 0, 3);
+    div_zero[9] = (TUN_FILTER_INSN)INSN(TUN_BPF_MISC | TUN_BPF_TXA, 0, 0, 0);
+    div_zero[8] = (TUN_FILTER_INSN)INSN(TUN_BPF_MISC | TUN_BPF_TAX, 0, 0, 0);
+    /* 7 * 7, shifted out, plus 7, negated, is 2^32 - 7, which is 289 modulo 1000, and a third of that 96. */
+    CHECK(TunFilterRun(div_zero, packet, size, size, &pc) == 96 && pc == 11);
+}
+
+static void
+TestFilterValidate(void)
+{
+    TUN_FILTER_INSN prog[TUN_FILTER_MAX_INSNS + 1];
+    for (ULONG i = 0; i < COUNT(prog); ++i)
+        prog[i] = (TUN_FILTER_INSN)INSN(TUN_BPF_RET | TUN_BPF_K, 0, 0, 1);
+    CHECK(!TunFilterValidate(prog, 0));
+    CHECK(TunFilterValidate(prog, TUN_FILTER_MAX_INSNS));
+    CHECK(!TunFilterValidate(prog, TUN_FILTER_MAX_INSNS + 1));
+
+    static const struct
+    {
+        TUN_FILTER_INSN Insn;
+        BOOLEAN Valid;
+    } cases[] = {
+        { INSN(TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_K, 0, 0, 0), FALSE },
+        { INSN(TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_K, 0, 0, 0), FALSE },
+        { INSN(TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_K, 0, 0, 1), TRUE },
+        { INSN(TUN_BPF_ST, 0, 0, TUN_FILTER_MEMWORDS), FALSE },
+        { INSN(TUN_BPF_LDX | TUN_BPF_MEM, 0, 0, TUN_FILTER_MEMWORDS - 1), TRUE },
+        { INSN(TUN_BPF_LD | TUN_BPF_MEM, 0, 0, 0x80000000), FALSE },
+        { INSN(TUN_BPF_JMP | TUN_BPF_JA, 0, 0, 1), TRUE },
+        { INSN(TUN_BPF_JMP | TUN_BPF_JA, 0, 0, 2), FALSE },
+        { INSN(TUN_BPF_JMP | TUN_BPF_JA, 0, 0, 0xffffffff), FALSE },
+        { INSN(TUN_BPF_JMP | TUN_BPF_JEQ | TUN_BPF_K, 1, 0, 0), TRUE },
+        { INSN(TUN_BPF_JMP | TUN_BPF_JGT | TUN_BPF_X, 0, 2, 0), FALSE },
+        { INSN(TUN_BPF_LD | TUN_BPF_W | TUN_BPF_MSH, 0, 0, 0), FALSE },
+        { INSN(TUN_BPF_ALU | 0xb0 | TUN_BPF_K, 0, 0, 1), FALSE },
+        { INSN(0xffff, 0, 0, 0), FALSE },
+    };
+    /* Each case goes first in a program of three, so that two instructions follow it. */
+    for (ULONG i = 0; i < COUNT(cases); ++i)
+    {
+        prog[0] = cases[i].Insn;
+        CHECK(TunFilterValidate(prog, 3) == cases[i].Valid);
+    }
+
+    /* Every path must end in a return. */
+    prog[0] = (TUN_FILTER_INSN)INSN(TUN_BPF_RET | TUN_BPF_K, 0, 0, 1);
+    prog[1] = (TUN_FILTER_INSN)INSN(TUN_BPF_LD | TUN_BPF_IMM, 0, 0, 1);
+    CHECK(!TunFilterValidate(prog, 2));
+}
+
+/* Random programs, of which those TunFilterValidate accepts must run to a return on any packet, within its bounds. */
+static void
+TestFilterFuzz(ULONG Rounds)
+{
+    static const USHORT codes[] = {
+        TUN_BPF_LD | TUN_BPF_W | TUN_BPF_ABS,    TUN_BPF_LD | TUN_BPF_H | TUN_BPF_IND,
+        TUN_BPF_LD | TUN_BPF_B | TUN_BPF_ABS,    TUN_BPF_LD | TUN_BPF_W | TUN_BPF_LEN,
+        TUN_BPF_LD | TUN_BPF_MEM,                TUN_BPF_LDX | TUN_BPF_B | TUN_BPF_MSH,
+        TUN_BPF_LDX | TUN_BPF_W | TUN_BPF_IMM,   TUN_BPF_ST,
+        TUN_BPF_STX,                             TUN_BPF_ALU | TUN_BPF_ADD | TUN_BPF_X,
+        TUN_BPF_ALU | TUN_BPF_DIV | TUN_BPF_X,   TUN_BPF_ALU | TUN_BPF_MOD | TUN_BPF_K,
+        TUN_BPF_ALU | TUN_BPF_LSH | TUN_BPF_X,   TUN_BPF_ALU | TUN_BPF_RSH | TUN_BPF_K,
+        TUN_BPF_ALU | TUN_BPF_NEG,               TUN_BPF_JMP | TUN_BPF_JA,
+        TUN_BPF_JMP | TUN_BPF_JGE | TUN_BPF_X,   TUN_BPF_JMP | TUN_BPF_JSET | TUN_BPF_K,
+        TUN_BPF_MISC | TUN_BPF_TAX,              TUN_BPF_RET | TUN_BPF_A,
+    };
+    UCHAR packet[TUN_FILTER_MAX_BYTES];
+    ULONG accepted = 0;
+    for (ULONG round = 0; round < Rounds; ++round)
+    {
+        TUN_FILTER_INSN prog[TUN_FILTER_MAX_INSNS];
+        ULONG count = 1 + TestRandom() % TUN_FILTER_MAX_INSNS, pc;
+        for (ULONG i = 0; i < count; ++i)
+        {
+            prog[i].Code = codes[TestRandom() % COUNT(codes)];
+            prog[i].Jt = (UCHAR)(TestRandom() % 4);
+            prog[i].Jf = (UCHAR)(TestRandom() % 4);
+            prog[i].K = TestRandom() % 8 ? TestRandom() % 40 : TestRandom();
+        }
+        prog[count - 1].Code = TUN_BPF_RET | TUN_BPF_A;
+        if (!TunFilterValidate(prog, count))
+            continue;
+        ++accepted;
+        ULONG size = TestRandom() % (sizeof(packet) + 1);
+        for (ULONG i = 0; i < size; ++i)
+            packet[i] = (UCHAR)TestRandom();
+        UCHAR *copy = TestExactCopy(packet, size);
+        TunFilterRun(prog, copy, size, size + TestRandom() % 1000, &pc);
+        CHECK(pc < count);
+        free(copy);
+    }
+    CHECK(accepted > Rounds / 100);
+}
+
+static void
+TestLanes(void)
+{
+    static const TUN_LANE_ID expected[8] = { TUN_LANE_NORMAL, TUN_LANE_LOW,  TUN_LANE_NORMAL, TUN_LANE_NORMAL,
+                                             TUN_LANE_NORMAL, TUN_LANE_HIGH, TUN_LANE_HIGH,   TUN_LANE_HIGH };
+    for (UCHAR priority = 0; priority < 8; ++priority)
+        CHECK(TunLaneOfPriority(priority) == expected[priority]);
+
+    UCHAR ip[2] = { 0x45, 0xb8 }; /* DSCP EF */
+    CHECK(TunIpPrecedence(ip) == 5);
+    ip[1] = 0x20; /* CS1 */
+    CHECK(TunIpPrecedence(ip) == 1 && TunLaneOfPriority(TunIpPrecedence(ip)) == TUN_LANE_LOW);
+    ip[1] = 0x48; /* AF21 */
+    CHECK(TunIpPrecedence(ip) == 2 && TunLaneOfPriority(TunIpPrecedence(ip)) == TUN_LANE_NORMAL);
+    ip[0] = 0x6b; /* Traffic class EF, spanning both bytes */
+    ip[1] = 0x80;
+    CHECK(TunIpPrecedence(ip) == 5);
+    ip[0] = 0x62;
+    ip[1] = 0x00;
+    CHECK(TunIpPrecedence(ip) == 1);
+    ip[0] = 0x5f;
+    CHECK(TunIpPrecedence(ip) == 0);
+
+    LONG num_nbl[TUN_LANE_COUNT] = { 0 }, max_nbls[TUN_LANE_COUNT] = { 2, 8, 8 };
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 0, 8) == TUN_LANE_COUNT);
+    /* A lane over its own limit drops first, even with the queue as a whole not full. */
+    num_nbl[TUN_LANE_HIGH] = 3;
+    num_nbl[TUN_LANE_LOW] = 1;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 4, 8) == TUN_LANE_HIGH);
+    num_nbl[TUN_LANE_HIGH] = 2;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 3, 8) == TUN_LANE_COUNT);
+    /* A full queue drops the least important lane that is not empty. */
+    num_nbl[TUN_LANE_NORMAL] = 6;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 9, 8) == TUN_LANE_LOW);
+    num_nbl[TUN_LANE_LOW] = 0;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 9, 8) == TUN_LANE_NORMAL);
+    num_nbl[TUN_LANE_NORMAL] = 0;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 9, 8) == TUN_LANE_HIGH);
+    /* NBLs still being copied out count towards the total, but cannot be dropped. */
+    num_nbl[TUN_LANE_HIGH] = 0;
+    CHECK(TunLaneToDrop(num_nbl, max_nbls, 9, 8) == TUN_LANE_COUNT);
+}
+
+/* Queues a copy of Size bytes filled with Tag, returning FALSE if the ring is full. */
+static int
+PushCopy(TUN_COPY_RING *Ring, ULONG Size, UCHAR Tag)
+{
+    TUN_PACKET_COPY *copy = TunCopyRingReserve(Ring, Size);
+    if (!copy)
+        return 0;
+    CHECK((UCHAR *)copy >= Ring->Buffer && (UCHAR *)copy + TunCopyFootprint(Size) <= Ring->Buffer + Ring->Size);
+    memset(copy->Data, Tag, Size);
+    copy->Size = copy->OriginalSize = Size;
+    TunCopyRingCommit(Ring, copy);
+    return 1;
+}
+
+/* Dequeues the oldest copy, checking it is the one of Size bytes filled with Tag. */
+static void
+PopCopy(TUN_COPY_RING *Ring, ULONG Size, UCHAR Tag)
+{
+    TUN_PACKET_COPY *copy = TunCopyRingFirst(Ring);
+    CHECK(copy && copy->Size == Size);
+    if (!copy || copy->Size != Size)
+        return;
+    for (ULONG i = 0; i < Size; ++i)
+        CHECK(copy->Data[i] == Tag);
+    TunCopyRingPop(Ring);
+}
+
+static void
+TestCopyRing(void)
+{
+    ULONG footprint = TunCopyFootprint(100);
+    UCHAR *buffer = malloc(3 * footprint);
+    TUN_COPY_RING ring;
+    TunCopyRingInit(&ring, buffer, 3 * footprint, 10);
+    CHECK(!TunCopyRingFirst(&ring));
+
+    /* Filled to the last byte, */
+    CHECK(PushCopy(&ring, 100, 1) && PushCopy(&ring, 100, 2) && PushCopy(&ring, 100, 3));
+    CHECK(!PushCopy(&ring, 1, 4));
+    /* then only going round once that leaves a gap before the oldest, */
+    PopCopy(&ring, 100, 1);
+    CHECK(!PushCopy(&ring, 100, 4));
+    CHECK(PushCopy(&ring, 90, 4));
+    CHECK(!PushCopy(&ring, 1, 5));
+    PopCopy(&ring, 100, 2);
+    CHECK(PushCopy(&ring, 1, 5));
+    /* and handed out in order across the wrap. */
+    PopCopy(&ring, 100, 3);
+    PopCopy(&ring, 90, 4);
+    CHECK(PushCopy(&ring, 100, 6));
+    PopCopy(&ring, 1, 5);
+    PopCopy(&ring, 100, 6);
+    CHECK(!TunCopyRingFirst(&ring) && ring.Head == 0 && ring.Tail == 0);
+
+    /* The count limits it too. */
+    TunCopyRingInit(&ring, buffer, 3 * footprint, 2);
+    CHECK(PushCopy(&ring, 1, 1) && PushCopy(&ring, 1, 2) && !PushCopy(&ring, 1, 3));
+    PopCopy(&ring, 1, 1);
+    CHECK(PushCopy(&ring, 1, 3));
+    free(buffer);
+}
+
+/* Checks the ring against a plain FIFO under random traffic, in a buffer the sanitizers guard exactly. */
+static void
+TestCopyRingFuzz(unsigned Iterations)
+{
+    enum
+    {
+        MaxSize = 300,
+        MaxCount = 64
+    };
+    struct
+    {
+        ULONG Size;
+        UCHAR Tag;
+    } fifo[MaxCount];
+    unsigned first = 0, count = 0;
+    ULONG size = TunCopyFootprint(MaxSize) + TestRandom() % (4 * TunCopyFootprint(MaxSize));
+    UCHAR *buffer = malloc(size);
+    TUN_COPY_RING ring;
+    TunCopyRingInit(&ring, buffer, size, MaxCount);
+
+    for (unsigned i = 0; i < Iterations; ++i)
+    {
+        if (TestRandom() % 2)
+        {
+            ULONG p_size = 1 + TestRandom() % MaxSize, used = 0;
+            UCHAR tag = (UCHAR)i;
+            for (unsigned j = 0; j < count; ++j)
+                used += TunCopyFootprint(fifo[(first + j) % MaxCount].Size);
+            if (PushCopy(&ring, p_size, tag))
+            {
+                CHECK(count < MaxCount && used + TunCopyFootprint(p_size) <= size);
+                fifo[(first + count) % MaxCount].Size = p_size;
+                fifo[(first + count++) % MaxCount].Tag = tag;
+            }
+            else
+                CHECK(count); /* An empty ring always fits a copy. */
+        }
+        else if (count)
+        {
+            PopCopy(&ring, fifo[first].Size, fifo[first].Tag);
+            first = (first + 1) % MaxCount;
+            --count;
+        }
+        else
+            CHECK(!TunCopyRingFirst(&ring));
+        CHECK(ring.Count == (LONG)count);
+    }
+    free(buffer);
+}
+
+/* Builds a pure IPv6 ACK from port Port, and returns its size. */
+static ULONG
+BuildAck6(UCHAR *Packet, USHORT Port, ULONG Ack)
+{
+    memset(Packet, 0, 60);
+    Packet[0] = 0x60;
+    Packet[5] = 20;
+    Packet[6] = 6;
+    Packet[7] = 64;
+    Packet[23] = 1;
+    Packet[39] = 2;
+    Packet[40] = (UCHAR)(Port >> 8);
+    Packet[41] = (UCHAR)Port;
+    Packet[43] = 22;
+    Packet[48] = (UCHAR)(Ack >> 24);
+    Packet[49] = (UCHAR)(Ack >> 16);
+    Packet[50] = (UCHAR)(Ack >> 8);
+    Packet[51] = (UCHAR)Ack;
+    Packet[52] = 5 << 4;
+    Packet[53] = 0x10;
+    return 60;
+}
+
+static void
+TestChecksumProtocol(void)
+{
+    UCHAR packet[128];
+    BuildTcp4(packet, 0, 22, 10);
+    CHECK(TunIpChecksumProtocol(packet) == TUN_IPPROTO_TCP);
+    packet[9] = TUN_IPPROTO_UDP;
+    CHECK(TunIpChecksumProtocol(packet) == TUN_IPPROTO_UDP);
+    packet[6] = 0x40; /* Don't fragment */
+    CHECK(TunIpChecksumProtocol(packet) == TUN_IPPROTO_UDP);
+    packet[6] = 0x20; /* More fragments, in the first fragment */
+    CHECK(TunIpChecksumProtocol(packet) == 0);
+    packet[6] = 0;
+    packet[7] = 1; /* Last fragment */
+    CHECK(TunIpChecksumProtocol(packet) == 0);
+    packet[6] = 0x01;
+    packet[7] = 0;
+    CHECK(TunIpChecksumProtocol(packet) == 0);
+
+    BuildAck6(packet, 1000, 1);
+    CHECK(TunIpChecksumProtocol(packet) == TUN_IPPROTO_TCP);
+    packet[6] = 44; /* Fragment header */
+    CHECK(TunIpChecksumProtocol(packet) == 44);
+}
+
+static void
+TestAckClassify(void)
+{
+    UCHAR packet[128], key[TUN_ACK_KEY_SIZE], key_size, other_key[TUN_ACK_KEY_SIZE], other_key_size;
+    ULONG size, ack;
+
+    size = BuildTcp4(packet, 0, 22, 0);
+    packet[28] = 0x12;
+    packet[31] = 0x78;
+    CHECK(TunAckClassify(packet, size, key, &key_size, &ack) && key_size == 12 && ack == 0x12000078);
+    CHECK(!memcmp(key, packet + 12, 8) && !memcmp(key + 8, packet + 20, 4));
+    size = BuildTcp4(packet, 2, 22, 0);
+    CHECK(TunAckClassify(packet, size, other_key, &other_key_size, &ack) && other_key_size == 12);
+    CHECK(!memcmp(key, other_key, key_size));
+
+    /* Anything more than an acknowledgment is not a pure ACK. */
+    size = BuildTcp4(packet, 0, 22, 1);
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    size = BuildTcp4(packet, 0, 22, 0);
+    packet[33] = 0x18; /* PSH */
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[33] = 0x11; /* FIN */
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[33] = 0x10;
+    packet[32] = 6 << 4; /* TCP options, e.g. SACK blocks */
+    CHECK(!TunAckClassify(packet, size + 4, key, &key_size, &ack));
+    packet[32] = 5 << 4;
+    packet[6] = 0x20; /* More fragments */
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[6] = 0;
+    packet[9] = 17;
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[9] = 6;
+    packet[3] = 41; /* Total length off from the packet's */
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[3] = 40;
+    CHECK(TunAckClassify(packet, size, key, &key_size, &ack));
+    CHECK(!TunAckClassify(packet, size - 1, key, &key_size, &ack));
+
+    size = BuildAck6(packet, 1000, 0xdeadbeef);
+    CHECK(TunAckClassify(packet, size, key, &key_size, &ack) && key_size == 36 && ack == 0xdeadbeef);
+    CHECK(!memcmp(key, packet + 8, 32) && !memcmp(key + 32, packet + 40, 4));
+    packet[6] = 0; /* A hop-by-hop options header in front of TCP */
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[6] = 6;
+    packet[5] = 21;
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+    packet[5] = 20;
+    packet[0] = 0x50;
+    CHECK(!TunAckClassify(packet, size, key, &key_size, &ack));
+}
+
+/* Classifies and records an IPv6 ACK, and returns the ACK it supersedes. */
+static VOID *
+RecordAck6(TUN_ACK_FLOW *Flows, VOID *Nbl, UCHAR Lane, USHORT Port, ULONG Ack, TUN_ACK_FLOW **Flow)
+{
+    UCHAR packet[60], key[TUN_ACK_KEY_SIZE], key_size;
+    ULONG ack;
+    VOID *superseded = (VOID *)&superseded;
+    CHECK(TunAckClassify(packet, BuildAck6(packet, Port, Ack), key, &key_size, &ack) && ack == Ack);
+    TUN_ACK_FLOW *flow = TunAckRecord(Flows, Nbl, Lane, key, key_size, ack, &superseded);
+    CHECK(flow >= Flows && flow < Flows + TUN_ACK_FLOWS && flow->Nbl == Nbl);
+    if (Flow)
+        *Flow = flow;
+    return superseded;
+}
+
+static void
+TestAckRecord(void)
+{
+    static TUN_ACK_FLOW flows[TUN_ACK_FLOWS];
+    int nbls[16];
+    TUN_ACK_FLOW *flow;
+
+    /* Two identical ACKs are duplicates the sender counts, so both stay. */
+    CHECK(RecordAck6(flows, &nbls[0], 1, 1000, 100, NULL) == NULL);
+    CHECK(RecordAck6(flows, &nbls[1], 1, 1000, 100, NULL) == NULL);
+    CHECK(RecordAck6(flows, &nbls[2], 1, 1000, 100, NULL) == NULL);
+    /* A newer one supersedes the latest of them only, and is superseded in turn, across the wrap too. */
+    CHECK(RecordAck6(flows, &nbls[3], 1, 1000, 0x80000000, NULL) == &nbls[2]);
+    CHECK(RecordAck6(flows, &nbls[4], 1, 1000, 0xfffffff0, NULL) == &nbls[3]);
+    CHECK(RecordAck6(flows, &nbls[5], 1, 1000, 0x10, NULL) == &nbls[4]);
+    /* An older one, reordered, does not, nor does one of another lane, nor one of another flow. */
+    CHECK(RecordAck6(flows, &nbls[6], 1, 1000, 0x8, NULL) == NULL);
+    CHECK(RecordAck6(flows, &nbls[7], 2, 1000, 0x20, NULL) == NULL);
+    CHECK(RecordAck6(flows, &nbls[8], 2, 1001, 0x30, NULL) == NULL);
+    /* Nor does one whose predecessor already left the queue. */
+    CHECK(RecordAck6(flows, &nbls[9], 1, 2000, 1, &flow) == NULL);
+    flow->Nbl = NULL;
+    CHECK(RecordAck6(flows, &nbls[10], 1, 2000, 2, NULL) == NULL);
+
+    /* Flows that share an entry only evict each other. */
+    USHORT port = 3000;
+    TUN_ACK_FLOW *first;
+    CHECK(RecordAck6(flows, &nbls[11], 0, port, 1, &first) == NULL);
+    do
+        CHECK(RecordAck6(flows, &nbls[12], 0, ++port, 5, &flow) == NULL);
+    while (flow != first);
+    CHECK(RecordAck6(flows, &nbls[13], 0, 3000, 2, NULL) == NULL);
+    CHECK(RecordAck6(flows, &nbls[14], 0, 3000, 3, NULL) == &nbls[13]);
+}
+
+/* Interleaves Writers writers staging 1 to 8 NBLs at random with the indicator and the deadline as TunReceiveStage
+ * and its DPCs drive TunReceiveAction, checking that nothing staged is ever left without someone bound to indicate it.
+ * Returns the mean NBLs per indication. */
+static double
+SimulateReceive(unsigned Writers, unsigned Steps)
+{
+    enum
+    {
+        MaxWriters = 16
+    };
+    LONG building[MaxWriters] = { 0 }; /* NBLs a writer is building, 0 if it is idle */
+    LONG staged = 0, writers = 0, sent = 0, indicated = 0, indications = 0;
+    unsigned indicator = MaxWriters; /* The writer indicating, busy until done, or MaxWriters for a DPC */
+    BOOLEAN indicating = 0, armed = 0;
+    for (unsigned i = 0; i < Steps || writers || staged || indicating || armed; ++i)
+    {
+        unsigned event = TestRandom() % 8, w = TestRandom() % Writers;
+        if ((i >= Steps && event < 4 && !building[w]) || (indicating && w == indicator)) /* No new writes, or busy */
+            event = 4;
+        if (event < 4 && !building[w])
+        {
+            building[w] = 1 + TestRandom() % 8;
+            ++writers;
+        }
+        else if (event < 4)
+        {
+            --writers;
+            if (TestRandom() % 16) /* Fails otherwise */
+            {
+                BOOLEAN alone = !writers && !indicating;
+                staged += building[w];
+                sent += building[w];
+                TUN_RECEIVE_ACTION action = TunReceiveAction(staged, writers, indicating, armed);
+                CHECK(!alone || action == TUN_RECEIVE_INDICATE); /* Nobody else coming, so no waiting */
+                if (action == TUN_RECEIVE_INDICATE)
+                {
+                    indicating = 1;
+                    indicator = w;
+                }
+                armed |= action == TUN_RECEIVE_WAIT;
+            }
+            building[w] = 0;
+        }
+        else if (event < 7 && indicating)
+        {
+            if (staged)
+            {
+                indicated += staged;
+                ++indications;
+                staged = 0;
+            }
+            else
+                indicating = 0;
+        }
+        else if (armed && (event == 7 || i >= Steps))
+        {
+            armed = 0;
+            if (staged && !indicating)
+            {
+                indicating = 1;
+                indicator = MaxWriters;
+            }
+        }
+        CHECK(!staged || indicating || armed);
+    }
+    CHECK(indicated == sent && !armed);
+    return indications ? (double)indicated / indications : 0;
+}
+
+/* Uncontended writes are indicated on their own, and contended ones together. */
+static void
+TestReceiveBatching(void)
+{
+    CHECK(TunReceiveAction(1, 0, 0, 0) == TUN_RECEIVE_INDICATE);
+    CHECK(TunReceiveAction(1, 1, 0, 0) == TUN_RECEIVE_WAIT);
+    CHECK(TunReceiveAction(1, 1, 0, 1) == TUN_RECEIVE_LEAVE);
+    CHECK(TunReceiveAction(TUN_RECEIVE_BATCH_NBLS, 1, 0, 1) == TUN_RECEIVE_INDICATE);
+    CHECK(TunReceiveAction(TUN_RECEIVE_BATCH_NBLS, 0, 1, 0) == TUN_RECEIVE_LEAVE);
+    double alone = SimulateReceive(1, 100000), together = SimulateReceive(16, 100000);
+    CHECK(alone > 4 && alone < 5); /* One write of 4.5 NBLs on average each */
+    CHECK(together > 2 * alone);
+}
+
+static void
+Bench(void)
+{
+    UCHAR packet[128];
+    ULONG size = BuildTcp4(packet, 0, 22, 60), pc, rounds = 10000000, passed = 0;
+    double start = TestNow();
+    for (ULONG i = 0; i < rounds; ++i)
+    {
+        passed += !!TunFilterRun(Ssh, packet, size, size, &pc);
+    }
+    CHECK(passed == rounds);
+    printf("filter of %u instructions: %6.2f ns/packet\n", (unsigned)COUNT(Ssh), (TestNow() - start) / rounds);
+    for (unsigned writers = 1; writers <= 16; writers *= 2)
+        printf("receive batching, %2u writers: %6.2f NBLs/indication\n", writers, SimulateReceive(writers, 1000000));
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        Bench();
+        return TestReport("packet bench");
+    }
+    TestFilterValidate();
+    TestFilterRun();
+    TestFilterFuzz(200000);
+    TestLanes();
+    TestChecksumProtocol();
+    TestAckClassify();
+    TestAckRecord();
+    TestCopyRing();
+    TestCopyRingFuzz(200000);
+    TestReceiveBatching();
+    return TestReport("packet");
+}
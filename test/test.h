@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* A minimal harness for the host tests, which run the portable parts of the driver against in-memory buffers. */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned TestFailures;
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            ++TestFailures; \
+        } \
+    } while (0)
+
+/* Returns the number of failed checks, for main to exit with, after reporting them along with the program name. */
+static inline int
+TestReport(const char *Name)
+{
+    printf("%s: %s (%u failed checks)\n", Name, TestFailures ? "FAIL" : "ok", TestFailures);
+    return TestFailures ? 1 : 0;
+}
+
+/* Deterministic xorshift32, so that a failing fuzz run can be repeated. */
+static unsigned TestRandomState = 0x2545f491;
+
+static inline unsigned
+TestRandom(void)
+{
+    TestRandomState ^= TestRandomState << 13;
+    TestRandomState ^= TestRandomState >> 17;
+    TestRandomState ^= TestRandomState << 5;
+    return TestRandomState;
+}
+
+static inline double
+TestNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Copies Size bytes into a heap block of exactly that size, so that the sanitizers catch any read past the end. */
+static inline void *
+TestExactCopy(const void *Buffer, size_t Size)
+{
+    void *copy = malloc(Size ? Size : 1);
+    if (!copy)
+        abort();
+    memcpy(copy, Buffer, Size);
+    return copy;
+}
@@ -38,6 +38,14 @@ ZwQuerySystemInformation(
     ULONG SystemInformationLength,
     ULONG *ReturnLength);
 
+extern BOOLEAN
+ObFindHandleForObject(
+    PEPROCESS Process,
+    PVOID Object,
+    POBJECT_TYPE ObjectType,
+    POBJECT_HANDLE_INFORMATION MatchCriteria,
+    HANDLE *Handle);
+
 extern NDIS_HANDLE
 NdisWdfGetAdapterContextFromAdapterHandle(PVOID DeviceExtension);
 
@@ -12,6 +12,8 @@
 #include <bcrypt.h>
 #include <ntstrsafe.h>
 #include "undocumented.h"
+#include "wintun.h"
+#include "packet.h"
 
 #pragma warning(disable : 4100) /* unreferenced formal parameter */
 #pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
@@ -26,23 +28,21 @@
 
 #define TUN_VENDOR_NAME "Wintun Tunnel"
 #define TUN_VENDOR_ID 0xFFFFFF00
-#define TUN_LINK_SPEED 100000000000ULL /* 100gbps */
-
-/* Maximum number of full-sized exchange packets that can be exchanged in a single read/write. */
-#define TUN_EXCH_MAX_PACKETS 256
-/* Maximum exchange packet size - empirically determined by net buffer list (pool) limitations */
-#define TUN_EXCH_MAX_PACKET_SIZE 0xF000
-#define TUN_EXCH_ALIGNMENT 16 /* Memory alignment in exchange buffers */
-/* Maximum IP packet size (headers + payload) */
-#define TUN_EXCH_MAX_IP_PACKET_SIZE (TUN_EXCH_MAX_PACKET_SIZE - sizeof(TUN_PACKET))
-/* Maximum size of read/write exchange buffer */
-#define TUN_EXCH_MAX_BUFFER_SIZE (TUN_EXCH_MAX_PACKETS * TUN_EXCH_MAX_PACKET_SIZE)
-#define TUN_EXCH_MIN_BUFFER_SIZE_READ TUN_EXCH_MAX_PACKET_SIZE /* Minimum size of read exchange buffer */
-#define TUN_EXCH_MIN_BUFFER_SIZE_WRITE (sizeof(TUN_PACKET))    /* Minimum size of write exchange buffer */
-#define TUN_QUEUE_MAX_NBLS 1000
+#define TUN_LINK_SPEED 100000000000ULL /* 100gbps, default */
+
+#define TUN_QUEUE_MAX_NBLS 1000 /* Default */
+#define TUN_QUEUE_MAX_NBLS_LIMIT 0x10000
+#define TUN_PARK_MAX_BYTES 0x800000 /* Packet data kept over a pause, along with at most QueueMaxNbls packets */
+#define TUN_TAP_MAX_RING_SIZE 0x400000 /* Of the ring a tap's copies are queued in, however many it may queue */
+#define TUN_DEQUEUE_BATCH 32 /* NBs taken off the queue at once, to be copied with the lock released */
+#define TUN_EXCH_MIN_PACKET_SIZE TunPacketAlign(sizeof(TUN_PACKET) + 1280) /* Fits the IPv6 minimum MTU */
 #define TUN_MEMORY_TAG 'wtun'
 #define TUN_CSQ_INSERT_HEAD ((PVOID)TRUE)
 #define TUN_CSQ_INSERT_TAIL ((PVOID)FALSE)
+#define TUN_RSS_KEY_SIZE NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_1
+#define TUN_RSS_MAX_INPUT 36 /* IPv6 source and destination addresses followed by TCP ports */
+#define TUN_RSS_MAX_INDIRECTION 128
+#define TUN_RSS_HASH_TYPES (NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6)
 
 #if REG_DWORD == REG_DWORD_BIG_ENDIAN
 #    define TUN_HTONS(x) ((USHORT)(x))
@@ -56,59 +56,253 @@
 #    error "Unable to determine endianess"
 #endif
 
-typedef struct _TUN_PACKET
-{
-    ULONG Size; /* Size of packet data (TUN_EXCH_MAX_IP_PACKET_SIZE max) */
-    _Field_size_bytes_(Size) __declspec(align(TUN_EXCH_ALIGNMENT)) UCHAR Data[]; /* Packet data */
-} TUN_PACKET;
-
 typedef enum _TUN_FLAGS
 {
     TUN_FLAGS_RUNNING = 1 << 0, /* Toggles between paused and running state */
     TUN_FLAGS_PRESENT = 1 << 1, /* Toggles between removal pending and being present */
 } TUN_FLAGS;
 
+typedef enum _TUN_RX_CSUM
+{
+    TUN_RX_CSUM_IPV4 = 1 << 0,
+    TUN_RX_CSUM_TCP_IPV4 = 1 << 1,
+    TUN_RX_CSUM_UDP_IPV4 = 1 << 2,
+    TUN_RX_CSUM_TCP_IPV6 = 1 << 3,
+    TUN_RX_CSUM_UDP_IPV6 = 1 << 4,
+    TUN_RX_CSUM_ALL = TUN_RX_CSUM_IPV4 | TUN_RX_CSUM_TCP_IPV4 | TUN_RX_CSUM_UDP_IPV4 | TUN_RX_CSUM_TCP_IPV6 |
+                      TUN_RX_CSUM_UDP_IPV6
+} TUN_RX_CSUM;
+
+/* Per-adapter geometry, read from the adapter's registry key at initialization. The TUN_EXCH_* constants in wintun.h
+ * are the upper bounds. */
+typedef struct _TUN_CONFIG
+{
+    ULONG MaxPackets;      /* Full-sized exchange packets per read/write */
+    ULONG MaxPacketSize;   /* Exchange packet size, header included */
+    ULONG MaxIpPacketSize; /* MaxPacketSize less the header */
+    ULONG MaxBufferSize;   /* MaxPackets full-sized exchange packets */
+    ULONG QueueMaxNbls;    /* Transmit queue length before the oldest NBLs are dropped */
+    ULONG64 LinkSpeed;     /* bps */
+    BOOLEAN ParkOnPause;   /* Keep copies of queued packets across a pause rather than dropping them */
+    BOOLEAN AckFilter;     /* Let a queued pure TCP ACK be superseded by a newer one of the same flow */
+    BOOLEAN DeferSend;     /* Leave copying sent packets into reads to a DPC, rather than the sending thread */
+} TUN_CONFIG;
+
+typedef struct _TUN_RSS_STATE
+{
+    BOOLEAN Enabled;
+    ULONG HashInformation;
+    UCHAR Key[TUN_RSS_KEY_SIZE];
+    ULONG IndirectionTableSize;                      /* Number of entries, a power of two */
+    ULONG IndirectionTable[TUN_RSS_MAX_INDIRECTION]; /* Processor indices */
+
+    /* Toeplitz hash contribution of every byte value at every input position, so hashing a packet takes a single
+     * lookup per input byte instead of a pass over each of its bits. Must stay the last member. */
+    ULONG Toeplitz[TUN_RSS_MAX_INPUT][256];
+} TUN_RSS_STATE;
+
+typedef struct _TUN_RSS_QUEUE
+{
+    KDPC Dpc; /* Targeted at the processor this queue belongs to */
+    KSPIN_LOCK Lock;
+    NET_BUFFER_LIST *FirstNbl, *LastNbl;
+    LONG NumNbl;
+    struct _TUN_CTX *Ctx;
+} TUN_RSS_QUEUE;
+
+/* Per-processor state. The first cache line is only ever written by its own processor, at DISPATCH_LEVEL, on every
+ * rundown reference; the RSS queue is written by whichever processor queues to it, so it gets a line of its own. */
+typedef struct _TUN_CPU
+{
+    volatile LONG RundownReaders;
+    LONG64 ActiveNBLCount; /* May go negative when NBLs complete on a different processor than they started on */
+    DECLSPEC_CACHEALIGN TUN_RSS_QUEUE RssQueue;
+    KDPC DrainDpc; /* Drains the queue on this processor, for handles with affinity to it or whoever defers to it */
+} DECLSPEC_CACHEALIGN TUN_CPU;
+
+typedef struct _TUN_PACKET_COPIES
+{
+    TUN_PACKET_COPY *First, *Last;
+    LONG Count;
+    LONG Bytes; /* Of packet data */
+} TUN_PACKET_COPIES;
+
+/* NBLs done with, collected while locks are held, to be completed back to NDIS in a single call once they are not. */
+typedef struct _TUN_COMPLETED_NBLS
+{
+    NET_BUFFER_LIST *First, *Last;
+    LONG Count; /* Of those that were queued, each holding up a pause */
+} TUN_COMPLETED_NBLS;
+
+C_ASSERT(TUN_LANE_COUNT == TUN_PRIORITY_LANES);
+
+typedef struct _TUN_LANE
+{
+    NET_BUFFER_LIST *FirstNbl, *LastNbl;
+    NET_BUFFER *NextNb;
+    LONG NumNbl; /* NBLs currently linked into this lane */
+    LONG MaxNbls;
+    LONG64 QueuedNbls, DroppedNbls;
+} TUN_LANE;
+
+/* Pending read IRPs, kept in order of arrival. */
+typedef struct _TUN_IRP_QUEUE
+{
+    KSPIN_LOCK Lock;
+    IO_CSQ Csq;
+    LIST_ENTRY List;
+    struct _TUN_CTX *Ctx;
+} TUN_IRP_QUEUE;
+
+/* Laid out by who writes what, so that the directions don't falsely share cache lines with each other: a control
+ * block that is only written on state transitions and configuration changes, then the device, whose queued reads
+ * are drained by whoever services them, then the send path's queue and transmit counters, and lastly the write
+ * path's indication staging and receive counters. Each hot block starts on a cache line of its own. */
 typedef struct _TUN_CTX
 {
     volatile LONG Flags;
 
-    /* Used like RCU. When we're making use of queues, we take a shared lock. When we want to
-     * drain the queues and toggle the state, we take an exclusive lock before toggling the
-     * atomic and then releasing. It's similar to setting the atomic and then calling rcu_barrier(). */
-    EX_SPIN_LOCK TransitionLock;
+    /* Used like RCU. When we're making use of queues, we take a per-processor reader reference. When we want to
+     * drain the queues and toggle the state, we toggle the atomic and then wait for every processor's readers to
+     * leave. It's similar to setting the atomic and then calling rcu_barrier(). */
+    struct
+    {
+        KSPIN_LOCK Lock;       /* Serializes barriers */
+        volatile LONG Barrier; /* Holds off new readers while a barrier waits for the current ones */
+    } Rundown;
 
     NDIS_HANDLE MiniportAdapterHandle; /* This is actually a pointer to NDIS_MINIPORT_BLOCK struct. */
-    NDIS_STATISTICS_INFO Statistics;
+    TUN_CONFIG Config;
 
+    /* Only counts while paused. While running, active NBLs are counted in TUN_CPU.ActiveNBLCount and this carries
+     * TUN_ACTIVE_NBL_BIAS; TunPause folds the per-processor counts back in. */
     volatile LONG64 ActiveNBLCount;
 
+    ULONG NumCpus;
+    TUN_CPU *Cpus; /* Indexed by processor index */
+
+    NDIS_HANDLE NBLPool;
+
+    /* TUN_RX_CSUM bits the stack currently has enabled through OID_TCP_OFFLOAD_PARAMETERS. Only packets that
+     * userspace flags with TUN_PACKET_FLAG_CHECKSUM_VALID get their checksums reported as verified. */
+    volatile LONG RxChecksum;
+
+    struct
+    {
+        /* Read by writers under a rundown reference, and replaced followed by a rundown barrier before the old one is
+         * freed. NULL until the protocol first configures RSS. */
+        TUN_RSS_STATE *volatile State;
+        ULONG NumQueues; /* Active processors, a prefix of Cpus */
+    } Rss;
+
+    struct
+    {
+        volatile LONG Handles; /* Open handles with an affinity; while zero, nothing is deferred */
+        volatile LONG64 CrossNodeCopies;
+    } Affinity;
+
+    LIST_ENTRY Entry; /* In TunAdapters, from initialization until halting */
+    ULONG LuidIndex;
+    /* The mux handle this adapter is subscribed to, if any. Read by drainers under a rundown reference, and cleared
+     * followed by a rundown barrier before the mux is freed. */
+    struct _TUN_MUX *volatile Mux;
+    struct _TUN_CTX *MuxDetached; /* Links the adapters TunMuxClose detached, only while it runs */
+
     struct
     {
         NDIS_HANDLE Handle;
         volatile LONG64 RefCount;
-        IO_REMOVE_LOCK RemoveLock;
 
         struct
         {
             KSPIN_LOCK Lock;
-            IO_CSQ Csq;
-            LIST_ENTRY List;
-        } ReadQueue;
+            LIST_ENTRY List; /* TUN_FILE_CTX.Entry of every open file object */
+        } Files;
 
+        volatile LONG Taps; /* Open tap handles; while zero, no packets are copied for taps */
         DEVICE_OBJECT *Object;
+
+        /* Acquired and released by every IRP, reads and writes alike. */
+        DECLSPEC_CACHEALIGN IO_REMOVE_LOCK RemoveLock;
+
+        DECLSPEC_CACHEALIGN TUN_IRP_QUEUE ReadQueue;
+        TUN_IRP_QUEUE TapQueue; /* Reads of tap handles, which are served from their own queues only */
+        TUN_IRP_QUEUE MuxQueue; /* Reads of mux handles, which are served from the adapters they subscribed to */
+        volatile LONG64 TapDrops;
+        /* Bytes of exchange buffers locked into memory, across handles, now and at most so far. */
+        volatile LONG64 LockedBytes, PeakLockedBytes;
     } Device;
 
-    struct
+    /* Transmit counters, which the In counters of Receive.Statistics are merged into when queried. */
+    DECLSPEC_CACHEALIGN NDIS_STATISTICS_INFO Statistics;
+
+    DECLSPEC_CACHEALIGN struct
     {
         KSPIN_LOCK Lock;
-        NET_BUFFER_LIST *FirstNbl, *LastNbl;
-        NET_BUFFER *NextNb;
-        LONG NumNbl;
+        TUN_LANE Lanes[TUN_LANE_COUNT];
+        LONG NumNbl; /* NBLs queued or still being copied out, across all lanes */
+        TUN_PACKET_COPIES Parked;
+        struct
+        {
+            TUN_ACK_FLOW Flows[TUN_ACK_FLOWS];
+            LONG64 Superseded;
+        } AckFilter;
+        /* Requests to drain the queue since the drainer last went round, nonzero for as long as there is one. Bumped
+         * without the lock by every sender and reader, so it stays off the lock's line. */
+        DECLSPEC_CACHEALIGN volatile LONG DrainRequests;
     } PacketQueue;
 
-    NDIS_HANDLE NBLPool;
+    /* Writes that bypass RSS stage their NBLs here, by ether type, and TunReceiveAction decides who indicates them and
+     * when. The indicator goes on until nothing is left, so that writes coming in meanwhile, on any processor, get
+     * indicated together. */
+    DECLSPEC_CACHEALIGN struct
+    {
+        KSPIN_LOCK Lock;
+        struct
+        {
+            NET_BUFFER_LIST *First, *Last;
+            LONG Count;
+        } Staged[2]; /* IPv4, IPv6 */
+        BOOLEAN Indicating;
+        BOOLEAN DeadlineArmed;
+        volatile LONG Writers; /* Writes that bypass RSS and are still building their NBLs, bumped without the lock */
+        KDPC Dpc; /* Takes over indicating from a writer that has done its share */
+        KTIMER Deadline;
+        KDPC DeadlineDpc; /* Indicates what writers left staged for others that have not staged theirs in time */
+        NDIS_STATISTICS_INFO Statistics; /* Only the In counters are used */
+    } Receive;
 } TUN_CTX;
 
+C_ASSERT(FIELD_OFFSET(TUN_CTX, Device.RemoveLock) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CTX, Device.ReadQueue) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CTX, Statistics) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CTX, PacketQueue) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CTX, PacketQueue.DrainRequests) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CTX, Receive) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(sizeof(TUN_CTX) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(sizeof(TUN_CPU) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(TUN_CPU, RssQueue) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+/* The device extension is only guaranteed pointer alignment, so it is sized for TUN_CTX to start on the first cache
+ * line boundary within it. */
+#define TUN_CTX_EXTENSION_SIZE (sizeof(TUN_CTX) + SYSTEM_CACHE_ALIGNMENT_SIZE - 1)
+
+static TUN_CTX *
+TunCtxFromExtension(_In_opt_ VOID *Extension)
+{
+    return Extension ? (TUN_CTX *)(((ULONG_PTR)Extension + SYSTEM_CACHE_ALIGNMENT_SIZE - 1) &
+                                   ~(ULONG_PTR)(SYSTEM_CACHE_ALIGNMENT_SIZE - 1))
+                     : NULL;
+}
+
+/* The adapter of the device an IRP was issued to, which holds its remove lock. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static TUN_CTX *
+TunIrpCtx(_In_ IRP *Irp)
+{
+    return TunCtxFromExtension(NdisGetDeviceReservedExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject));
+}
+
 typedef struct _TUN_MAPPED_UBUFFER
 {
     VOID *volatile UserAddress;
@@ -119,21 +313,75 @@ typedef struct _TUN_MAPPED_UBUFFER
     /* TODO: ThreadID for checking */
 } TUN_MAPPED_UBUFFER;
 
+typedef struct _TUN_FILTER_PROG
+{
+    ULONG Count;
+    TUN_FILTER_INSN Insns[TUN_FILTER_MAX_INSNS];
+    volatile LONG64 Drops[TUN_FILTER_MAX_INSNS]; /* Indexed by the return instruction that dropped */
+} TUN_FILTER_PROG;
+
 typedef struct _TUN_FILE_CTX
 {
+    LIST_ENTRY Entry;
+    FILE_OBJECT *FileObject;
+    PEPROCESS Process;    /* Opener, referenced, so forced closing knows where to look for its handles */
+    BOOLEAN ForceClosing; /* Already visited by TunForceHandlesClosed */
     TUN_MAPPED_UBUFFER ReadBuffer;
     TUN_MAPPED_UBUFFER WriteBuffer;
+    LONG Format;             /* TUN_EXCH_FORMAT_*, fixed once either buffer is mapped */
+    LONG Locking;            /* TUN_LOCKING_*, fixed likewise */
+    volatile LONG Locked;    /* Set by the first read or write locked on its own, which counts as mapping */
+    struct
+    {
+        ULONG Size, Count; /* Count is zero unless the write buffer was split into slots */
+        volatile LONG Busy[TUN_EXCH_MAX_WRITE_SLOTS / 32]; /* Slots of writes in flight */
+    } WriteSlots;
+    volatile LONG Processor; /* Processor index reads are serviced on, or -1 */
+    volatile LONG Node;      /* NUMA node of Processor, or -1 */
+    /* Read under a rundown reference, and replaced followed by a rundown barrier before the old one is freed. */
+    TUN_FILTER_PROG *volatile Filter;
+    struct
+    {
+        volatile LONG Flags; /* TUN_TAP_FLAGS, zero unless this is a tap, fixed once either buffer is mapped */
+        KSPIN_LOCK Lock;
+        ULONG SnapLength;   /* Never more than MaxIpPacketSize */
+        TUN_COPY_RING Ring; /* Copies queued for reading, set up when the handle becomes a tap */
+    } Tap;
+    struct _TUN_MUX *volatile Mux; /* NULL unless this is a mux, fixed once either buffer is mapped */
 } TUN_FILE_CTX;
 
+#define TUN_MUX_QUANTUM 16 /* Packets a mux read takes from one adapter before moving on to the next */
+
+/* The adapters a mux handle is subscribed to, sorted by LUID index. Adapters only leave, or are freed, once they are
+ * out of the list, so holding the lock keeps all those in it around, and a remove lock reference taken meanwhile
+ * keeps one around past it. */
+typedef struct _TUN_MUX
+{
+    TUN_CTX *Ctx;                /* Of the device the mux handle was opened on, whose MuxQueue holds its reads */
+    FILE_OBJECT *FileObject;     /* Of the mux handle */
+    volatile LONG DrainRequests; /* As PacketQueue.DrainRequests, for the mux's reads */
+    ULONG Next;                  /* Adapter the next run is taken from, only used by the drainer */
+    KSPIN_LOCK Lock;
+    ULONG Count;
+    struct
+    {
+        ULONG LuidIndex;
+        TUN_CTX *Ctx;     /* NULL once the adapter has been halted */
+        TUN_CTX *Connect; /* Ctx, if TunMuxSet has yet to indicate it connected, only while it runs */
+    } Adapters[];
+} TUN_MUX;
+
 static UINT NdisVersion;
 static NDIS_HANDLE NdisMiniportDriverHandle;
 static DRIVER_DISPATCH *NdisDispatchPnP;
 static volatile LONG64 TunAdapterCount;
+/* Adapters for mux handles to subscribe to, by TUN_CTX.Entry. The lock also guards which mux each belongs to. */
+static KSPIN_LOCK TunAdaptersLock;
+static LIST_ENTRY TunAdapters;
 
 #define InterlockedGet(val) (InterlockedAdd((val), 0))
 #define InterlockedGet64(val) (InterlockedAdd64((val), 0))
 #define InterlockedGetPointer(val) (InterlockedCompareExchangePointer((val), NULL, NULL))
-#define TunPacketAlign(size) (((UINT)(size) + (UINT)(TUN_EXCH_ALIGNMENT - 1)) & ~(UINT)(TUN_EXCH_ALIGNMENT - 1))
 #define TunInitUnicodeString(str, buf) \
     { \
         (str)->Length = 0; \
@@ -143,15 +391,18 @@ static volatile LONG64 TunAdapterCount;
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_ static void
-TunIndicateStatus(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ NDIS_MEDIA_CONNECT_STATE MediaConnectState)
+TunIndicateStatus(
+    _In_ NDIS_HANDLE MiniportAdapterHandle,
+    _In_ NDIS_MEDIA_CONNECT_STATE MediaConnectState,
+    _In_ ULONG64 LinkSpeed)
 {
     NDIS_LINK_STATE state = { .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
                                           .Revision = NDIS_LINK_STATE_REVISION_1,
                                           .Size = NDIS_SIZEOF_LINK_STATE_REVISION_1 },
                               .MediaConnectState = MediaConnectState,
                               .MediaDuplexState = MediaDuplexStateFull,
-                              .XmitLinkSpeed = TUN_LINK_SPEED,
-                              .RcvLinkSpeed = TUN_LINK_SPEED,
+                              .XmitLinkSpeed = LinkSpeed,
+                              .RcvLinkSpeed = LinkSpeed,
                               .PauseFunctions = NdisPauseFunctionsUnsupported };
 
     NDIS_STATUS_INDICATION t = { .Header = { .Type = NDIS_OBJECT_TYPE_STATUS_INDICATION,
@@ -165,21 +416,114 @@ TunIndicateStatus(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ NDIS_MEDIA_CONNEC
     NdisMIndicateStatusEx(MiniportAdapterHandle, &t);
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunLockedBytesAdd(_Inout_ TUN_CTX *Ctx, _In_ LONG64 Count)
+{
+    LONG64 locked = InterlockedAdd64(&Ctx->Device.LockedBytes, Count);
+    for (LONG64 peak = ReadNoFence64(&Ctx->Device.PeakLockedBytes); locked > peak;)
+    {
+        LONG64 prev = InterlockedCompareExchange64(&Ctx->Device.PeakLockedBytes, locked, peak);
+        if (prev == peak)
+            break;
+        peak = prev;
+    }
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static void
 TunCompleteRequest(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp, _In_ NTSTATUS Status, _In_ CCHAR PriorityBoost)
 {
+    /* Only reads and writes of handles with TUN_LOCKING_CALL have an MDL of their own. */
+    if (Irp->MdlAddress)
+    {
+        TunLockedBytesAdd(Ctx, -(LONG64)MmGetMdlByteCount(Irp->MdlAddress));
+        MmUnlockPages(Irp->MdlAddress);
+        IoFreeMdl(Irp->MdlAddress);
+        Irp->MdlAddress = NULL;
+    }
     Irp->IoStatus.Status = Status;
     IoCompleteRequest(Irp, PriorityBoost);
     IoReleaseRemoveLock(&Ctx->Device.RemoveLock, Irp);
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_saves_
+static KIRQL
+TunRundownAcquire(_Inout_ TUN_CTX *Ctx)
+{
+    KIRQL irql = KeRaiseIrqlToDpcLevel();
+    TUN_CPU *cpu = &Ctx->Cpus[KeGetCurrentProcessorIndex()];
+    for (;;)
+    {
+        /* Nobody else can be inside on this processor at DISPATCH_LEVEL, so an existing reference is our own, and
+         * the barrier is already waiting for it anyway. */
+        if (InterlockedIncrement(&cpu->RundownReaders) > 1 || !ReadNoFence(&Ctx->Rundown.Barrier))
+            return irql;
+        InterlockedDecrement(&cpu->RundownReaders);
+        while (ReadNoFence(&Ctx->Rundown.Barrier))
+            YieldProcessor();
+    }
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunRundownRelease(_Inout_ TUN_CTX *Ctx, _In_ _IRQL_restores_ KIRQL Irql)
+{
+    InterlockedDecrement(&Ctx->Cpus[KeGetCurrentProcessorIndex()].RundownReaders);
+    KeLowerIrql(Irql);
+}
+
+/* Waits for all readers that might not have seen prior changes to leave. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunRundownBarrier(_Inout_ TUN_CTX *Ctx)
+{
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLock(&Ctx->Rundown.Lock, &lqh);
+    InterlockedExchange(&Ctx->Rundown.Barrier, TRUE);
+    for (ULONG i = 0; i < Ctx->NumCpus; ++i)
+    {
+        while (ReadNoFence(&Ctx->Cpus[i].RundownReaders))
+            YieldProcessor();
+    }
+    KeMemoryBarrier();
+    InterlockedExchange(&Ctx->Rundown.Barrier, FALSE);
+    KeReleaseInStackQueuedSpinLock(&lqh);
+}
+
+/* Large enough that the per-processor counts folded in by TunPause can never bring ActiveNBLCount down to zero before
+ * the bias is taken off again. */
+#define TUN_ACTIVE_NBL_BIAS (MAXLONG64 / 2)
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunActiveNBLAdd(_Inout_ TUN_CTX *Ctx, _In_ LONG64 Count)
+{
+    KIRQL irql = TunRundownAcquire(Ctx);
+    if (ReadNoFence(&Ctx->Flags) & TUN_FLAGS_RUNNING)
+        Ctx->Cpus[KeGetCurrentProcessorIndex()].ActiveNBLCount += Count;
+    else
+        InterlockedAdd64(&Ctx->ActiveNBLCount, Count);
+    TunRundownRelease(Ctx, irql);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static NDIS_STATUS
-TunCompletePause(_Inout_ TUN_CTX *Ctx, _In_ BOOLEAN AsyncCompletion)
+TunCompletePause(_Inout_ TUN_CTX *Ctx, _In_ LONG64 Count, _In_ BOOLEAN AsyncCompletion)
 {
-    ASSERT(InterlockedGet64(&Ctx->ActiveNBLCount) > 0);
-    if (InterlockedDecrement64(&Ctx->ActiveNBLCount) <= 0)
+    KIRQL irql = TunRundownAcquire(Ctx);
+    if (ReadNoFence(&Ctx->Flags) & TUN_FLAGS_RUNNING)
+    {
+        Ctx->Cpus[KeGetCurrentProcessorIndex()].ActiveNBLCount -= Count;
+        TunRundownRelease(Ctx, irql);
+        return NDIS_STATUS_PENDING;
+    }
+    TunRundownRelease(Ctx, irql);
+
+    ASSERT(InterlockedGet64(&Ctx->ActiveNBLCount) >= Count);
+    if (InterlockedAdd64(&Ctx->ActiveNBLCount, -Count) <= 0)
     {
         if (AsyncCompletion)
             NdisMPauseComplete(Ctx->MiniportAdapterHandle);
@@ -189,14 +533,37 @@ TunCompletePause(_Inout_ TUN_CTX *Ctx, _In_ BOOLEAN AsyncCompletion)
     return NDIS_STATUS_PENDING;
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunOffloadFill(_Out_ NDIS_OFFLOAD *Offload, _In_ LONG RxChecksum)
+{
+#define TUN_OFFLOAD(rx_csum) ((RxChecksum & (rx_csum)) ? NDIS_OFFLOAD_SUPPORTED : NDIS_OFFLOAD_NOT_SUPPORTED)
+    NdisZeroMemory(Offload, sizeof(*Offload));
+    Offload->Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
+    Offload->Header.Revision = NDIS_OFFLOAD_REVISION_1;
+    Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_1;
+    Offload->Checksum.IPv4Receive.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->Checksum.IPv4Receive.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Receive.IpChecksum = TUN_OFFLOAD(TUN_RX_CSUM_IPV4);
+    Offload->Checksum.IPv4Receive.TcpChecksum = TUN_OFFLOAD(TUN_RX_CSUM_TCP_IPV4);
+    Offload->Checksum.IPv4Receive.UdpChecksum = TUN_OFFLOAD(TUN_RX_CSUM_UDP_IPV4);
+    Offload->Checksum.IPv6Receive.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->Checksum.IPv6Receive.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Receive.TcpChecksum = TUN_OFFLOAD(TUN_RX_CSUM_TCP_IPV6);
+    Offload->Checksum.IPv6Receive.UdpChecksum = TUN_OFFLOAD(TUN_RX_CSUM_UDP_IPV6);
+#undef TUN_OFFLOAD
+}
+
 static IO_CSQ_INSERT_IRP_EX TunCsqInsertIrpEx;
 _Use_decl_annotations_
 static NTSTATUS
 TunCsqInsertIrpEx(IO_CSQ *Csq, IRP *Irp, PVOID InsertContext)
 {
-    TUN_CTX *ctx = CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq);
-    (InsertContext == TUN_CSQ_INSERT_HEAD ? InsertHeadList
-                                          : InsertTailList)(&ctx->Device.ReadQueue.List, &Irp->Tail.Overlay.ListEntry);
+    TUN_IRP_QUEUE *queue = CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq);
+    (InsertContext == TUN_CSQ_INSERT_HEAD ? InsertHeadList : InsertTailList)(
+        &queue->List, &Irp->Tail.Overlay.ListEntry);
     return STATUS_SUCCESS;
 }
 
@@ -213,12 +580,12 @@ _Use_decl_annotations_
 static IRP *
 TunCsqPeekNextIrp(IO_CSQ *Csq, IRP *Irp, _In_ PVOID PeekContext)
 {
-    TUN_CTX *ctx = CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq);
+    TUN_IRP_QUEUE *queue = CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq);
 
     /* If the IRP is non-NULL, we will start peeking from that IRP onwards, else
      * we will start from the listhead. This is done under the assumption that
      * new IRPs are always inserted at the tail. */
-    for (LIST_ENTRY *head = &ctx->Device.ReadQueue.List, *next = Irp ? Irp->Tail.Overlay.ListEntry.Flink : head->Flink;
+    for (LIST_ENTRY *head = &queue->List, *next = Irp ? Irp->Tail.Overlay.ListEntry.Flink : head->Flink;
          next != head;
          next = next->Flink)
     {
@@ -236,21 +603,21 @@ TunCsqPeekNextIrp(IO_CSQ *Csq, IRP *Irp, _In_ PVOID PeekContext)
 
 _IRQL_raises_(DISPATCH_LEVEL)
 _IRQL_requires_max_(DISPATCH_LEVEL)
-_Requires_lock_not_held_(CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock)
-_Acquires_lock_(CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock)
+_Requires_lock_not_held_(CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock)
+_Acquires_lock_(CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock)
 static VOID
 TunCsqAcquireLock(_In_ IO_CSQ *Csq, _Out_ _At_(*Irql, _Post_ _IRQL_saves_) KIRQL *Irql)
 {
-    KeAcquireSpinLock(&CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock, Irql);
+    KeAcquireSpinLock(&CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock, Irql);
 }
 
 _IRQL_requires_(DISPATCH_LEVEL)
-_Requires_lock_held_(CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock)
-_Releases_lock_(CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock)
+_Requires_lock_held_(CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock)
+_Releases_lock_(CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock)
 static VOID
 TunCsqReleaseLock(_In_ IO_CSQ *Csq, _In_ _IRQL_restores_ KIRQL Irql)
 {
-    KeReleaseSpinLock(&CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq)->Device.ReadQueue.Lock, Irql);
+    KeReleaseSpinLock(&CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Lock, Irql);
 }
 
 static IO_CSQ_COMPLETE_CANCELED_IRP TunCsqCompleteCanceledIrp;
@@ -258,39 +625,40 @@ _Use_decl_annotations_
 static VOID
 TunCsqCompleteCanceledIrp(IO_CSQ *Csq, IRP *Irp)
 {
-    TUN_CTX *ctx = CONTAINING_RECORD(Csq, TUN_CTX, Device.ReadQueue.Csq);
-    TunCompleteRequest(ctx, Irp, STATUS_CANCELLED, IO_NO_INCREMENT);
+    TunCompleteRequest(CONTAINING_RECORD(Csq, TUN_IRP_QUEUE, Csq)->Ctx, Irp, STATUS_CANCELLED, IO_NO_INCREMENT);
 }
 
-_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunIrpQueueInit(_Out_ TUN_IRP_QUEUE *Queue, _In_ TUN_CTX *Ctx)
+{
+    KeInitializeSpinLock(&Queue->Lock);
+    IoCsqInitializeEx(
+        &Queue->Csq,
+        TunCsqInsertIrpEx,
+        TunCsqRemoveIrp,
+        TunCsqPeekNextIrp,
+        TunCsqAcquireLock,
+        TunCsqReleaseLock,
+        TunCsqCompleteCanceledIrp);
+    InitializeListHead(&Queue->List);
+    Queue->Ctx = Ctx;
+}
+
+/* Maps a buffer that is not mapped yet, with its InitializationComplete mutex held. */
+_IRQL_requires_(APC_LEVEL)
 _Must_inspect_result_
 static NTSTATUS
-TunMapUbuffer(_Inout_ TUN_MAPPED_UBUFFER *MappedBuffer, _In_ VOID *UserAddress, _In_ ULONG Size)
+TunMapUbufferLocked(
+    _Inout_ TUN_CTX *Ctx,
+    _Inout_ TUN_MAPPED_UBUFFER *MappedBuffer,
+    _In_ VOID *UserAddress,
+    _In_ ULONG Size)
 {
-    VOID *current_uaddr = InterlockedGetPointer(&MappedBuffer->UserAddress);
-    if (current_uaddr)
-    {
-        if (UserAddress != current_uaddr || Size > MappedBuffer->Size) /* TODO: Check ThreadID */
-            return STATUS_ALREADY_INITIALIZED;
-        return STATUS_SUCCESS;
-    }
-
-    NTSTATUS status = STATUS_SUCCESS;
-    ExAcquireFastMutex(&MappedBuffer->InitializationComplete);
-
-    /* Recheck the same thing as above, but locked this time. */
-    current_uaddr = InterlockedGetPointer(&MappedBuffer->UserAddress);
-    if (current_uaddr)
-    {
-        if (UserAddress != current_uaddr || Size > MappedBuffer->Size) /* TODO: Check ThreadID */
-            status = STATUS_ALREADY_INITIALIZED;
-        goto err_releasemutex;
-    }
-
+    NTSTATUS status;
     MappedBuffer->Mdl = IoAllocateMdl(UserAddress, Size, FALSE, FALSE, NULL);
-    status = STATUS_INSUFFICIENT_RESOURCES;
     if (!MappedBuffer->Mdl)
-        goto err_releasemutex;
+        return STATUS_INSUFFICIENT_RESOURCES;
 
     status = STATUS_INVALID_USER_BUFFER;
     try
@@ -305,8 +673,8 @@ TunMapUbuffer(_Inout_ TUN_MAPPED_UBUFFER *MappedBuffer, _In_ VOID *UserAddress,
     if (!MappedBuffer->KernelAddress)
         goto err_unlockmdl;
     MappedBuffer->Size = Size;
+    TunLockedBytesAdd(Ctx, Size);
     InterlockedExchangePointer(&MappedBuffer->UserAddress, UserAddress);
-    ExReleaseFastMutex(&MappedBuffer->InitializationComplete);
     return STATUS_SUCCESS;
 
 err_unlockmdl:
@@ -314,27 +682,101 @@ err_unlockmdl:
 err_freemdl:
     IoFreeMdl(MappedBuffer->Mdl);
     MappedBuffer->Mdl = NULL;
-err_releasemutex:
+    return status;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunMapUbuffer(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_MAPPED_UBUFFER *MappedBuffer, _In_ VOID *UserAddress, _In_ ULONG Size)
+{
+    VOID *current_uaddr = InterlockedGetPointer(&MappedBuffer->UserAddress);
+    if (current_uaddr)
+    {
+        if (UserAddress != current_uaddr || Size > MappedBuffer->Size) /* TODO: Check ThreadID */
+            return STATUS_ALREADY_INITIALIZED;
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS status = STATUS_SUCCESS;
+    ExAcquireFastMutex(&MappedBuffer->InitializationComplete);
+
+    /* Recheck the same thing as above, but locked this time. */
+    current_uaddr = InterlockedGetPointer(&MappedBuffer->UserAddress);
+    if (current_uaddr)
+    {
+        if (UserAddress != current_uaddr || Size > MappedBuffer->Size) /* TODO: Check ThreadID */
+            status = STATUS_ALREADY_INITIALIZED;
+    }
+    else
+        status = TunMapUbufferLocked(Ctx, MappedBuffer, UserAddress, Size);
+
     ExReleaseFastMutex(&MappedBuffer->InitializationComplete);
     return status;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static void
-TunUnmapUbuffer(_Inout_ TUN_MAPPED_UBUFFER *MappedBuffer)
+TunUnmapUbuffer(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_MAPPED_UBUFFER *MappedBuffer)
 {
     if (MappedBuffer->Mdl)
     {
+        TunLockedBytesAdd(Ctx, -(LONG64)MappedBuffer->Size);
         MmUnlockPages(MappedBuffer->Mdl);
         IoFreeMdl(MappedBuffer->Mdl);
         MappedBuffer->UserAddress = MappedBuffer->KernelAddress = MappedBuffer->Mdl = NULL;
     }
 }
 
+/* Locks just the buffer of a read or write of a handle with TUN_LOCKING_CALL, until the IRP is completed. */
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunLockIrp(
+    _Inout_ TUN_CTX *Ctx,
+    _Inout_ TUN_FILE_CTX *FileCtx,
+    _Inout_ IRP *Irp,
+    _In_ ULONG Size,
+    _In_ LOCK_OPERATION Operation)
+{
+    if (!ReadNoFence(&FileCtx->Locked))
+    {
+        /* The first one waits for settings being changed, as it would when mapping a buffer. */
+        ExAcquireFastMutex(&FileCtx->ReadBuffer.InitializationComplete);
+        InterlockedExchange(&FileCtx->Locked, TRUE);
+        ExReleaseFastMutex(&FileCtx->ReadBuffer.InitializationComplete);
+    }
+
+    NTSTATUS status;
+    MDL *mdl = IoAllocateMdl(Irp->UserBuffer, Size, FALSE, FALSE, NULL);
+    if (!mdl)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    status = STATUS_INVALID_USER_BUFFER;
+    try
+    {
+        MmProbeAndLockPages(mdl, UserMode, Operation);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) { goto err_freemdl; }
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (!MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute))
+        goto err_unlockmdl;
+    TunLockedBytesAdd(Ctx, Size);
+    Irp->MdlAddress = mdl;
+    return STATUS_SUCCESS;
+
+err_unlockmdl:
+    MmUnlockPages(mdl);
+err_freemdl:
+    IoFreeMdl(mdl);
+    return status;
+}
+
 _IRQL_requires_max_(APC_LEVEL)
 _Must_inspect_result_
 static NTSTATUS
-TunMapIrp(_In_ IRP *Irp)
+TunMapIrp(_In_ TUN_CTX *Ctx, _In_ IRP *Irp)
 {
     ULONG size;
     TUN_MAPPED_UBUFFER *ubuffer;
@@ -345,11 +787,15 @@ TunMapIrp(_In_ IRP *Irp)
     {
     case IRP_MJ_READ:
         size = stack->Parameters.Read.Length;
-        if (size < TUN_EXCH_MIN_BUFFER_SIZE_READ)
+        /* Mux reads take packets of other adapters too, which may have been configured with larger ones. */
+        if (size < Ctx->Config.MaxPacketSize ||
+            (ReadPointerNoFence((PVOID *)&file_ctx->Mux) && size < TUN_EXCH_MIN_BUFFER_SIZE_MUX_READ))
             return STATUS_INVALID_USER_BUFFER;
         ubuffer = &file_ctx->ReadBuffer;
         break;
     case IRP_MJ_WRITE:
+        if (ReadNoFence(&file_ctx->Tap.Flags))
+            return STATUS_INVALID_DEVICE_REQUEST;
         size = stack->Parameters.Write.Length;
         if (size < TUN_EXCH_MIN_BUFFER_SIZE_WRITE)
             return STATUS_INVALID_USER_BUFFER;
@@ -358,101 +804,404 @@ TunMapIrp(_In_ IRP *Irp)
     default:
         return STATUS_INVALID_PARAMETER;
     }
-    if (size > TUN_EXCH_MAX_BUFFER_SIZE)
+    if (size > Ctx->Config.MaxBufferSize)
+        return STATUS_INVALID_USER_BUFFER;
+    /* Slotted write buffers were mapped up front, and TunWriteSlotsAcquire checks that the IRP falls within. */
+    if (ubuffer == &file_ctx->WriteBuffer && ReadNoFence((LONG *)&file_ctx->WriteSlots.Count))
+        return STATUS_SUCCESS;
+    if (file_ctx->Locking == TUN_LOCKING_CALL)
+        return TunLockIrp(
+            Ctx, file_ctx, Irp, size, stack->MajorFunction == IRP_MJ_READ ? IoWriteAccess : IoReadAccess);
+    return TunMapUbuffer(Ctx, ubuffer, Irp->UserBuffer, size);
+}
+
+/* Finds an IRP's buffer in system space, either locked on its own or within its handle's mapped buffer, along with
+ * the MDL that describes it and the offset of the buffer into that MDL. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static UCHAR *
+TunIrpBuffer(_In_ IRP *Irp, _In_ const TUN_MAPPED_UBUFFER *MappedBuffer, _Out_opt_ MDL **Mdl, _Out_opt_ ULONG *Offset)
+{
+    MDL *mdl = Irp->MdlAddress;
+    ULONG offset = 0;
+    UCHAR *buffer;
+    if (mdl)
+        /* Already mapped by TunLockIrp, so this cannot fail. */
+        buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+    else
+    {
+        /* Nonzero only for writes to a slot other than the first of a slotted buffer. */
+        mdl = MappedBuffer->Mdl;
+        offset = (ULONG)((UCHAR *)Irp->UserBuffer - (UCHAR *)MappedBuffer->UserAddress);
+        buffer = (UCHAR *)MappedBuffer->KernelAddress + offset;
+    }
+    if (Mdl)
+        *Mdl = mdl;
+    if (Offset)
+        *Offset = offset;
+    return buffer;
+}
+
+/* Finds the slots a write IRP covers, if the handle's write buffer is slotted and the IRP covers whole slots. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunWriteSlotsRange(_In_ const TUN_FILE_CTX *FileCtx, _In_ IRP *Irp, _Out_ ULONG *First, _Out_ ULONG *Last)
+{
+    ULONG_PTR offset = (ULONG_PTR)Irp->UserBuffer - (ULONG_PTR)FileCtx->WriteBuffer.UserAddress;
+    if (!FileCtx->WriteSlots.Count || offset > FileCtx->WriteBuffer.Size)
+        return FALSE;
+    TUN_SUBMIT_WRITE write = { (ULONG)offset, IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length };
+    /* By the mapped size, which is zero while a racing TUN_IOCTL_SET_WRITE_SLOTS has yet to map the buffer. */
+    return TunSubmitWriteSlots(
+        &write, FileCtx->WriteSlots.Size, FileCtx->WriteBuffer.Size / FileCtx->WriteSlots.Size, First, Last);
+}
+
+/* Claims the slots of a write IRP for as long as the IRP is in flight. Nothing to claim for unslotted buffers. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunWriteSlotsAcquire(_Inout_ TUN_FILE_CTX *FileCtx, _In_ IRP *Irp)
+{
+    ULONG first, last;
+    if (!ReadNoFence((LONG *)&FileCtx->WriteSlots.Count))
+        return STATUS_SUCCESS;
+    if (!TunWriteSlotsRange(FileCtx, Irp, &first, &last))
         return STATUS_INVALID_USER_BUFFER;
-    return TunMapUbuffer(ubuffer, Irp->UserBuffer, size);
+    for (ULONG i = first; i <= last; ++i)
+    {
+        if (InterlockedBitTestAndSet(&FileCtx->WriteSlots.Busy[i / 32], i % 32))
+        {
+            while (i-- > first)
+                InterlockedBitTestAndReset(&FileCtx->WriteSlots.Busy[i / 32], i % 32);
+            return STATUS_DEVICE_BUSY;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunWriteSlotsRelease(_Inout_ TUN_FILE_CTX *FileCtx, _In_ IRP *Irp)
+{
+    ULONG first, last;
+    if (!ReadNoFence((LONG *)&FileCtx->WriteSlots.Count) || !TunWriteSlotsRange(FileCtx, Irp, &first, &last))
+        return;
+    for (ULONG i = first; i <= last; ++i)
+        InterlockedBitTestAndReset(&FileCtx->WriteSlots.Busy[i / 32], i % 32);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_
 static _Return_type_success_(
-    return != NULL) IRP *TunRemoveNextIrp(_Inout_ TUN_CTX *Ctx, _Out_ UCHAR **Buffer, _Out_ ULONG *Size)
+    return != NULL) IRP *TunRemoveNextIrp(
+    _Inout_ TUN_CTX *Ctx,
+    _Out_ UCHAR **Buffer,
+    _Out_ ULONG *Size,
+    _Out_ TUN_FILE_CTX **FileCtx)
 {
     IRP *irp = IoCsqRemoveNextIrp(&Ctx->Device.ReadQueue.Csq, NULL);
     if (!irp)
         return NULL;
     IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(irp);
+    *FileCtx = (TUN_FILE_CTX *)stack->FileObject->FsContext;
     *Size = stack->Parameters.Read.Length;
     ASSERT(irp->IoStatus.Information <= (ULONG_PTR)*Size);
-    *Buffer = ((TUN_FILE_CTX *)stack->FileObject->FsContext)->ReadBuffer.KernelAddress;
+    *Buffer = TunIrpBuffer(irp, &(*FileCtx)->ReadBuffer, NULL, NULL);
     return irp;
 }
 
-_IRQL_requires_same_ static BOOLEAN
-TunWontFitIntoIrp(_In_ IRP *Irp, _In_ ULONG Size, _In_ NET_BUFFER *Nb)
+/* Packets written into a read IRP so far, needed for the v2 offset index. */
+#define IRP_READ_PACKETS(irp) (*(ULONG_PTR *)&(irp)->Tail.Overlay.DriverContext[0])
+
+/* Bytes of a read buffer a packet takes up, including its entry in the v2 offset index. */
+_IRQL_requires_same_ static ULONG
+TunPacketFootprint(_In_ LONG Format, _In_ ULONG PacketSize)
 {
-    return (ULONG_PTR)Size <
-           Irp->IoStatus.Information + TunPacketAlign(sizeof(TUN_PACKET) + NET_BUFFER_DATA_LENGTH(Nb));
+    if (Format == TUN_EXCH_FORMAT_V2)
+        return TunPacketV2Align(sizeof(TUN_PACKET_V2) + PacketSize) + sizeof(ULONG);
+    return TunPacketAlign(sizeof(TUN_PACKET) + PacketSize);
 }
 
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_Must_inspect_result_
-static NTSTATUS
-TunWriteIntoIrp(_Inout_ IRP *Irp, _Inout_ UCHAR *Buffer, _In_ NET_BUFFER *Nb, _Inout_ NDIS_STATISTICS_INFO *Statistics)
+/* Bytes of a read buffer left for packets. In the v2 format the count closing the offset index is set aside. */
+_IRQL_requires_same_ static ULONG
+TunIrpRoom(_In_ IRP *Irp, _In_ ULONG Size, _In_ LONG Format)
 {
-    ULONG p_size = NET_BUFFER_DATA_LENGTH(Nb);
-    TUN_PACKET *p = (TUN_PACKET *)(Buffer + Irp->IoStatus.Information);
+    ULONG_PTR used = Irp->IoStatus.Information;
+    if (Format == TUN_EXCH_FORMAT_V2)
+        used += (IRP_READ_PACKETS(Irp) + 1) * sizeof(ULONG);
+    return (ULONG)(Size - used);
+}
 
-    p->Size = p_size;
-    void *ptr = NdisGetDataBuffer(Nb, p_size, p->Data, 1, 0);
-    if (!ptr)
+_IRQL_requires_same_ static BOOLEAN
+TunWontFitIntoIrp(_In_ IRP *Irp, _In_ ULONG Size, _In_ LONG Format, _In_ ULONG PacketSize)
+{
+    return TunIrpRoom(Irp, Size, Format) < TunPacketFootprint(Format, PacketSize);
+}
+
+/* Writes the header of a packet at the end of a read IRP's buffer in the given exchange format, and returns where
+ * its data goes. An OriginalSize larger than Size marks the packet as cut short. */
+_IRQL_requires_same_ static UCHAR *
+TunPacketBegin(
+    _In_ IRP *Irp,
+    _Inout_ UCHAR *Buffer,
+    _In_ LONG Format,
+    _In_ ULONG Size,
+    _In_ ULONG OriginalSize,
+    _In_ UCHAR Priority)
+{
+    UCHAR flags = OriginalSize > Size ? TUN_PACKET_FLAG_TRUNCATED : 0;
+    if (Format == TUN_EXCH_FORMAT_V2)
     {
-        if (Statistics)
-            InterlockedIncrement64((LONG64 *)&Statistics->ifOutErrors);
-        return NDIS_STATUS_RESOURCES;
+        TUN_PACKET_V2 *p = (TUN_PACKET_V2 *)(Buffer + Irp->IoStatus.Information);
+        p->Size = (USHORT)Size;
+        p->Flags = flags;
+        p->Priority = Priority;
+        return p->Data;
     }
-    if (ptr != p->Data)
-        NdisMoveMemory(p->Data, ptr, p_size);
-
-    Irp->IoStatus.Information += TunPacketAlign(sizeof(TUN_PACKET) + p_size);
-
-    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutOctets, p_size);
-    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutUcastOctets, p_size);
-    InterlockedIncrement64((LONG64 *)&Statistics->ifHCOutUcastPkts);
-    return STATUS_SUCCESS;
+    TUN_PACKET *p = (TUN_PACKET *)(Buffer + Irp->IoStatus.Information);
+    p->Size = Size;
+    p->Flags = flags;
+    p->Priority = Priority;
+    p->Reserved = 0;
+    p->OriginalSize = flags ? (USHORT)OriginalSize : 0;
+    return p->Data;
 }
 
-#define NET_BUFFER_LIST_REFCOUNT(nbl) ((volatile LONG64 *)NET_BUFFER_LIST_MINIPORT_RESERVED(nbl))
-
+/* Advances a read IRP past a packet written with TunPacketBegin. */
 _IRQL_requires_same_ static void
-TunNBLRefInit(_Inout_ TUN_CTX *Ctx, _Inout_ NET_BUFFER_LIST *Nbl)
+TunPacketEnd(_Inout_ IRP *Irp, _In_ LONG Format, _In_ ULONG Size)
 {
-    InterlockedIncrement64(&Ctx->ActiveNBLCount);
-    InterlockedIncrement(&Ctx->PacketQueue.NumNbl);
-    InterlockedExchange64(NET_BUFFER_LIST_REFCOUNT(Nbl), 1);
+    if (Format == TUN_EXCH_FORMAT_V2)
+    {
+        Irp->IoStatus.Information += TunPacketV2Align(sizeof(TUN_PACKET_V2) + Size);
+        IRP_READ_PACKETS(Irp)++;
+    }
+    else
+        Irp->IoStatus.Information += TunPacketAlign(sizeof(TUN_PACKET) + Size);
 }
 
+/* Appends the offset index to a v2 read about to be completed successfully. The offsets are recovered by walking the
+ * headers written, which the client may have scribbled over by now, so the walk never leaves the packets, and all
+ * the client gets for its trouble is a garbled index. */
 _IRQL_requires_same_ static void
-TunNBLRefInc(_Inout_ NET_BUFFER_LIST *Nbl)
+TunReadFinish(_Inout_ IRP *Irp, _Inout_ UCHAR *Buffer, _In_ LONG Format)
+{
+    if (Format != TUN_EXCH_FORMAT_V2)
+        return;
+    ULONG end = (ULONG)Irp->IoStatus.Information, count = (ULONG)IRP_READ_PACKETS(Irp);
+    ULONG *index = (ULONG *)(Buffer + end);
+    for (ULONG i = 0, offset = 0; i < count; ++i)
+    {
+        index[i] = offset;
+        if (offset < end)
+            offset += TunPacketV2Align(
+                sizeof(TUN_PACKET_V2) + *(volatile const USHORT *)&((const TUN_PACKET_V2 *)(Buffer + offset))->Size);
+    }
+    index[count] = count;
+    Irp->IoStatus.Information = end + (count + 1) * sizeof(ULONG);
+}
+
+/* The 802.1p user priority of an outgoing NBL if the stack tagged it, and otherwise the IP precedence (the class
+ * selector bits of the DSCP) of its first packet. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static UCHAR
+TunNBLPriority(_In_ NET_BUFFER_LIST *Nbl)
+{
+    NDIS_NET_BUFFER_LIST_8021Q_INFO ieee8021q = { .Value = NET_BUFFER_LIST_INFO(Nbl, Ieee8021QNetBufferListInfo) };
+    if (ieee8021q.TagHeader.UserPriority)
+        return (UCHAR)ieee8021q.TagHeader.UserPriority;
+
+    UCHAR storage[2];
+    const UCHAR *ip = NdisGetDataBuffer(NET_BUFFER_LIST_FIRST_NB(Nbl), sizeof(storage), storage, 1, 0);
+    return ip ? TunIpPrecedence(ip) : 0;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunWriteIntoIrp(
+    _Inout_ IRP *Irp,
+    _Inout_ UCHAR *Buffer,
+    _In_ LONG Format,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_ NET_BUFFER *Nb,
+    _Inout_ NDIS_STATISTICS_INFO *Statistics)
+{
+    ULONG p_size = NET_BUFFER_DATA_LENGTH(Nb);
+    UCHAR *data = TunPacketBegin(Irp, Buffer, Format, p_size, p_size, TunNBLPriority(Nbl));
+    void *ptr = NdisGetDataBuffer(Nb, p_size, data, 1, 0);
+    if (!ptr)
+    {
+        if (Statistics)
+            InterlockedIncrement64((LONG64 *)&Statistics->ifOutErrors);
+        return NDIS_STATUS_RESOURCES;
+    }
+    if (ptr != data)
+        NdisMoveMemory(data, ptr, p_size);
+
+    TunPacketEnd(Irp, Format, p_size);
+
+    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutOctets, p_size);
+    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutUcastOctets, p_size);
+    InterlockedIncrement64((LONG64 *)&Statistics->ifHCOutUcastPkts);
+    return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunWriteCopyIntoIrp(
+    _Inout_ IRP *Irp,
+    _Inout_ UCHAR *Buffer,
+    _In_ LONG Format,
+    _In_ const TUN_PACKET_COPY *Copy,
+    _Inout_opt_ NDIS_STATISTICS_INFO *Statistics)
+{
+    NdisMoveMemory(
+        TunPacketBegin(Irp, Buffer, Format, Copy->Size, Copy->OriginalSize, Copy->Priority), Copy->Data, Copy->Size);
+    TunPacketEnd(Irp, Format, Copy->Size);
+
+    if (!Statistics)
+        return;
+    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutOctets, Copy->Size);
+    InterlockedAdd64((LONG64 *)&Statistics->ifHCOutUcastOctets, Copy->Size);
+    InterlockedIncrement64((LONG64 *)&Statistics->ifHCOutUcastPkts);
+}
+
+#define NET_BUFFER_LIST_REFCOUNT(nbl) ((volatile LONG64 *)NET_BUFFER_LIST_MINIPORT_RESERVED(nbl))
+
+_IRQL_requires_same_ static void
+TunNBLRefInit(_Inout_ TUN_CTX *Ctx, _Inout_ NET_BUFFER_LIST *Nbl, _In_ LONG Count)
+{
+    TunActiveNBLAdd(Ctx, Count);
+    InterlockedAdd(&Ctx->PacketQueue.NumNbl, Count);
+    for (; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+        InterlockedExchange64(NET_BUFFER_LIST_REFCOUNT(Nbl), 1);
+}
+
+_IRQL_requires_same_ static void
+TunNBLRefInc(_Inout_ NET_BUFFER_LIST *Nbl)
 {
     ASSERT(InterlockedGet64(NET_BUFFER_LIST_REFCOUNT(Nbl)));
     InterlockedIncrement64(NET_BUFFER_LIST_REFCOUNT(Nbl));
 }
 
-_When_((SendCompleteFlags & NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL), _IRQL_requires_(DISPATCH_LEVEL))
-_When_(!(SendCompleteFlags & NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL), _IRQL_requires_max_(DISPATCH_LEVEL))
-static BOOLEAN
-TunNBLRefDec(_Inout_ TUN_CTX *Ctx, _Inout_ NET_BUFFER_LIST *Nbl, _In_ ULONG SendCompleteFlags)
+_IRQL_requires_same_ static void
+TunAppendNBL(_Inout_ NET_BUFFER_LIST **Head, _Inout_ NET_BUFFER_LIST **Tail, __drv_aliasesMem _In_ NET_BUFFER_LIST *Nbl)
+{
+    *(*Tail ? &NET_BUFFER_LIST_NEXT_NBL(*Tail) : Head) = Nbl;
+    *Tail = Nbl;
+    NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+}
+
+/* Drops a reference, collecting the NBL for TunNBLComplete once the last one is gone. The NBL leaves the queue's
+ * count right away, so that the room it made can be filled while it waits for completion. */
+_IRQL_requires_same_ static BOOLEAN
+TunNBLRefDec(_Inout_ TUN_CTX *Ctx, _Inout_ NET_BUFFER_LIST *Nbl, _Inout_ TUN_COMPLETED_NBLS *Completed)
 {
     ASSERT(InterlockedGet64(NET_BUFFER_LIST_REFCOUNT(Nbl)) > 0);
     if (InterlockedDecrement64(NET_BUFFER_LIST_REFCOUNT(Nbl)) <= 0)
     {
-        NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
-        NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, Nbl, SendCompleteFlags);
+        TunAppendNBL(&Completed->First, &Completed->Last, Nbl);
+        Completed->Count++;
         ASSERT(InterlockedGet(&Ctx->PacketQueue.NumNbl) > 0);
         InterlockedDecrement(&Ctx->PacketQueue.NumNbl);
-        TunCompletePause(Ctx, TRUE);
         return TRUE;
     }
     return FALSE;
 }
 
-_IRQL_requires_same_ static void
-TunAppendNBL(_Inout_ NET_BUFFER_LIST **Head, _Inout_ NET_BUFFER_LIST **Tail, __drv_aliasesMem _In_ NET_BUFFER_LIST *Nbl)
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunNBLComplete(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_COMPLETED_NBLS *Completed)
 {
-    *(*Tail ? &NET_BUFFER_LIST_NEXT_NBL(*Tail) : Head) = Nbl;
-    *Tail = Nbl;
-    NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+    if (!Completed->First)
+        return;
+    NdisMSendNetBufferListsComplete(
+        Ctx->MiniportAdapterHandle,
+        Completed->First,
+        KeGetCurrentIrql() == DISPATCH_LEVEL ? NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL : 0);
+    if (Completed->Count)
+        TunCompletePause(Ctx, Completed->Count, TRUE);
+    Completed->First = Completed->Last = NULL;
+    Completed->Count = 0;
+}
+
+/* With the ACK filter on, the first NB of every queued NBL carries the flow entry it was last recorded in, and whether
+ * a newer ACK superseded it. */
+#define NET_BUFFER_ACK_FLOW(nb) (*(TUN_ACK_FLOW **)&NET_BUFFER_MINIPORT_RESERVED(nb)[0])
+#define NET_BUFFER_ACK_SUPERSEDED(nb) (NET_BUFFER_MINIPORT_RESERVED(nb)[1])
+
+/* Classifies the first NB of a queued NBL by TunAckClassify, which only sees whole headers. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+TunAckClassifyNb(
+    _In_ NET_BUFFER *Nb,
+    _Out_writes_bytes_(TUN_ACK_KEY_SIZE) UCHAR *Key,
+    _Out_ UCHAR *KeySize,
+    _Out_ ULONG *Ack)
+{
+    UCHAR storage[80]; /* An IPv4 header with all the options it can have, and a TCP header without */
+    ULONG size = NET_BUFFER_DATA_LENGTH(Nb);
+    if (size < 40 || size > sizeof(storage))
+        return FALSE;
+    const UCHAR *ip = NdisGetDataBuffer(Nb, size, storage, 1, 0);
+    return ip && TunAckClassify(ip, size, Key, KeySize, Ack);
+}
+
+/* Records a pure ACK just appended to a lane, and marks the ACK it makes redundant, if any, to be skipped. */
+_Requires_lock_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunAckFilterRecord(
+    _Inout_ TUN_CTX *Ctx,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_ TUN_LANE_ID Lane,
+    _In_reads_bytes_(KeySize) const UCHAR *Key,
+    _In_ UCHAR KeySize,
+    _In_ ULONG Ack)
+{
+    VOID *superseded;
+    TUN_ACK_FLOW *flow =
+        TunAckRecord(Ctx->PacketQueue.AckFilter.Flows, Nbl, (UCHAR)Lane, Key, KeySize, Ack, &superseded);
+    if (superseded)
+    {
+        NET_BUFFER_ACK_SUPERSEDED(NET_BUFFER_LIST_FIRST_NB((NET_BUFFER_LIST *)superseded)) = (PVOID)TRUE;
+        Ctx->PacketQueue.AckFilter.Superseded++;
+    }
+    NET_BUFFER_ACK_FLOW(NET_BUFFER_LIST_FIRST_NB(Nbl)) = flow;
+}
+
+/* Must be called whenever an NBL leaves the lanes, so no flow entry outlives it. */
+_Requires_lock_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunAckFilterForget(_Inout_ TUN_CTX *Ctx, _In_ NET_BUFFER_LIST *Nbl)
+{
+    if (!Ctx->Config.AckFilter)
+        return;
+    TUN_ACK_FLOW *flow = NET_BUFFER_ACK_FLOW(NET_BUFFER_LIST_FIRST_NB(Nbl));
+    if (flow && flow->Nbl == Nbl)
+        flow->Nbl = NULL;
+}
+
+_Requires_lock_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunLaneDropFirst(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_LANE *Lane, _Inout_ TUN_COMPLETED_NBLS *Completed)
+{
+    NET_BUFFER_LIST *nbl_second = NET_BUFFER_LIST_NEXT_NBL(Lane->FirstNbl);
+
+    TunAckFilterForget(Ctx, Lane->FirstNbl);
+    NET_BUFFER_LIST_STATUS(Lane->FirstNbl) = NDIS_STATUS_SEND_ABORTED;
+    TunNBLRefDec(Ctx, Lane->FirstNbl, Completed);
+
+    Lane->NextNb = NULL;
+    Lane->FirstNbl = nbl_second;
+    if (!Lane->FirstNbl)
+        Lane->LastNbl = NULL;
+    Lane->NumNbl--;
+    Lane->DroppedNbls++;
 }
 
 _Requires_lock_not_held_(Ctx->PacketQueue.Lock)
@@ -460,73 +1209,130 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 static void
 TunQueueAppend(_Inout_ TUN_CTX *Ctx, _In_ NET_BUFFER_LIST *Nbl, _In_ UINT MaxNbls)
 {
+    TUN_COMPLETED_NBLS completed = { NULL, NULL, 0 };
+    struct
+    {
+        NET_BUFFER_LIST *First, *Last;
+        LONG Count;
+    } chains[TUN_LANE_COUNT] = { 0 };
+
+    /* Sorted into lanes before taking the lock, which is then taken once for the lot. */
     for (NET_BUFFER_LIST *nbl_next; Nbl; Nbl = nbl_next)
     {
         nbl_next = NET_BUFFER_LIST_NEXT_NBL(Nbl);
         if (!NET_BUFFER_LIST_FIRST_NB(Nbl))
         {
-            NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
-            NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, Nbl, 0);
+            /* Never queued, so it does not count. */
+            TunAppendNBL(&completed.First, &completed.Last, Nbl);
             continue;
         }
+        TUN_LANE_ID lane_id = TunLaneOfPriority(TunNBLPriority(Nbl));
+        TunAppendNBL(&chains[lane_id].First, &chains[lane_id].Last, Nbl);
+        chains[lane_id].Count++;
+    }
 
-        KLOCK_QUEUE_HANDLE lqh;
-        KeAcquireInStackQueuedSpinLock(&Ctx->PacketQueue.Lock, &lqh);
-        TunNBLRefInit(Ctx, Nbl);
-        TunAppendNBL(&Ctx->PacketQueue.FirstNbl, &Ctx->PacketQueue.LastNbl, Nbl);
-
-        while ((UINT)InterlockedGet(&Ctx->PacketQueue.NumNbl) > MaxNbls && Ctx->PacketQueue.FirstNbl)
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLock(&Ctx->PacketQueue.Lock, &lqh);
+    for (TUN_LANE_ID lane_id = 0; lane_id < TUN_LANE_COUNT; ++lane_id)
+    {
+        if (!chains[lane_id].First)
+            continue;
+        TUN_LANE *lane = &Ctx->PacketQueue.Lanes[lane_id];
+        TunNBLRefInit(Ctx, chains[lane_id].First, chains[lane_id].Count);
+        *(lane->LastNbl ? &NET_BUFFER_LIST_NEXT_NBL(lane->LastNbl) : &lane->FirstNbl) = chains[lane_id].First;
+        lane->LastNbl = chains[lane_id].Last;
+        lane->NumNbl += chains[lane_id].Count;
+        lane->QueuedNbls += chains[lane_id].Count;
+
+        /* Recorded before any are dropped, so no flow entry is left pointing at a dropped NBL. */
+        for (NET_BUFFER_LIST *nbl = Ctx->Config.AckFilter ? chains[lane_id].First : NULL; nbl;
+             nbl = NET_BUFFER_LIST_NEXT_NBL(nbl))
         {
-            NET_BUFFER_LIST *nbl_second = NET_BUFFER_LIST_NEXT_NBL(Ctx->PacketQueue.FirstNbl);
-
-            NET_BUFFER_LIST_STATUS(Ctx->PacketQueue.FirstNbl) = NDIS_STATUS_SEND_ABORTED;
-            TunNBLRefDec(Ctx, Ctx->PacketQueue.FirstNbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-
-            Ctx->PacketQueue.NextNb = NULL;
-            Ctx->PacketQueue.FirstNbl = nbl_second;
-            if (!Ctx->PacketQueue.FirstNbl)
-                Ctx->PacketQueue.LastNbl = NULL;
+            UCHAR ack_key[TUN_ACK_KEY_SIZE], ack_key_size;
+            ULONG ack_number;
+            NET_BUFFER *nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+            NET_BUFFER_ACK_FLOW(nb) = NULL;
+            NET_BUFFER_ACK_SUPERSEDED(nb) = (PVOID)FALSE;
+            if (!NET_BUFFER_NEXT_NB(nb) && TunAckClassifyNb(nb, ack_key, &ack_key_size, &ack_number))
+                TunAckFilterRecord(Ctx, nbl, lane_id, ack_key, ack_key_size, ack_number);
         }
+    }
 
-        KeReleaseInStackQueuedSpinLock(&lqh);
+    /* Lanes over their own limit drop their oldest NBLs, then, when the queue as a whole is full, the oldest NBLs of
+     * the least important lanes make room. */
+    LONG num_nbl[TUN_LANE_COUNT], max_nbls[TUN_LANE_COUNT];
+    for (TUN_LANE_ID lane_id = 0; lane_id < TUN_LANE_COUNT; ++lane_id)
+    {
+        num_nbl[lane_id] = Ctx->PacketQueue.Lanes[lane_id].NumNbl;
+        max_nbls[lane_id] = Ctx->PacketQueue.Lanes[lane_id].MaxNbls;
+    }
+    for (;;)
+    {
+        TUN_LANE_ID lane_id =
+            TunLaneToDrop(num_nbl, max_nbls, (ULONG)InterlockedGet(&Ctx->PacketQueue.NumNbl), MaxNbls);
+        if (lane_id >= TUN_LANE_COUNT)
+            break;
+        TunLaneDropFirst(Ctx, &Ctx->PacketQueue.Lanes[lane_id], &completed);
+        num_nbl[lane_id]--;
     }
+
+    KeReleaseInStackQueuedSpinLock(&lqh);
+    TunNBLComplete(Ctx, &completed);
 }
 
 _Requires_lock_held_(Ctx->PacketQueue.Lock)
 _IRQL_requires_(DISPATCH_LEVEL)
 _Must_inspect_result_
-static _Return_type_success_(return !=
-                                    NULL) NET_BUFFER *TunQueueRemove(_Inout_ TUN_CTX *Ctx, _Out_ NET_BUFFER_LIST **Nbl)
+static _Return_type_success_(return != NULL) NET_BUFFER *TunQueueRemove(
+    _Inout_ TUN_CTX *Ctx,
+    _Out_ NET_BUFFER_LIST **Nbl,
+    _Out_ TUN_LANE_ID *LaneId,
+    _Inout_ TUN_COMPLETED_NBLS *Completed)
 {
     NET_BUFFER_LIST *nbl_top;
     NET_BUFFER *ret;
+    TUN_LANE *lane;
 
 retry:
-    nbl_top = Ctx->PacketQueue.FirstNbl;
-    *Nbl = nbl_top;
-    if (!nbl_top)
+    for (*LaneId = TUN_LANE_HIGH; *LaneId < TUN_LANE_COUNT && !Ctx->PacketQueue.Lanes[*LaneId].FirstNbl; ++*LaneId)
+        ;
+    if (*LaneId >= TUN_LANE_COUNT)
+    {
+        *Nbl = NULL;
         return NULL;
-    if (!Ctx->PacketQueue.NextNb)
-        Ctx->PacketQueue.NextNb = NET_BUFFER_LIST_FIRST_NB(nbl_top);
-    ret = Ctx->PacketQueue.NextNb;
-    Ctx->PacketQueue.NextNb = NET_BUFFER_NEXT_NB(ret);
-    if (!Ctx->PacketQueue.NextNb)
-    {
-        Ctx->PacketQueue.FirstNbl = NET_BUFFER_LIST_NEXT_NBL(nbl_top);
-        if (!Ctx->PacketQueue.FirstNbl)
-            Ctx->PacketQueue.LastNbl = NULL;
+    }
+    lane = &Ctx->PacketQueue.Lanes[*LaneId];
+    nbl_top = lane->FirstNbl;
+    *Nbl = nbl_top;
+    if (!lane->NextNb)
+        lane->NextNb = NET_BUFFER_LIST_FIRST_NB(nbl_top);
+    ret = lane->NextNb;
+    lane->NextNb = NET_BUFFER_NEXT_NB(ret);
+    if (!lane->NextNb)
+    {
+        TunAckFilterForget(Ctx, nbl_top);
+        lane->FirstNbl = NET_BUFFER_LIST_NEXT_NBL(nbl_top);
+        if (!lane->FirstNbl)
+            lane->LastNbl = NULL;
+        lane->NumNbl--;
         NET_BUFFER_LIST_NEXT_NBL(nbl_top) = NULL;
     }
     else
         TunNBLRefInc(nbl_top);
 
-    if (ret && NET_BUFFER_DATA_LENGTH(ret) > TUN_EXCH_MAX_IP_PACKET_SIZE)
+    if (ret && NET_BUFFER_DATA_LENGTH(ret) > Ctx->Config.MaxIpPacketSize)
     {
         NET_BUFFER_LIST_STATUS(nbl_top) = NDIS_STATUS_INVALID_LENGTH;
-        TunNBLRefDec(Ctx, nbl_top, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+        TunNBLRefDec(Ctx, nbl_top, Completed);
         InterlockedIncrement64((LONG64 *)&Ctx->Statistics.ifOutDiscards);
         goto retry;
     }
+    /* A newer ACK is queued behind this one, which saves userspace from sending both. */
+    if (Ctx->Config.AckFilter && ret == NET_BUFFER_LIST_FIRST_NB(nbl_top) && NET_BUFFER_ACK_SUPERSEDED(ret))
+    {
+        TunNBLRefDec(Ctx, nbl_top, Completed);
+        goto retry;
+    }
 
     return ret;
 }
@@ -535,41 +1341,161 @@ retry:
 _Requires_lock_held_(Ctx->PacketQueue.Lock)
 _IRQL_requires_(DISPATCH_LEVEL)
 static void
-TunQueuePrepend(_Inout_ TUN_CTX *Ctx, _In_ NET_BUFFER *Nb, _In_ NET_BUFFER_LIST *Nbl)
+TunQueuePrepend(_Inout_ TUN_CTX *Ctx, _In_ TUN_LANE_ID LaneId, _In_ NET_BUFFER *Nb, _In_ NET_BUFFER_LIST *Nbl)
 {
-    Ctx->PacketQueue.NextNb = Nb;
+    TUN_LANE *lane = &Ctx->PacketQueue.Lanes[LaneId];
+    lane->NextNb = Nb;
 
-    if (!Nbl || Nbl == Ctx->PacketQueue.FirstNbl)
+    if (!Nbl || Nbl == lane->FirstNbl)
         return;
 
     TunNBLRefInc(Nbl);
-    if (!Ctx->PacketQueue.FirstNbl)
-        Ctx->PacketQueue.FirstNbl = Ctx->PacketQueue.LastNbl = Nbl;
+    if (!lane->FirstNbl)
+        lane->FirstNbl = lane->LastNbl = Nbl;
     else
     {
-        NET_BUFFER_LIST_NEXT_NBL(Nbl) = Ctx->PacketQueue.FirstNbl;
-        Ctx->PacketQueue.FirstNbl = Nbl;
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = lane->FirstNbl;
+        lane->FirstNbl = Nbl;
+    }
+    lane->NumNbl++;
+}
+
+/* Copies the NBs of Nbl not yet handed out, starting at Nb if given, onto Copies, which are to join the parked list
+ * after, so that neither the allocations nor the copying hold up the queue lock. Returns FALSE if any had to be dropped
+ * because the parked list would be full, by packets or bytes, or memory ran out. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunQueuePark(
+    _Inout_ TUN_CTX *Ctx,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_opt_ NET_BUFFER *Nb,
+    _Inout_ TUN_PACKET_COPIES *Copies)
+{
+    BOOLEAN parked_all = TRUE;
+    UCHAR priority = TunNBLPriority(Nbl);
+    for (Nb = Nb ? Nb : NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+    {
+        ULONG p_size = NET_BUFFER_DATA_LENGTH(Nb);
+        TUN_PACKET_COPY *parked;
+        /* What is parked already only shrinks meanwhile, as readers take it. */
+        if (p_size > Ctx->Config.MaxIpPacketSize ||
+            ReadNoFence(&Ctx->PacketQueue.Parked.Count) + Copies->Count >= (LONG)Ctx->Config.QueueMaxNbls ||
+            ReadNoFence(&Ctx->PacketQueue.Parked.Bytes) + Copies->Bytes + (LONG)p_size > TUN_PARK_MAX_BYTES ||
+            (parked = ExAllocatePoolWithTag(
+                 NonPagedPoolNx, sizeof(TUN_PACKET_COPY) + p_size, TUN_HTONL(TUN_MEMORY_TAG))) == NULL)
+            goto cleanup_discard;
+        void *ptr = NdisGetDataBuffer(Nb, p_size, parked->Data, 1, 0);
+        if (!ptr)
+        {
+            ExFreePoolWithTag(parked, TUN_HTONL(TUN_MEMORY_TAG));
+            goto cleanup_discard;
+        }
+        if (ptr != parked->Data)
+            NdisMoveMemory(parked->Data, ptr, p_size);
+        parked->Next = NULL;
+        parked->Size = parked->OriginalSize = p_size;
+        parked->Priority = priority;
+        *(Copies->Last ? &Copies->Last->Next : &Copies->First) = parked;
+        Copies->Last = parked;
+        Copies->Count++;
+        Copies->Bytes += p_size;
+        continue;
+
+    cleanup_discard:
+        InterlockedIncrement64((LONG64 *)&Ctx->Statistics.ifOutDiscards);
+        parked_all = FALSE;
     }
+    return parked_all;
 }
 
+/* Empties the queue, parking what it held if Park is set, and dropping whatever was parked before otherwise. */
 _Requires_lock_not_held_(Ctx->PacketQueue.Lock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static void
-TunQueueClear(_Inout_ TUN_CTX *Ctx, _In_ NDIS_STATUS Status)
+TunQueueClear(_Inout_ TUN_CTX *Ctx, _In_ NDIS_STATUS Status, _In_ BOOLEAN Park)
 {
+    TUN_COMPLETED_NBLS completed = { NULL, NULL, 0 };
+    TUN_PACKET_COPIES discarded = { NULL, NULL, 0, 0 }, parked = { NULL, NULL, 0, 0 };
+    struct
+    {
+        NET_BUFFER_LIST *First;
+        NET_BUFFER *NextNb;
+    } lanes[TUN_LANE_COUNT];
     KLOCK_QUEUE_HANDLE lqh;
     KeAcquireInStackQueuedSpinLock(&Ctx->PacketQueue.Lock, &lqh);
-    for (NET_BUFFER_LIST *nbl = Ctx->PacketQueue.FirstNbl, *nbl_next; nbl; nbl = nbl_next)
+    if (!Park)
     {
-        nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
-        NET_BUFFER_LIST_STATUS(nbl) = Status;
-        TunNBLRefDec(Ctx, nbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+        discarded = Ctx->PacketQueue.Parked;
+        RtlZeroMemory(&Ctx->PacketQueue.Parked, sizeof(Ctx->PacketQueue.Parked));
+    }
+    for (TUN_LANE_ID lane_id = 0; lane_id < TUN_LANE_COUNT; ++lane_id)
+    {
+        TUN_LANE *lane = &Ctx->PacketQueue.Lanes[lane_id];
+        lanes[lane_id].First = lane->FirstNbl;
+        lanes[lane_id].NextNb = lane->NextNb;
+        lane->FirstNbl = NULL;
+        lane->LastNbl = NULL;
+        lane->NextNb = NULL;
+        lane->NumNbl = 0;
+    }
+    for (ULONG i = 0; i < TUN_ACK_FLOWS; ++i)
+        Ctx->PacketQueue.AckFilter.Flows[i].Nbl = NULL;
+
+    /* Parking copies with the lock released, which only a pausing adapter can afford, as nothing is queued to it
+     * meanwhile that resetting NumNbl below would lose count of. */
+    if (Park)
+        KeReleaseInStackQueuedSpinLock(&lqh);
+    for (TUN_LANE_ID lane_id = 0; lane_id < TUN_LANE_COUNT; ++lane_id)
+    {
+        for (NET_BUFFER_LIST *nbl = lanes[lane_id].First, *nbl_next; nbl; nbl = nbl_next)
+        {
+            nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
+            NET_BUFFER *nb = nbl == lanes[lane_id].First ? lanes[lane_id].NextNb : NULL;
+            NET_BUFFER_LIST_STATUS(nbl) = Park && TunQueuePark(Ctx, nbl, nb, &parked) ? NDIS_STATUS_SUCCESS : Status;
+            TunNBLRefDec(Ctx, nbl, &completed);
+        }
+    }
+    if (Park)
+    {
+        KeAcquireInStackQueuedSpinLock(&Ctx->PacketQueue.Lock, &lqh);
+        if (parked.First)
+        {
+            *(Ctx->PacketQueue.Parked.Last ? &Ctx->PacketQueue.Parked.Last->Next : &Ctx->PacketQueue.Parked.First) =
+                parked.First;
+            Ctx->PacketQueue.Parked.Last = parked.Last;
+            Ctx->PacketQueue.Parked.Count += parked.Count;
+            Ctx->PacketQueue.Parked.Bytes += parked.Bytes;
+        }
     }
-    Ctx->PacketQueue.FirstNbl = NULL;
-    Ctx->PacketQueue.LastNbl = NULL;
-    Ctx->PacketQueue.NextNb = NULL;
     InterlockedExchange(&Ctx->PacketQueue.NumNbl, 0);
     KeReleaseInStackQueuedSpinLock(&lqh);
+
+    /* Packets parked over an earlier pause that are now dropped count as discarded too. */
+    for (TUN_PACKET_COPY *copy = discarded.First, *copy_next; copy; copy = copy_next)
+    {
+        copy_next = copy->Next;
+        ExFreePoolWithTag(copy, TUN_HTONL(TUN_MEMORY_TAG));
+    }
+    if (discarded.Count)
+        InterlockedAdd64((LONG64 *)&Ctx->Statistics.ifOutDiscards, discarded.Count);
+    TunNBLComplete(Ctx, &completed);
+}
+
+/* Returns FALSE if the filter drops the packet, counting the drop against the instruction that decided it. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunFilterNb(_In_ const TUN_FILTER_PROG *Prog, _In_ NET_BUFFER *Nb)
+{
+    UCHAR storage[TUN_FILTER_MAX_BYTES];
+    ULONG length = NET_BUFFER_DATA_LENGTH(Nb), size = min(length, TUN_FILTER_MAX_BYTES), pc;
+    const UCHAR *data = NdisGetDataBuffer(Nb, size, storage, 1, 0);
+    if (!data)
+        size = 0;
+    if (TunFilterRun(Prog->Insns, data, size, length, &pc))
+        return TRUE;
+    InterlockedIncrement64((LONG64 *)&Prog->Drops[pc]);
+    return FALSE;
 }
 
 _Requires_lock_not_held_(Ctx->PacketQueue.Lock)
@@ -580,146 +1506,708 @@ TunQueueProcess(_Inout_ TUN_CTX *Ctx)
     IRP *irp = NULL;
     UCHAR *buffer = NULL;
     ULONG size = 0;
+    TUN_FILE_CTX *file_ctx = NULL;
     NET_BUFFER *nb;
+    struct
+    {
+        NET_BUFFER *Nb;
+        NET_BUFFER_LIST *Nbl;
+    } batch[TUN_DEQUEUE_BATCH];
+    TUN_COMPLETED_NBLS completed = { NULL, NULL, 0 };
     KLOCK_QUEUE_HANDLE lqh;
 
     for (;;)
     {
         NET_BUFFER_LIST *nbl;
+        TUN_LANE_ID lane;
 
         KeAcquireInStackQueuedSpinLock(&Ctx->PacketQueue.Lock, &lqh);
 
+        /* Packets parked over a pause go out ahead of anything queued since. */
+        TUN_PACKET_COPY *parked = Ctx->PacketQueue.Parked.First;
+        if (parked)
+        {
+            if (!irp && (irp = TunRemoveNextIrp(Ctx, &buffer, &size, &file_ctx)) == NULL)
+            {
+                KeReleaseInStackQueuedSpinLock(&lqh);
+                break;
+            }
+            _Analysis_assume_(buffer);
+            if (TunWontFitIntoIrp(irp, size, file_ctx->Format, parked->Size))
+            {
+                /* Read buffers always fit one packet of MaxIpPacketSize, which is all parking takes. */
+                ASSERT(irp->IoStatus.Information);
+                KeReleaseInStackQueuedSpinLock(&lqh);
+                TunReadFinish(irp, buffer, file_ctx->Format);
+                TunCompleteRequest(Ctx, irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+                irp = NULL;
+                continue;
+            }
+            if (!(Ctx->PacketQueue.Parked.First = parked->Next))
+                Ctx->PacketQueue.Parked.Last = NULL;
+            Ctx->PacketQueue.Parked.Count--;
+            Ctx->PacketQueue.Parked.Bytes -= parked->Size;
+            KeReleaseInStackQueuedSpinLock(&lqh);
+
+            TunWriteCopyIntoIrp(irp, buffer, file_ctx->Format, parked, &Ctx->Statistics);
+            ExFreePoolWithTag(parked, TUN_HTONL(TUN_MEMORY_TAG));
+            continue;
+        }
+
         /* Get head NB (and IRP). */
         if (!irp)
         {
-            nb = TunQueueRemove(Ctx, &nbl);
+            nb = TunQueueRemove(Ctx, &nbl, &lane, &completed);
             if (!nb)
             {
                 KeReleaseInStackQueuedSpinLock(&lqh);
-                return;
+                break;
             }
-            irp = TunRemoveNextIrp(Ctx, &buffer, &size);
+            irp = TunRemoveNextIrp(Ctx, &buffer, &size, &file_ctx);
             if (!irp)
             {
-                TunQueuePrepend(Ctx, nb, nbl);
+                TunQueuePrepend(Ctx, lane, nb, nbl);
                 KeReleaseInStackQueuedSpinLock(&lqh);
                 if (nbl)
-                    TunNBLRefDec(Ctx, nbl, 0);
-                return;
+                    TunNBLRefDec(Ctx, nbl, &completed);
+                break;
             }
 
             _Analysis_assume_(buffer);
             _Analysis_assume_(irp->IoStatus.Information <= size);
         }
         else
-            nb = TunQueueRemove(Ctx, &nbl);
+            nb = TunQueueRemove(Ctx, &nbl, &lane, &completed);
 
-        /* If the NB won't fit in the IRP, return it. */
-        if (nb && TunWontFitIntoIrp(irp, size, nb))
+        /* Take as many NBs as fit in the IRP, to be copied once the lock is released. Each holds a reference to its
+         * NBL. The first that won't fit is returned. */
+        ULONG count = 0, dropped = 0, room = TunIrpRoom(irp, size, file_ctx->Format);
+        BOOLEAN full = FALSE;
+        for (; nb; nb = TunQueueRemove(Ctx, &nbl, &lane, &completed))
         {
-            TunQueuePrepend(Ctx, nb, nbl);
-            if (nbl)
-                TunNBLRefDec(Ctx, nbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-            nbl = NULL;
-            nb = NULL;
+            ULONG footprint = TunPacketFootprint(file_ctx->Format, NET_BUFFER_DATA_LENGTH(nb));
+            if (room < footprint)
+            {
+                TunQueuePrepend(Ctx, lane, nb, nbl);
+                if (nbl)
+                    TunNBLRefDec(Ctx, nbl, &completed);
+                nb = NULL;
+                full = TRUE;
+                break;
+            }
+            room -= footprint;
+            batch[count].Nb = nb;
+            batch[count].Nbl = nbl;
+            if (++count == TUN_DEQUEUE_BATCH)
+                break;
         }
 
         KeReleaseInStackQueuedSpinLock(&lqh);
 
-        /* Process NB and IRP. */
-        if (nb)
+        /* Process NBs and IRP. */
+        const TUN_FILTER_PROG *filter = ReadPointerNoFence((PVOID *)&file_ctx->Filter);
+        LONG node = ReadNoFence(&file_ctx->Node);
+        for (ULONG i = 0; i < count; ++i)
         {
-            NTSTATUS status = TunWriteIntoIrp(irp, buffer, nb, &Ctx->Statistics);
-            if (!NT_SUCCESS(status))
+            if (filter && !TunFilterNb(filter, batch[i].Nb))
             {
-                if (nbl)
-                    NET_BUFFER_LIST_STATUS(nbl) = status;
-                IoCsqInsertIrpEx(&Ctx->Device.ReadQueue.Csq, irp, NULL, TUN_CSQ_INSERT_HEAD);
-                irp = NULL;
+                InterlockedIncrement64((LONG64 *)&Ctx->Statistics.ifOutDiscards);
+                ++dropped;
+            }
+            else
+            {
+                NTSTATUS status =
+                    TunWriteIntoIrp(irp, buffer, file_ctx->Format, batch[i].Nbl, batch[i].Nb, &Ctx->Statistics);
+                if (node >= 0 && (USHORT)node != KeGetCurrentNodeNumber())
+                    InterlockedIncrement64(&Ctx->Affinity.CrossNodeCopies);
+                if (!NT_SUCCESS(status) && batch[i].Nbl)
+                    NET_BUFFER_LIST_STATUS(batch[i].Nbl) = status;
             }
+            if (batch[i].Nbl)
+                TunNBLRefDec(Ctx, batch[i].Nbl, &completed);
         }
+
+        /* Stopping short of the batch size means the IRP is full or the queue empty, either of which completes it,
+         * unless nothing made it in. Room is counted before filtering, so packets the filter dropped leave the IRP
+         * full only on paper, and it goes on taking more. */
+        if (count == TUN_DEQUEUE_BATCH || (full && dropped))
+            continue;
+        if (!irp->IoStatus.Information)
+            IoCsqInsertIrpEx(&Ctx->Device.ReadQueue.Csq, irp, NULL, TUN_CSQ_INSERT_HEAD);
         else
         {
+            TunReadFinish(irp, buffer, file_ctx->Format);
             TunCompleteRequest(Ctx, irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
-            irp = NULL;
         }
-
-        if (nbl)
-            TunNBLRefDec(Ctx, nbl, 0);
+        irp = NULL;
+        /* The packets of a read go back to the network stack together. */
+        TunNBLComplete(Ctx, &completed);
     }
+    TunNBLComplete(Ctx, &completed);
 }
 
-_IRQL_requires_same_ static void
-TunSetNBLStatus(_Inout_opt_ NET_BUFFER_LIST *Nbl, _In_ NDIS_STATUS Status)
+/* Pins the adapter at Index of a mux with its remove lock, or returns NULL if it has left. Drainers of the adapters
+ * take the lock while holding their rundown, so waiting for a rundown under it could deadlock against a barrier. The
+ * caller takes the rundown once the lock is dropped instead, as halting only waits for the remove lock after taking
+ * the adapter out of the mux. */
+_Requires_lock_not_held_(Mux->Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static TUN_CTX *
+TunMuxPin(_Inout_ TUN_MUX *Mux, _In_ ULONG Index)
 {
-    for (; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
-        NET_BUFFER_LIST_STATUS(Nbl) = Status;
+    KeAcquireSpinLockAtDpcLevel(&Mux->Lock);
+    TUN_CTX *ctx = Mux->Adapters[Index].Ctx;
+    if (ctx && !NT_SUCCESS(IoAcquireRemoveLock(&ctx->Device.RemoveLock, Mux)))
+        ctx = NULL;
+    KeReleaseSpinLockFromDpcLevel(&Mux->Lock);
+    return ctx;
 }
 
-static MINIPORT_SEND_NET_BUFFER_LISTS TunSendNetBufferLists;
-_Use_decl_annotations_
-static void
-TunSendNetBufferLists(
-    NDIS_HANDLE MiniportAdapterContext,
-    NET_BUFFER_LIST *NetBufferLists,
-    NDIS_PORT_NUMBER PortNumber,
-    ULONG SendFlags)
+/* Takes up to TUN_MUX_QUANTUM packets parked or queued on an adapter into a mux read, as a single run tagged with
+ * the adapter's LUID index. Returns how many packets were taken, and sets Full if the next one did not fit. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static ULONG
+TunMuxTake(
+    _Inout_ TUN_CTX *Ctx,
+    _In_ ULONG LuidIndex,
+    _Inout_ IRP *Irp,
+    _Inout_ UCHAR *Buffer,
+    _In_ ULONG Size,
+    _In_opt_ const TUN_FILTER_PROG *Filter,
+    _Out_ BOOLEAN *Full)
 {
-    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
+    ULONG run = (ULONG)Irp->IoStatus.Information, copies = 0, count = 0, packets = 0;
+    TUN_PACKET_COPY *parked[TUN_MUX_QUANTUM];
+    struct
+    {
+        NET_BUFFER *Nb;
+        NET_BUFFER_LIST *Nbl;
+    } batch[TUN_MUX_QUANTUM];
+    TUN_COMPLETED_NBLS completed = { NULL, NULL, 0 };
+    KLOCK_QUEUE_HANDLE lqh;
 
-    InterlockedIncrement64(&ctx->ActiveNBLCount);
+    *Full = Size - run <= sizeof(TUN_MUX_RUN);
+    if (*Full)
+        return 0;
+    ULONG room = Size - run - sizeof(TUN_MUX_RUN);
 
-    KIRQL irql = ExAcquireSpinLockShared(&ctx->TransitionLock);
-    LONG flags = InterlockedGet(&ctx->Flags);
-    NDIS_STATUS status;
-    if ((status = NDIS_STATUS_ADAPTER_REMOVED, !(flags & TUN_FLAGS_PRESENT)) ||
-        (status = NDIS_STATUS_PAUSED, !(flags & TUN_FLAGS_RUNNING)) ||
-        (status = NDIS_STATUS_MEDIA_DISCONNECTED, InterlockedGet64(&ctx->Device.RefCount) <= 0))
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->PacketQueue.Lock, &lqh);
+    /* Packets parked over a pause go out ahead of anything queued since. */
+    for (TUN_PACKET_COPY *copy; copies < TUN_MUX_QUANTUM && (copy = Ctx->PacketQueue.Parked.First) != NULL;)
     {
-        TunSetNBLStatus(NetBufferLists, status);
-        NdisMSendNetBufferListsComplete(
-            ctx->MiniportAdapterHandle, NetBufferLists, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-        goto cleanup_ExReleaseSpinLockShared;
+        ULONG footprint = TunPacketFootprint(TUN_EXCH_FORMAT_V1, copy->Size);
+        if (room < footprint)
+        {
+            *Full = TRUE;
+            break;
+        }
+        room -= footprint;
+        if (!(Ctx->PacketQueue.Parked.First = copy->Next))
+            Ctx->PacketQueue.Parked.Last = NULL;
+        Ctx->PacketQueue.Parked.Count--;
+        Ctx->PacketQueue.Parked.Bytes -= copy->Size;
+        parked[copies++] = copy;
     }
+    if (!Ctx->PacketQueue.Parked.First)
+    {
+        NET_BUFFER_LIST *nbl;
+        TUN_LANE_ID lane;
+        for (NET_BUFFER *nb;
+             copies + count < TUN_MUX_QUANTUM && (nb = TunQueueRemove(Ctx, &nbl, &lane, &completed)) != NULL;)
+        {
+            ULONG footprint = TunPacketFootprint(TUN_EXCH_FORMAT_V1, NET_BUFFER_DATA_LENGTH(nb));
+            if (room < footprint)
+            {
+                TunQueuePrepend(Ctx, lane, nb, nbl);
+                if (nbl)
+                    TunNBLRefDec(Ctx, nbl, &completed);
+                *Full = TRUE;
+                break;
+            }
+            room -= footprint;
+            batch[count].Nb = nb;
+            batch[count].Nbl = nbl;
+            ++count;
+        }
+    }
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
 
-    TunQueueAppend(ctx, NetBufferLists, TUN_QUEUE_MAX_NBLS);
-
-    TunQueueProcess(ctx);
+    Irp->IoStatus.Information += sizeof(TUN_MUX_RUN);
+    for (ULONG i = 0; i < copies; ++i)
+    {
+        TunWriteCopyIntoIrp(Irp, Buffer, TUN_EXCH_FORMAT_V1, parked[i], &Ctx->Statistics);
+        ExFreePoolWithTag(parked[i], TUN_HTONL(TUN_MEMORY_TAG));
+        ++packets;
+    }
+    for (ULONG i = 0; i < count; ++i)
+    {
+        if (Filter && !TunFilterNb(Filter, batch[i].Nb))
+        {
+            InterlockedIncrement64((LONG64 *)&Ctx->Statistics.ifOutDiscards);
+            /* Frees the room it was counted against, so the read is not full after all. */
+            *Full = FALSE;
+        }
+        else
+        {
+            NTSTATUS status =
+                TunWriteIntoIrp(Irp, Buffer, TUN_EXCH_FORMAT_V1, batch[i].Nbl, batch[i].Nb, &Ctx->Statistics);
+            if (NT_SUCCESS(status))
+                ++packets;
+            else if (batch[i].Nbl)
+                NET_BUFFER_LIST_STATUS(batch[i].Nbl) = status;
+        }
+        if (batch[i].Nbl)
+            TunNBLRefDec(Ctx, batch[i].Nbl, &completed);
+    }
+    TunNBLComplete(Ctx, &completed);
 
-cleanup_ExReleaseSpinLockShared:
-    ExReleaseSpinLockShared(&ctx->TransitionLock, irql);
-    TunCompletePause(ctx, TRUE);
+    if (!packets)
+        Irp->IoStatus.Information = run;
+    else
+    {
+        TUN_MUX_RUN *header = (TUN_MUX_RUN *)(Buffer + run);
+        header->LuidIndex = LuidIndex;
+        header->Size = (ULONG)Irp->IoStatus.Information - run - sizeof(TUN_MUX_RUN);
+        header->Count = packets;
+        header->Reserved = 0;
+    }
+    return copies + count;
 }
 
-static MINIPORT_CANCEL_SEND TunCancelSend;
-_Use_decl_annotations_
+/* Fills the pending reads of a mux with runs taken from its adapters in turn, so that each adapter with packets gets
+ * TUN_MUX_QUANTUM of them in before any gets more. A read is completed once it is full or a whole round of the
+ * adapters found nothing more to take, and the next read carries on with the adapter after the last one served. */
+_IRQL_requires_(DISPATCH_LEVEL)
 static void
-TunCancelSend(NDIS_HANDLE MiniportAdapterContext, PVOID CancelId)
+TunMuxProcess(_Inout_ TUN_MUX *Mux)
 {
-    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
-    KLOCK_QUEUE_HANDLE lqh;
+    TUN_CTX *home = Mux->Ctx;
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)Mux->FileObject->FsContext;
+    const TUN_FILTER_PROG *filter = ReadPointerNoFence((PVOID *)&file_ctx->Filter);
 
-    KeAcquireInStackQueuedSpinLock(&ctx->PacketQueue.Lock, &lqh);
-
-    NET_BUFFER_LIST *nbl_last = NULL, **nbl_last_link = &ctx->PacketQueue.FirstNbl;
-    for (NET_BUFFER_LIST *nbl = ctx->PacketQueue.FirstNbl, *nbl_next; nbl; nbl = nbl_next)
+    for (IRP *irp; (irp = IoCsqRemoveNextIrp(&home->Device.MuxQueue.Csq, Mux->FileObject)) != NULL;)
     {
-        nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
-        if (NDIS_GET_NET_BUFFER_LIST_CANCEL_ID(nbl) == CancelId)
+        ULONG size = IoGetCurrentIrpStackLocation(irp)->Parameters.Read.Length;
+        UCHAR *buffer = TunIrpBuffer(irp, &file_ctx->ReadBuffer, NULL, NULL);
+        BOOLEAN full = FALSE;
+        for (ULONG idle = 0; idle < Mux->Count;)
         {
-            NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SEND_ABORTED;
-            *nbl_last_link = nbl_next;
-            TunNBLRefDec(ctx, nbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+            ULONG taken = 0;
+            TUN_CTX *ctx = TunMuxPin(Mux, Mux->Next);
+            if (ctx)
+            {
+                if (ReadNoFence(&ctx->PacketQueue.NumNbl) || ReadNoFence(&ctx->PacketQueue.Parked.Count))
+                {
+                    KIRQL irql = TunRundownAcquire(ctx);
+                    if (ReadNoFence(&ctx->Flags) & TUN_FLAGS_PRESENT)
+                        taken = TunMuxTake(ctx, Mux->Adapters[Mux->Next].LuidIndex, irp, buffer, size, filter, &full);
+                    TunRundownRelease(ctx, irql);
+                }
+                IoReleaseRemoveLock(&ctx->Device.RemoveLock, Mux);
+            }
+            /* The adapter whose packet did not fit goes first in the next read. */
+            if (full)
+                break;
+            idle = taken ? 0 : idle + 1;
+            Mux->Next = (Mux->Next + 1) % Mux->Count;
         }
-        else
+
+        if (!irp->IoStatus.Information)
         {
-            nbl_last = nbl;
-            nbl_last_link = &NET_BUFFER_LIST_NEXT_NBL(nbl);
+            IoCsqInsertIrpEx(&home->Device.MuxQueue.Csq, irp, NULL, TUN_CSQ_INSERT_HEAD);
+            break;
         }
+        TunCompleteRequest(home, irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+    }
+}
+
+/* Services the reads of a mux, unless somebody already is, like TunQueueKick does for an adapter. Its adapters kick
+ * it whenever they are left with packets that none of their own reads took. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunMuxKick(_Inout_ TUN_MUX *Mux)
+{
+    if (InterlockedIncrement(&Mux->DrainRequests) > 1)
+        return;
+    /* Keeps the filter of the mux handle from being freed meanwhile. */
+    KIRQL irql = TunRundownAcquire(Mux->Ctx);
+    LONG requests;
+    do
+    {
+        requests = ReadNoFence(&Mux->DrainRequests);
+        TunMuxProcess(Mux);
+    } while (InterlockedAdd(&Mux->DrainRequests, -requests) > 0);
+    TunRundownRelease(Mux->Ctx, irql);
+}
+
+#define TUN_QUEUE_DRAIN_ROUNDS 8 /* Passes over the queue in one go before handing over to a drain DPC */
+
+/* Services the queue as its one drainer, for as long as DrainRequests counts requests not yet seen to. Each pass
+ * starts with the read at the head of the read queue, so if that belongs to a handle with affinity to some other
+ * processor, draining moves on to that processor, along with the drainer's role. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunQueueDrain(_Inout_ TUN_CTX *Ctx)
+{
+    ULONG current = KeGetCurrentProcessorIndex();
+    for (ULONG round = 0;; ++round)
+    {
+        if (round == TUN_QUEUE_DRAIN_ROUNDS)
+        {
+            /* Requests keep coming. Let the other DPCs of this processor have a go, and carry on after them. */
+            KeInsertQueueDpc(&Ctx->Cpus[current].DrainDpc, NULL, NULL);
+            return;
+        }
+        LONG requests = ReadNoFence(&Ctx->PacketQueue.DrainRequests);
+        if (ReadNoFence(&Ctx->Affinity.Handles))
+        {
+            LONG processor = -1;
+            KeAcquireSpinLockAtDpcLevel(&Ctx->Device.ReadQueue.Lock);
+            IRP *irp = TunCsqPeekNextIrp(&Ctx->Device.ReadQueue.Csq, NULL, NULL);
+            if (irp)
+                processor = ReadNoFence(
+                    &((TUN_FILE_CTX *)IoGetCurrentIrpStackLocation(irp)->FileObject->FsContext)->Processor);
+            KeReleaseSpinLockFromDpcLevel(&Ctx->Device.ReadQueue.Lock);
+            if (processor >= 0 && (ULONG)processor != current)
+            {
+                KeInsertQueueDpc(&Ctx->Cpus[processor].DrainDpc, NULL, NULL);
+                return;
+            }
+        }
+        TunQueueProcess(Ctx);
+        /* Whatever the adapter's own reads left is for the mux it is subscribed to. */
+        TUN_MUX *mux = ReadPointerNoFence((PVOID *)&Ctx->Mux);
+        if (mux && (ReadNoFence(&Ctx->PacketQueue.NumNbl) || ReadNoFence(&Ctx->PacketQueue.Parked.Count)))
+            TunMuxKick(mux);
+        if (InterlockedAdd(&Ctx->PacketQueue.DrainRequests, -requests) <= 0)
+            return;
+    }
+}
+
+static KDEFERRED_ROUTINE TunQueueDrainDpc;
+_Use_decl_annotations_
+static VOID
+TunQueueDrainDpc(KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    TUN_CTX *ctx = DeferredContext;
+    KIRQL irql = TunRundownAcquire(ctx);
+    if (ReadNoFence(&ctx->Flags) & TUN_FLAGS_PRESENT)
+        TunQueueDrain(ctx);
+    else
+        InterlockedExchange(&ctx->PacketQueue.DrainRequests, 0);
+    TunRundownRelease(ctx, irql);
+}
+
+/* Services the queue, unless somebody already is, in which case all it takes is asking them to go round once more.
+ * Callers never wait for each other on the queue lock this way. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunQueueKick(_Inout_ TUN_CTX *Ctx)
+{
+    if (InterlockedIncrement(&Ctx->PacketQueue.DrainRequests) > 1)
+        return;
+    TunQueueDrain(Ctx);
+}
+
+/* Like TunQueueKick, but leaves the draining to a drain DPC on the next processor over, so that the sender returns
+ * right away. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunQueueDefer(_Inout_ TUN_CTX *Ctx)
+{
+    if (InterlockedIncrement(&Ctx->PacketQueue.DrainRequests) > 1)
+        return;
+    KeInsertQueueDpc(&Ctx->Cpus[(KeGetCurrentProcessorIndex() + 1) % Ctx->NumCpus].DrainDpc, NULL, NULL);
+}
+
+/* Copies a chain of NBLs straight into the read at the head of the read queue, and completes them, when nothing is
+ * queued ahead of them, no drain is under way and all of them fit, which saves queuing them only to take them off again
+ * at once. Senders that come along meanwhile find the read taken, so they queue, and nothing overtakes the chain.
+ * Returns FALSE with nothing done otherwise, for the caller to queue the chain and kick the queue. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+TunQueueCutThrough(_Inout_ TUN_CTX *Ctx, _In_ NET_BUFFER_LIST *Nbl)
+{
+    /* Reads with an affinity are left to TunQueueKick. */
+    if (ReadNoFence(&Ctx->PacketQueue.NumNbl) || ReadNoFence(&Ctx->Affinity.Handles))
+        return FALSE;
+
+    IRP *irp;
+    UCHAR *buffer;
+    ULONG size;
+    TUN_FILE_CTX *file_ctx;
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->PacketQueue.Lock, &lqh);
+    /* Check again now that senders queue behind us: NBLs queued or still being copied out go first, and so does a
+     * drain under way, as it may hold an earlier read it has yet to complete. */
+    if (InterlockedGet(&Ctx->PacketQueue.NumNbl) || ReadNoFence(&Ctx->PacketQueue.DrainRequests) ||
+        Ctx->PacketQueue.Parked.First || (irp = TunRemoveNextIrp(Ctx, &buffer, &size, &file_ctx)) == NULL)
+        goto cleanup_KeReleaseInStackQueuedSpinLock;
+    _Analysis_assume_(buffer);
+    ULONG room = TunIrpRoom(irp, size, file_ctx->Format);
+    for (NET_BUFFER_LIST *nbl = Nbl; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl))
+    {
+        for (NET_BUFFER *nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb))
+        {
+            ULONG footprint = TunPacketFootprint(file_ctx->Format, NET_BUFFER_DATA_LENGTH(nb));
+            if (NET_BUFFER_DATA_LENGTH(nb) > Ctx->Config.MaxIpPacketSize || room < footprint)
+            {
+                IoCsqInsertIrpEx(&Ctx->Device.ReadQueue.Csq, irp, NULL, TUN_CSQ_INSERT_HEAD);
+                goto cleanup_KeReleaseInStackQueuedSpinLock;
+            }
+            room -= footprint;
+        }
+    }
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+
+    const TUN_FILTER_PROG *filter = ReadPointerNoFence((PVOID *)&file_ctx->Filter);
+    for (NET_BUFFER_LIST *nbl = Nbl; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl))
+    {
+        NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SUCCESS;
+        for (NET_BUFFER *nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb))
+        {
+            NTSTATUS status;
+            if (filter && !TunFilterNb(filter, nb))
+                InterlockedIncrement64((LONG64 *)&Ctx->Statistics.ifOutDiscards);
+            else if (!NT_SUCCESS(status = TunWriteIntoIrp(irp, buffer, file_ctx->Format, nbl, nb, &Ctx->Statistics)))
+                NET_BUFFER_LIST_STATUS(nbl) = status;
+        }
+    }
+    if (!irp->IoStatus.Information)
+        IoCsqInsertIrpEx(&Ctx->Device.ReadQueue.Csq, irp, NULL, TUN_CSQ_INSERT_HEAD);
+    else
+    {
+        TunReadFinish(irp, buffer, file_ctx->Format);
+        TunCompleteRequest(Ctx, irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+    }
+    NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, Nbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+    return TRUE;
+
+cleanup_KeReleaseInStackQueuedSpinLock:
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+    return FALSE;
+}
+
+/* Hands out the copies queued for a tap to its pending reads, copying them straight out of its ring. Reads that are
+ * done are moved to Completed, for the caller to complete once it holds no more locks. */
+_Requires_lock_not_held_(FileCtx->Tap.Lock)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunTapProcess(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_FILE_CTX *FileCtx, _Inout_ LIST_ENTRY *Completed)
+{
+    IRP *irp = NULL;
+    UCHAR *buffer = NULL;
+    ULONG size = 0;
+    KLOCK_QUEUE_HANDLE lqh;
+
+    for (;;)
+    {
+        KeAcquireInStackQueuedSpinLock(&FileCtx->Tap.Lock, &lqh);
+        const TUN_PACKET_COPY *copy = TunCopyRingFirst(&FileCtx->Tap.Ring);
+        if (!copy)
+        {
+            KeReleaseInStackQueuedSpinLock(&lqh);
+            break;
+        }
+        if (!irp)
+        {
+            if ((irp = IoCsqRemoveNextIrp(&Ctx->Device.TapQueue.Csq, FileCtx->FileObject)) == NULL)
+            {
+                KeReleaseInStackQueuedSpinLock(&lqh);
+                return;
+            }
+            size = IoGetCurrentIrpStackLocation(irp)->Parameters.Read.Length;
+            buffer = TunIrpBuffer(irp, &FileCtx->ReadBuffer, NULL, NULL);
+        }
+        if (TunWontFitIntoIrp(irp, size, FileCtx->Format, copy->Size))
+        {
+            /* Copies are cut to MaxIpPacketSize at most, so they always fit into an empty read. */
+            ASSERT(irp->IoStatus.Information);
+            KeReleaseInStackQueuedSpinLock(&lqh);
+            TunReadFinish(irp, buffer, FileCtx->Format);
+            InsertTailList(Completed, &irp->Tail.Overlay.ListEntry);
+            irp = NULL;
+            continue;
+        }
+        TunWriteCopyIntoIrp(irp, buffer, FileCtx->Format, copy, NULL);
+        TunCopyRingPop(&FileCtx->Tap.Ring);
+        KeReleaseInStackQueuedSpinLock(&lqh);
+    }
+
+    if (irp)
+    {
+        TunReadFinish(irp, buffer, FileCtx->Format);
+        InsertTailList(Completed, &irp->Tail.Overlay.ListEntry);
+    }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunTapComplete(_Inout_ TUN_CTX *Ctx, _Inout_ LIST_ENTRY *Completed)
+{
+    while (!IsListEmpty(Completed))
+        TunCompleteRequest(
+            Ctx,
+            CONTAINING_RECORD(RemoveHeadList(Completed), IRP, Tail.Overlay.ListEntry),
+            STATUS_SUCCESS,
+            IO_NETWORK_INCREMENT);
+}
+
+/* Copies every packet of an NBL chain, cut to the snap length, into the ring of each tap handle that asked for packets
+ * going in Direction, and hands them out to the taps' pending reads. Copies that do not fit a tap's ring are dropped,
+ * so a tap that falls behind never holds up the packets themselves. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunTapNBLs(_Inout_ TUN_CTX *Ctx, _In_ ULONG Direction, _In_opt_ NET_BUFFER_LIST *Nbl)
+{
+    LIST_ENTRY completed;
+    KLOCK_QUEUE_HANDLE lqh;
+
+    InitializeListHead(&completed);
+    /* Handles are only freed once they left the list, so holding the list lock keeps them all around. */
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->Device.Files.Lock, &lqh);
+    for (LIST_ENTRY *entry = Ctx->Device.Files.List.Flink; entry != &Ctx->Device.Files.List; entry = entry->Flink)
+    {
+        TUN_FILE_CTX *file_ctx = CONTAINING_RECORD(entry, TUN_FILE_CTX, Entry);
+        if (!(ReadNoFence(&file_ctx->Tap.Flags) & Direction))
+            continue;
+
+        BOOLEAN queued = FALSE;
+        for (NET_BUFFER_LIST *nbl = Nbl; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl))
+        {
+            UCHAR priority = Direction == TUN_TAP_TRANSMIT ? TunNBLPriority(nbl) : 0;
+            for (NET_BUFFER *nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb))
+            {
+                ULONG p_size = NET_BUFFER_DATA_LENGTH(nb);
+                KLOCK_QUEUE_HANDLE tap_lqh;
+                KeAcquireInStackQueuedSpinLockAtDpcLevel(&file_ctx->Tap.Lock, &tap_lqh);
+                ULONG snap = min(p_size, file_ctx->Tap.SnapLength);
+                TUN_PACKET_COPY *copy = snap ? TunCopyRingReserve(&file_ctx->Tap.Ring, snap) : NULL;
+                void *ptr = copy ? NdisGetDataBuffer(nb, snap, copy->Data, 1, 0) : NULL;
+                if (ptr)
+                {
+                    if (ptr != copy->Data)
+                        NdisMoveMemory(copy->Data, ptr, snap);
+                    copy->Next = NULL;
+                    copy->Size = snap;
+                    copy->OriginalSize = p_size;
+                    copy->Priority = priority;
+                    TunCopyRingCommit(&file_ctx->Tap.Ring, copy);
+                    queued = TRUE;
+                }
+                KeReleaseInStackQueuedSpinLockFromDpcLevel(&tap_lqh);
+                if (!ptr)
+                    InterlockedIncrement64(&Ctx->Device.TapDrops);
+            }
+        }
+        if (queued)
+            TunTapProcess(Ctx, file_ctx, &completed);
+    }
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+
+    TunTapComplete(Ctx, &completed);
+}
+
+_IRQL_requires_same_ static void
+TunSetNBLStatus(_Inout_opt_ NET_BUFFER_LIST *Nbl, _In_ NDIS_STATUS Status)
+{
+    for (; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+        NET_BUFFER_LIST_STATUS(Nbl) = Status;
+}
+
+static MINIPORT_SEND_NET_BUFFER_LISTS TunSendNetBufferLists;
+_Use_decl_annotations_
+static void
+TunSendNetBufferLists(
+    NDIS_HANDLE MiniportAdapterContext,
+    NET_BUFFER_LIST *NetBufferLists,
+    NDIS_PORT_NUMBER PortNumber,
+    ULONG SendFlags)
+{
+    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
+
+    TunActiveNBLAdd(ctx, 1);
+
+    KIRQL irql = TunRundownAcquire(ctx);
+    LONG flags = ReadNoFence(&ctx->Flags);
+    NDIS_STATUS status;
+    if ((status = NDIS_STATUS_ADAPTER_REMOVED, !(flags & TUN_FLAGS_PRESENT)) ||
+        (status = NDIS_STATUS_PAUSED, !(flags & TUN_FLAGS_RUNNING)) ||
+        (status = NDIS_STATUS_MEDIA_DISCONNECTED, ReadNoFence64(&ctx->Device.RefCount) <= 0))
+    {
+        TunSetNBLStatus(NetBufferLists, status);
+        NdisMSendNetBufferListsComplete(
+            ctx->MiniportAdapterHandle, NetBufferLists, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+        goto cleanup_TunRundownRelease;
+    }
+
+    if (ReadNoFence(&ctx->Device.Taps))
+        TunTapNBLs(ctx, TUN_TAP_TRANSMIT, NetBufferLists);
+
+    if (ctx->Config.DeferSend)
+    {
+        TunQueueAppend(ctx, NetBufferLists, ctx->Config.QueueMaxNbls);
+        TunQueueDefer(ctx);
+        goto cleanup_TunRundownRelease;
+    }
+
+    if (TunQueueCutThrough(ctx, NetBufferLists))
+        goto cleanup_TunRundownRelease;
+
+    TunQueueAppend(ctx, NetBufferLists, ctx->Config.QueueMaxNbls);
+
+    TunQueueKick(ctx);
+
+cleanup_TunRundownRelease:
+    TunRundownRelease(ctx, irql);
+    TunCompletePause(ctx, 1, TRUE);
+}
+
+static MINIPORT_CANCEL_SEND TunCancelSend;
+_Use_decl_annotations_
+static void
+TunCancelSend(NDIS_HANDLE MiniportAdapterContext, PVOID CancelId)
+{
+    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
+    TUN_COMPLETED_NBLS completed = { NULL, NULL, 0 };
+    KLOCK_QUEUE_HANDLE lqh;
+
+    KeAcquireInStackQueuedSpinLock(&ctx->PacketQueue.Lock, &lqh);
+
+    for (TUN_LANE *lane = ctx->PacketQueue.Lanes; lane < ctx->PacketQueue.Lanes + TUN_LANE_COUNT; ++lane)
+    {
+        NET_BUFFER_LIST *nbl_last = NULL, **nbl_last_link = &lane->FirstNbl;
+        for (NET_BUFFER_LIST *nbl = lane->FirstNbl, *nbl_next; nbl; nbl = nbl_next)
+        {
+            nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
+            if (NDIS_GET_NET_BUFFER_LIST_CANCEL_ID(nbl) == CancelId)
+            {
+                if (nbl == lane->FirstNbl)
+                    lane->NextNb = NULL;
+                TunAckFilterForget(ctx, nbl);
+                NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SEND_ABORTED;
+                *nbl_last_link = nbl_next;
+                lane->NumNbl--;
+                TunNBLRefDec(ctx, nbl, &completed);
+            }
+            else
+            {
+                nbl_last = nbl;
+                nbl_last_link = &NET_BUFFER_LIST_NEXT_NBL(nbl);
+            }
+        }
+        lane->LastNbl = nbl_last;
     }
-    ctx->PacketQueue.LastNbl = nbl_last;
 
     KeReleaseInStackQueuedSpinLock(&lqh);
+    TunNBLComplete(ctx, &completed);
 }
 
 _IRQL_requires_max_(APC_LEVEL)
@@ -727,283 +2215,1329 @@ _Must_inspect_result_
 static NTSTATUS
 TunDispatchRead(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
 {
-    NTSTATUS status = TunMapIrp(Irp);
+    NTSTATUS status = TunMapIrp(Ctx, Irp);
     if (!NT_SUCCESS(status))
         goto cleanup_CompleteRequest;
 
-    KIRQL irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-    LONG flags = InterlockedGet(&Ctx->Flags);
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext;
+    TUN_MUX *mux = ReadPointerNoFence((PVOID *)&file_ctx->Mux);
+    TUN_IRP_QUEUE *queue = mux                                 ? &Ctx->Device.MuxQueue
+                           : ReadNoFence(&file_ctx->Tap.Flags) ? &Ctx->Device.TapQueue
+                                                               : &Ctx->Device.ReadQueue;
+    IRP_READ_PACKETS(Irp) = 0;
+    KIRQL irql = TunRundownAcquire(Ctx);
+    LONG flags = ReadNoFence(&Ctx->Flags);
     if ((status = STATUS_FILE_FORCED_CLOSED, !(flags & TUN_FLAGS_PRESENT)) ||
-        !NT_SUCCESS(status = IoCsqInsertIrpEx(&Ctx->Device.ReadQueue.Csq, Irp, NULL, TUN_CSQ_INSERT_TAIL)))
-        goto cleanup_ExReleaseSpinLockShared;
+        !NT_SUCCESS(status = IoCsqInsertIrpEx(&queue->Csq, Irp, NULL, TUN_CSQ_INSERT_TAIL)))
+        goto cleanup_TunRundownRelease;
 
-    TunQueueProcess(Ctx);
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, irql);
+    if (queue == &Ctx->Device.TapQueue)
+    {
+        LIST_ENTRY completed;
+        InitializeListHead(&completed);
+        TunTapProcess(Ctx, file_ctx, &completed);
+        TunTapComplete(Ctx, &completed);
+    }
+    else if (mux)
+        TunMuxKick(mux);
+    else
+        TunQueueKick(Ctx);
+    TunRundownRelease(Ctx, irql);
     return STATUS_PENDING;
 
-cleanup_ExReleaseSpinLockShared:
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, irql);
+cleanup_TunRundownRelease:
+    TunRundownRelease(Ctx, irql);
 cleanup_CompleteRequest:
     TunCompleteRequest(Ctx, Irp, status, IO_NO_INCREMENT);
     return status;
 }
 
-#define IRP_REFCOUNT(irp) ((volatile LONG *)&(irp)->Tail.Overlay.DriverContext[0])
-#define NET_BUFFER_LIST_IRP(nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(nbl)[0])
+#define TUN_WRITE_SCAN_BATCH TUN_EXCH_VALIDATE_BATCH
 
-_IRQL_requires_max_(APC_LEVEL)
+typedef struct _TUN_WRITE_SCAN
+{
+    ULONG Count;
+    ULONG Offset[TUN_WRITE_SCAN_BATCH]; /* Of the packet data, past the header */
+    ULONG Size[TUN_WRITE_SCAN_BATCH];
+    ULONG Flags[TUN_WRITE_SCAN_BATCH];
+    UCHAR Version[TUN_WRITE_SCAN_BATCH];
+    UCHAR Protocol[TUN_WRITE_SCAN_BATCH]; /* By TunIpChecksumProtocol, for TUN_PACKET_FLAG_CHECKSUM_VALID packets */
+} TUN_WRITE_SCAN;
+
+/* Gathers the headers of up to TUN_WRITE_SCAN_BATCH packets starting at *Offset into Scan, and then validates the
+ * whole batch at once. The packets are described by the gathered copy from here on, so later passes neither repeat
+ * the checks nor re-read headers that userspace could be changing under us. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_
 static NTSTATUS
-TunDispatchWrite(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+TunWriteScan(
+    _In_reads_bytes_(Size) const UCHAR *Buffer,
+    _In_ ULONG Size,
+    _In_ LONG Format,
+    _In_ ULONG MaxIpPacketSize,
+    _Inout_ ULONG *Offset,
+    _Out_ TUN_WRITE_SCAN *Scan)
 {
-    NTSTATUS status;
+    ULONG offset = *Offset, n;
 
-    InterlockedIncrement64(&Ctx->ActiveNBLCount);
+    ULONG header_size = Format == TUN_EXCH_FORMAT_V2 ? sizeof(TUN_PACKET_V2) : sizeof(TUN_PACKET);
 
-    if (!NT_SUCCESS(status = TunMapIrp(Irp)))
-        goto cleanup_CompleteRequest;
+    /* Walking the sizes is a serial dependency, so only check what is needed to find the next header. */
+    for (n = 0; n < TUN_WRITE_SCAN_BATCH && Size - offset >= header_size; ++n)
+    {
+        ULONG p_size, p_aligned;
+        if (Format == TUN_EXCH_FORMAT_V2)
+        {
+            const TUN_PACKET_V2 *p = (const TUN_PACKET_V2 *)(Buffer + offset);
+            p_size = *(volatile const USHORT *)&p->Size;
+            p_aligned = TunPacketV2Align(sizeof(TUN_PACKET_V2) + p_size);
+            Scan->Flags[n] = *(volatile const UCHAR *)&p->Flags;
+        }
+        else
+        {
+            const TUN_PACKET *p = (const TUN_PACKET *)(Buffer + offset);
+            p_size = *(volatile const ULONG *)&p->Size;
+            p_aligned = TunPacketAlign(sizeof(TUN_PACKET) + p_size);
+            Scan->Flags[n] = *(volatile const ULONG *)&p->Flags;
+        }
+        if (p_size > MaxIpPacketSize || Size - offset < p_aligned)
+            return STATUS_INVALID_USER_BUFFER;
+        const UCHAR *data = Buffer + offset + header_size;
+        Scan->Offset[n] = offset + header_size;
+        Scan->Size[n] = p_size;
+        Scan->Version[n] = p_size ? data[0] >> 4 : 0;
+        /* Anything too short to hold either protocol field is rejected below anyway. */
+        if (p_size >= 20 && (Scan->Flags[n] & TUN_PACKET_FLAG_CHECKSUM_VALID))
+            Scan->Protocol[n] = TunIpChecksumProtocol(data);
+        offset += p_aligned;
+    }
 
-    KIRQL irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-    LONG flags = InterlockedGet(&Ctx->Flags);
-    if (status = STATUS_FILE_FORCED_CLOSED, !(flags & TUN_FLAGS_PRESENT))
-        goto cleanup_ExReleaseSpinLockShared;
+    /* Branch-free over the gathered arrays, by the same rules userspace validates its bundles with. */
+    if (!TunExchValidateBatch(Scan->Size, Scan->Version, n))
+        return STATUS_INVALID_USER_BUFFER;
 
-    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
-    TUN_MAPPED_UBUFFER *ubuffer = &((TUN_FILE_CTX *)stack->FileObject->FsContext)->WriteBuffer;
-    UCHAR *buffer = ubuffer->KernelAddress;
-    ULONG size = stack->Parameters.Write.Length;
+    Scan->Count = n;
+    *Offset = offset;
+    return STATUS_SUCCESS;
+}
 
-    const UCHAR *b = buffer, *b_end = buffer + size;
-    typedef enum _ethtypeidx_t
-    {
-        ethtypeidx_ipv4 = 0,
-        ethtypeidx_start = 0,
-        ethtypeidx_ipv6,
-        ethtypeidx_end
-    } ethtypeidx_t;
-    static const struct
+_IRQL_requires_same_ static PVOID
+TunRxChecksumInfo(_In_ LONG RxChecksum, _In_ UCHAR Version, _In_ UCHAR Protocol)
+{
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO csum = { .Value = NULL };
+    if (Version == 4)
     {
-        ULONG nbl_flags;
-        USHORT nbl_proto;
-    } ether_const[ethtypeidx_end] = {
-        { NDIS_NBL_FLAGS_IS_IPV4, TUN_HTONS(NDIS_ETH_TYPE_IPV4) },
-        { NDIS_NBL_FLAGS_IS_IPV6, TUN_HTONS(NDIS_ETH_TYPE_IPV6) },
-    };
-    struct
+        csum.Receive.IpChecksumSucceeded = !!(RxChecksum & TUN_RX_CSUM_IPV4);
+        csum.Receive.TcpChecksumSucceeded = Protocol == TUN_IPPROTO_TCP && (RxChecksum & TUN_RX_CSUM_TCP_IPV4);
+        csum.Receive.UdpChecksumSucceeded = Protocol == TUN_IPPROTO_UDP && (RxChecksum & TUN_RX_CSUM_UDP_IPV4);
+    }
+    else
     {
-        NET_BUFFER_LIST *head, *tail;
-        LONG count;
-    } nbl_queue[ethtypeidx_end] = { { NULL, NULL, 0 }, { NULL, NULL, 0 } };
-    LONG nbl_count = 0;
-    while (b_end - b >= sizeof(TUN_PACKET))
+        csum.Receive.TcpChecksumSucceeded = Protocol == TUN_IPPROTO_TCP && (RxChecksum & TUN_RX_CSUM_TCP_IPV6);
+        csum.Receive.UdpChecksumSucceeded = Protocol == TUN_IPPROTO_UDP && (RxChecksum & TUN_RX_CSUM_UDP_IPV6);
+    }
+    return csum.Value;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunRssInitToeplitz(_Inout_ TUN_RSS_STATE *State)
+{
+    for (ULONG i = 0; i < TUN_RSS_MAX_INPUT; ++i)
     {
-        if (nbl_count >= MAXLONG)
+        /* The 32-bit key windows for the 8 input bits of byte i all lie within key bytes i to i + 4. */
+        ULONG64 bits = ((ULONG64)State->Key[i] << 32) | ((ULONG64)State->Key[i + 1] << 24) |
+                       ((ULONG64)State->Key[i + 2] << 16) | ((ULONG64)State->Key[i + 3] << 8) | State->Key[i + 4];
+        ULONG window[8];
+        for (ULONG j = 0; j < 8; ++j)
+            window[j] = (ULONG)(bits >> (8 - j));
+        for (ULONG b = 0; b < 256; ++b)
         {
-            status = STATUS_INVALID_USER_BUFFER;
-            goto cleanup_nbl_queues;
+            ULONG hash = 0;
+            for (ULONG j = 0; j < 8; ++j)
+                hash ^= (b & (0x80 >> j)) ? window[j] : 0;
+            State->Toeplitz[i][b] = hash;
         }
+    }
+}
+
+/* Hashes a packet TunWriteScan already found large enough for its IP header. Returns the NDIS_HASH_* type that was
+ * used, or 0 when none of the enabled hash types covers the packet. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static ULONG
+TunRssHash(
+    _In_ const TUN_RSS_STATE *State,
+    _In_reads_bytes_(Size) const UCHAR *Packet,
+    _In_ ULONG Size,
+    _In_ UCHAR Version,
+    _Out_ ULONG *Hash)
+{
+    ULONG hash_types = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(State->HashInformation);
+    UCHAR input[TUN_RSS_MAX_INPUT];
+    ULONG input_size, hash_type;
 
-        TUN_PACKET *p = (TUN_PACKET *)b;
-        if (p->Size > TUN_EXCH_MAX_IP_PACKET_SIZE)
+    if (Version == 4)
+    {
+        ULONG ihl = (*(volatile const UCHAR *)Packet & 0xf) * 4;
+        RtlCopyMemory(input, Packet + 12, 8);
+        input_size = 8;
+        hash_type = NDIS_HASH_IPV4;
+        /* Ports are only hashed for unfragmented TCP, as later fragments don't carry them. */
+        if ((hash_types & NDIS_HASH_TCP_IPV4) && Packet[9] == TUN_IPPROTO_TCP && !(Packet[6] & 0x3f) && !Packet[7] &&
+            ihl >= 20 && Size >= ihl + 4)
         {
-            status = STATUS_INVALID_USER_BUFFER;
-            goto cleanup_nbl_queues;
+            RtlCopyMemory(input + input_size, Packet + ihl, 4);
+            input_size += 4;
+            hash_type = NDIS_HASH_TCP_IPV4;
         }
-        ULONG p_size = TunPacketAlign(sizeof(TUN_PACKET) + p->Size);
-        if (b_end - b < (ptrdiff_t)p_size)
+    }
+    else
+    {
+        RtlCopyMemory(input, Packet + 8, 32);
+        input_size = 32;
+        hash_type = NDIS_HASH_IPV6;
+        /* Extension headers are not walked, so only TCP directly following the fixed header gets its ports hashed. */
+        if ((hash_types & NDIS_HASH_TCP_IPV6) && Packet[6] == TUN_IPPROTO_TCP && Size >= 40 + 4)
         {
-            status = STATUS_INVALID_USER_BUFFER;
-            goto cleanup_nbl_queues;
+            RtlCopyMemory(input + input_size, Packet + 40, 4);
+            input_size += 4;
+            hash_type = NDIS_HASH_TCP_IPV6;
         }
+    }
+    if (!(hash_types & hash_type))
+        return 0;
+
+    ULONG hash = 0;
+    for (ULONG i = 0; i < input_size; ++i)
+        hash ^= State->Toeplitz[i][input[i]];
+    *Hash = hash;
+    return hash_type;
+}
+
+static KDEFERRED_ROUTINE TunRssDpc;
+_Use_decl_annotations_
+static VOID
+TunRssDpc(KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    TUN_RSS_QUEUE *queue = DeferredContext;
+    KLOCK_QUEUE_HANDLE lqh;
+
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&queue->Lock, &lqh);
+    NET_BUFFER_LIST *nbl = queue->FirstNbl;
+    LONG count = queue->NumNbl;
+    queue->FirstNbl = queue->LastNbl = NULL;
+    queue->NumNbl = 0;
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+
+    if (nbl)
+        NdisMIndicateReceiveNetBufferLists(
+            queue->Ctx->MiniportAdapterHandle, nbl, NDIS_DEFAULT_PORT_NUMBER, count, NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL);
+}
+
+#define TUN_RECEIVE_FLUSH_ROUNDS 8 /* Batches indicated in one go before handing over to the DPC */
+#define TUN_RECEIVE_DEADLINE 500 /* Longest a writer waits for others to join its batch, in 100ns units */
+
+/* Indicates everything staged, batch by batch, until nothing is left, with Receive.Indicating set by the caller. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunReceiveFlush(_Inout_ TUN_CTX *Ctx)
+{
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->Receive.Lock, &lqh);
+    ASSERT(Ctx->Receive.Indicating);
+    for (ULONG round = 0;; ++round)
+    {
+        if (!Ctx->Receive.Staged[0].First && !Ctx->Receive.Staged[1].First)
+        {
+            Ctx->Receive.Indicating = FALSE;
+            break;
+        }
+        if (round == TUN_RECEIVE_FLUSH_ROUNDS)
+        {
+            /* Writers keep staging faster than we indicate. Leave the rest to the DPC, still as the indicator, rather
+             * than holding this writer up any longer. */
+            KeInsertQueueDpc(&Ctx->Receive.Dpc, NULL, NULL);
+            break;
+        }
+        NET_BUFFER_LIST *first[2] = { Ctx->Receive.Staged[0].First, Ctx->Receive.Staged[1].First };
+        LONG count[2] = { Ctx->Receive.Staged[0].Count, Ctx->Receive.Staged[1].Count };
+        RtlZeroMemory(Ctx->Receive.Staged, sizeof(Ctx->Receive.Staged));
+        KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+
+        /* Each list is of a single ether type, just like a single write's. */
+        for (ULONG i = 0; i < 2; ++i)
+        {
+            if (first[i])
+                NdisMIndicateReceiveNetBufferLists(
+                    Ctx->MiniportAdapterHandle,
+                    first[i],
+                    NDIS_DEFAULT_PORT_NUMBER,
+                    count[i],
+                    NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL | NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
+        }
+
+        KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->Receive.Lock, &lqh);
+    }
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+}
+
+static KDEFERRED_ROUTINE TunReceiveDpc;
+_Use_decl_annotations_
+static VOID
+TunReceiveDpc(KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    TunReceiveFlush(DeferredContext);
+}
+
+static KDEFERRED_ROUTINE TunReceiveDeadlineDpc;
+_Use_decl_annotations_
+static VOID
+TunReceiveDeadlineDpc(KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    TUN_CTX *ctx = DeferredContext;
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&ctx->Receive.Lock, &lqh);
+    ctx->Receive.DeadlineArmed = FALSE;
+    BOOLEAN indicate = !ctx->Receive.Indicating && (ctx->Receive.Staged[0].First || ctx->Receive.Staged[1].First);
+    ctx->Receive.Indicating |= indicate;
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+    if (indicate)
+        TunReceiveFlush(ctx);
+}
+
+/* Stages a write's NBLs of one ether type for indication. Returns TRUE if the caller is to indicate them, along with
+ * whatever else gets staged meanwhile. Otherwise, the indicator, a writer yet to stage or the deadline will. The
+ * deadline only matters when other writers fail or stall, as the last of them to stage indicates, so timer
+ * granularity coarser than TUN_RECEIVE_DEADLINE costs little. */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+TunReceiveStage(
+    _Inout_ TUN_CTX *Ctx,
+    _In_ ULONG Index,
+    __drv_aliasesMem _In_ NET_BUFFER_LIST *First,
+    _In_ NET_BUFFER_LIST *Last,
+    _In_ LONG Count)
+{
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->Receive.Lock, &lqh);
+    if (Ctx->Receive.Staged[Index].Last)
+        NET_BUFFER_LIST_NEXT_NBL(Ctx->Receive.Staged[Index].Last) = First;
+    else
+        Ctx->Receive.Staged[Index].First = First;
+    Ctx->Receive.Staged[Index].Last = Last;
+    Ctx->Receive.Staged[Index].Count += Count;
+    TUN_RECEIVE_ACTION action = TunReceiveAction(
+        Ctx->Receive.Staged[0].Count + Ctx->Receive.Staged[1].Count,
+        ReadNoFence(&Ctx->Receive.Writers),
+        Ctx->Receive.Indicating,
+        Ctx->Receive.DeadlineArmed);
+    if (action == TUN_RECEIVE_INDICATE)
+        Ctx->Receive.Indicating = TRUE;
+    else if (action == TUN_RECEIVE_WAIT)
+    {
+        LARGE_INTEGER due_time = { .QuadPart = -TUN_RECEIVE_DEADLINE };
+        Ctx->Receive.DeadlineArmed = TRUE;
+        KeSetTimer(&Ctx->Receive.Deadline, due_time, &Ctx->Receive.DeadlineDpc);
+    }
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+    return action == TUN_RECEIVE_INDICATE;
+}
+
+#define IRP_REFCOUNT(irp) ((volatile LONG *)&(irp)->Tail.Overlay.DriverContext[0])
+#define NET_BUFFER_LIST_IRP(nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(nbl)[0])
+#define NET_BUFFER_LIST_RSS_QUEUE(nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(nbl)[1])
+
+/* Moves a chain of NBLs onto the per-processor queues picked by TunDispatchWrite. Consecutive NBLs bound for the same
+ * processor are spliced in one go, and each flow keeps its order because it always maps to the same queue. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static void
+TunRssQueueNBLs(_Inout_ TUN_CTX *Ctx, __drv_aliasesMem _In_opt_ NET_BUFFER_LIST *Nbl)
+{
+    while (Nbl)
+    {
+        ULONG index = (ULONG)(ULONG_PTR)NET_BUFFER_LIST_RSS_QUEUE(Nbl);
+        NET_BUFFER_LIST *first = Nbl, *last = Nbl;
+        LONG count = 1;
+        for (Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl); Nbl && (ULONG)(ULONG_PTR)NET_BUFFER_LIST_RSS_QUEUE(Nbl) == index;
+             Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl), ++count)
+            last = Nbl;
+        NET_BUFFER_LIST_NEXT_NBL(last) = NULL;
+
+        TUN_RSS_QUEUE *queue = &Ctx->Cpus[index].RssQueue;
+        KLOCK_QUEUE_HANDLE lqh;
+        KeAcquireInStackQueuedSpinLockAtDpcLevel(&queue->Lock, &lqh);
+        if (queue->LastNbl)
+            NET_BUFFER_LIST_NEXT_NBL(queue->LastNbl) = first;
+        else
+            queue->FirstNbl = first;
+        queue->LastNbl = last;
+        queue->NumNbl += count;
+        KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+        KeInsertQueueDpc(&queue->Dpc, NULL, NULL);
+    }
+}
+
+/* Builds NBLs for the packets of Buffer from Offset up to Size, which must end right after one of them, and indicates
+ * them to the network stack on behalf of Irp. Each adds to the IRP's reference count, on which the caller holds a
+ * bias until all its packets are indicated, and to Indicated. */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunWriteBundle(
+    _Inout_ TUN_CTX *Ctx,
+    _Inout_ IRP *Irp,
+    _In_reads_bytes_(Size) const UCHAR *Buffer,
+    _In_ MDL *Mdl,
+    _In_ ULONG Base,
+    _In_ ULONG Offset,
+    _In_ ULONG Size,
+    _In_ LONG Format,
+    _Inout_ LONG *Indicated)
+{
+    NTSTATUS status;
+    const TUN_RSS_STATE *rss = ReadPointerNoFence((PVOID *)&Ctx->Rss.State);
+    if (rss && !rss->Enabled)
+        rss = NULL;
+    if (!rss)
+        InterlockedIncrement(&Ctx->Receive.Writers);
+    LONG flags = ReadNoFence(&Ctx->Flags);
+    ULONG header_size = Format == TUN_EXCH_FORMAT_V2 ? sizeof(TUN_PACKET_V2) : sizeof(TUN_PACKET);
+
+    typedef enum _ethtypeidx_t
+    {
+        ethtypeidx_ipv4 = 0,
+        ethtypeidx_start = 0,
+        ethtypeidx_ipv6,
+        ethtypeidx_end
+    } ethtypeidx_t;
+    static const struct
+    {
+        ULONG nbl_flags;
+        USHORT nbl_proto;
+    } ether_const[ethtypeidx_end] = {
+        { NDIS_NBL_FLAGS_IS_IPV4, TUN_HTONS(NDIS_ETH_TYPE_IPV4) },
+        { NDIS_NBL_FLAGS_IS_IPV6, TUN_HTONS(NDIS_ETH_TYPE_IPV6) },
+    };
+    struct
+    {
+        NET_BUFFER_LIST *head, *tail;
+        LONG count;
+    } nbl_queue[ethtypeidx_end] = { { NULL, NULL, 0 }, { NULL, NULL, 0 } };
+    LONG nbl_count = 0;
+    ULONG offset = Offset;
+    LONG rx_csum = ReadNoFence(&Ctx->RxChecksum);
+    while (Size - offset >= header_size)
+    {
+        TUN_WRITE_SCAN scan;
+        if (!NT_SUCCESS(status = TunWriteScan(Buffer, Size, Format, Ctx->Config.MaxIpPacketSize, &offset, &scan)) ||
+            (status = STATUS_INVALID_USER_BUFFER, nbl_count > MAXLONG - (LONG)scan.Count))
+            goto cleanup_nbl_queues;
+
+        for (ULONG i = 0; i < scan.Count; ++i)
+        {
+            ethtypeidx_t idx = scan.Version[i] == 4 ? ethtypeidx_ipv4 : ethtypeidx_ipv6;
+            NET_BUFFER_LIST *nbl =
+                NdisAllocateNetBufferAndNetBufferList(Ctx->NBLPool, 0, 0, Mdl, Base + scan.Offset[i], scan.Size[i]);
+            if (!nbl)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto cleanup_nbl_queues;
+            }
+
+            nbl->SourceHandle = Ctx->MiniportAdapterHandle;
+            NdisSetNblFlag(nbl, ether_const[idx].nbl_flags);
+            NET_BUFFER_LIST_INFO(nbl, NetBufferListFrameType) = (PVOID)ether_const[idx].nbl_proto;
+            NET_BUFFER_LIST_INFO(nbl, TcpIpChecksumNetBufferListInfo) =
+                scan.Flags[i] & TUN_PACKET_FLAG_CHECKSUM_VALID
+                    ? TunRxChecksumInfo(rx_csum, scan.Version[i], scan.Protocol[i])
+                    : NULL;
+            NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SUCCESS;
+            NET_BUFFER_LIST_IRP(nbl) = Irp;
+            if (rss)
+            {
+                ULONG hash = 0, hash_type = TunRssHash(
+                                    rss,
+                                    Buffer + scan.Offset[i],
+                                    scan.Size[i],
+                                    scan.Version[i],
+                                    &hash);
+                if (hash_type)
+                {
+                    NET_BUFFER_LIST_SET_HASH_VALUE(nbl, hash);
+                    NET_BUFFER_LIST_SET_HASH_TYPE(nbl, hash_type);
+                    NET_BUFFER_LIST_SET_HASH_FUNCTION(nbl, NdisHashFunctionToeplitz);
+                }
+                NET_BUFFER_LIST_RSS_QUEUE(nbl) =
+                    (PVOID)(ULONG_PTR)rss->IndirectionTable[hash & (rss->IndirectionTableSize - 1)];
+            }
+            TunAppendNBL(&nbl_queue[idx].head, &nbl_queue[idx].tail, nbl);
+            nbl_queue[idx].count++;
+        }
+        nbl_count += scan.Count;
+    }
+
+    if (offset != Size)
+    {
+        status = STATUS_INVALID_USER_BUFFER;
+        goto cleanup_nbl_queues;
+    }
+    status = STATUS_SUCCESS;
+    if (!nbl_count)
+        goto cleanup_nbl_queues;
+    if (!(flags & TUN_FLAGS_RUNNING))
+    {
+        InterlockedAdd64((LONG64 *)&Ctx->Receive.Statistics.ifInDiscards, nbl_count);
+        InterlockedAdd64((LONG64 *)&Ctx->Receive.Statistics.ifInErrors, nbl_count);
+        goto cleanup_nbl_queues;
+    }
+
+    if (ReadNoFence(&Ctx->Device.Taps))
+    {
+        TunTapNBLs(Ctx, TUN_TAP_RECEIVE, nbl_queue[ethtypeidx_ipv4].head);
+        TunTapNBLs(Ctx, TUN_TAP_RECEIVE, nbl_queue[ethtypeidx_ipv6].head);
+    }
+
+    TunActiveNBLAdd(Ctx, nbl_count);
+    InterlockedAdd(IRP_REFCOUNT(Irp), nbl_count);
+    *Indicated += nbl_count;
+
+    if (rss)
+    {
+        TunRssQueueNBLs(Ctx, nbl_queue[ethtypeidx_ipv4].head);
+        TunRssQueueNBLs(Ctx, nbl_queue[ethtypeidx_ipv6].head);
+    }
+    else
+    {
+        BOOLEAN indicate = FALSE;
+        InterlockedDecrement(&Ctx->Receive.Writers);
+        for (ethtypeidx_t idx = ethtypeidx_start; idx < ethtypeidx_end; idx++)
+        {
+            if (nbl_queue[idx].head)
+                indicate |= TunReceiveStage(Ctx, idx, nbl_queue[idx].head, nbl_queue[idx].tail, nbl_queue[idx].count);
+        }
+        if (indicate)
+            TunReceiveFlush(Ctx);
+    }
+
+    return STATUS_SUCCESS;
+
+cleanup_nbl_queues:
+    if (!rss)
+        InterlockedDecrement(&Ctx->Receive.Writers);
+    for (ethtypeidx_t idx = ethtypeidx_start; idx < ethtypeidx_end; idx++)
+    {
+        for (NET_BUFFER_LIST *nbl = nbl_queue[idx].head, *nbl_next; nbl; nbl = nbl_next)
+        {
+            nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
+            NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
+            NdisFreeNetBufferList(nbl);
+        }
+    }
+    return status;
+}
+
+/* Finds the position of an adapter among those of a mux, or returns -1 if it is not one of them. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static LONG
+TunMuxFind(_In_ const TUN_MUX *Mux, _In_ ULONG LuidIndex)
+{
+    for (ULONG low = 0, high = Mux->Count; low < high;)
+    {
+        ULONG mid = low + (high - low) / 2;
+        if (Mux->Adapters[mid].LuidIndex < LuidIndex)
+            low = mid + 1;
+        else if (Mux->Adapters[mid].LuidIndex > LuidIndex)
+            high = mid;
+        else
+            return (LONG)mid;
+    }
+    return -1;
+}
+
+/* Indicates each run of a mux write on the adapter it names, up to the first that fails. Runs of adapters halted
+ * since they were subscribed to are dropped. A write that got some runs through ends as a short write just before
+ * the first that failed, so the client can tell how far it got. */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunMuxWrite(
+    _Inout_ TUN_MUX *Mux,
+    _Inout_ IRP *Irp,
+    _In_reads_bytes_(Size) const UCHAR *Buffer,
+    _In_ MDL *Mdl,
+    _In_ ULONG Base,
+    _In_ ULONG Size,
+    _Inout_ LONG *Indicated)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    for (ULONG offset = 0; offset < Size;)
+    {
+        const TUN_MUX_RUN *run = (const TUN_MUX_RUN *)(Buffer + offset);
+        if (status = STATUS_INVALID_USER_BUFFER, Size - offset < sizeof(TUN_MUX_RUN))
+            break;
+        ULONG luid_index = *(volatile const ULONG *)&run->LuidIndex, end = offset + sizeof(TUN_MUX_RUN);
+        ULONG run_size = *(volatile const ULONG *)&run->Size;
+        if (Size - end < run_size)
+            break;
+        end += run_size;
+
+        LONG i = TunMuxFind(Mux, luid_index);
+        if (status = STATUS_NOT_FOUND, i < 0)
+            break;
+        status = STATUS_SUCCESS;
+        TUN_CTX *ctx = TunMuxPin(Mux, (ULONG)i);
+        if (ctx)
+        {
+            KIRQL irql = TunRundownAcquire(ctx);
+            if (ReadNoFence(&ctx->Flags) & TUN_FLAGS_PRESENT)
+                status = TunWriteBundle(
+                    ctx, Irp, Buffer, Mdl, Base, offset + sizeof(TUN_MUX_RUN), end, TUN_EXCH_FORMAT_V1, Indicated);
+            TunRundownRelease(ctx, irql);
+            IoReleaseRemoveLock(&ctx->Device.RemoveLock, Mux);
+            if (!NT_SUCCESS(status))
+                break;
+        }
+        Irp->IoStatus.Information = offset = end;
+    }
+    return Irp->IoStatus.Information ? STATUS_SUCCESS : status;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunDispatchWrite(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS status;
+
+    TunActiveNBLAdd(Ctx, 1);
+
+    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)stack->FileObject->FsContext;
+    if (!NT_SUCCESS(status = TunMapIrp(Ctx, Irp)) || !NT_SUCCESS(status = TunWriteSlotsAcquire(file_ctx, Irp)))
+        goto cleanup_CompleteRequest;
+
+    MDL *mdl;
+    ULONG base;
+    UCHAR *buffer = TunIrpBuffer(Irp, &file_ctx->WriteBuffer, &mdl, &base);
+    ULONG size = stack->Parameters.Write.Length;
+    TUN_MUX *mux = ReadPointerNoFence((PVOID *)&file_ctx->Mux);
+    LONG indicated = 0;
+    /* Biased until all packets are indicated, so that those returned meanwhile cannot complete the IRP early. */
+    InterlockedExchange(IRP_REFCOUNT(Irp), 1);
+
+    KIRQL irql = TunRundownAcquire(Ctx);
+    if (status = STATUS_FILE_FORCED_CLOSED, ReadNoFence(&Ctx->Flags) & TUN_FLAGS_PRESENT)
+    {
+        if (mux)
+            status = TunMuxWrite(mux, Irp, buffer, mdl, base, size, &indicated);
+        else if (NT_SUCCESS(
+                     status = TunWriteBundle(Ctx, Irp, buffer, mdl, base, 0, size, file_ctx->Format, &indicated)))
+            Irp->IoStatus.Information = size;
+    }
+    TunRundownRelease(Ctx, irql);
+    if (!indicated)
+        goto cleanup_TunWriteSlotsRelease;
+
+    IoMarkIrpPending(Irp);
+    if (InterlockedDecrement(IRP_REFCOUNT(Irp)) <= 0)
+    {
+        TunWriteSlotsRelease(file_ctx, Irp);
+        TunCompleteRequest(Ctx, Irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+    }
+    TunCompletePause(Ctx, 1, TRUE);
+    return STATUS_PENDING;
+
+cleanup_TunWriteSlotsRelease:
+    TunWriteSlotsRelease(file_ctx, Irp);
+cleanup_CompleteRequest:
+    TunCompleteRequest(Ctx, Irp, status, IO_NO_INCREMENT);
+    TunCompletePause(Ctx, 1, TRUE);
+    return status;
+}
+
+static MINIPORT_RETURN_NET_BUFFER_LISTS TunReturnNetBufferLists;
+_Use_decl_annotations_
+static void
+TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST NetBufferLists, ULONG ReturnFlags)
+{
+    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
+
+    LONG64 stat_size = 0, stat_p_ok = 0, stat_p_err = 0;
+    for (NET_BUFFER_LIST *nbl = NetBufferLists, *nbl_next; nbl; nbl = nbl_next)
+    {
+        nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
+        NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
+
+        IRP *irp = NET_BUFFER_LIST_IRP(nbl);
+        if (NT_SUCCESS(NET_BUFFER_LIST_STATUS(nbl)))
+        {
+            ULONG p_size = NET_BUFFER_LIST_FIRST_NB(nbl)->DataLength;
+            stat_size += p_size;
+            stat_p_ok++;
+        }
+        else
+            stat_p_err++;
+
+        NdisFreeNetBufferList(nbl);
+        TunCompletePause(ctx, 1, TRUE);
+
+        ASSERT(InterlockedGet(IRP_REFCOUNT(irp)) > 0);
+        if (InterlockedDecrement(IRP_REFCOUNT(irp)) <= 0)
+        {
+            TunWriteSlotsRelease(IoGetCurrentIrpStackLocation(irp)->FileObject->FsContext, irp);
+            /* Writes of mux handles indicate packets on adapters other than the one they were issued to. */
+            TunCompleteRequest(TunIrpCtx(irp), irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+        }
+    }
+
+    InterlockedAdd64((LONG64 *)&ctx->Receive.Statistics.ifHCInOctets, stat_size);
+    InterlockedAdd64((LONG64 *)&ctx->Receive.Statistics.ifHCInUcastOctets, stat_size);
+    InterlockedAdd64((LONG64 *)&ctx->Receive.Statistics.ifHCInUcastPkts, stat_p_ok);
+    InterlockedAdd64((LONG64 *)&ctx->Receive.Statistics.ifInErrors, stat_p_err);
+}
+
+/* Handles keep an adapter connected, taps aside, which give their count back when they become one, and so do mux
+ * handles opened elsewhere that subscribed to it, which TunMuxSet counts itself. */
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunHandleOpened(_Inout_ TUN_CTX *Ctx)
+{
+    if (InterlockedIncrement64(&Ctx->Device.RefCount) == 1)
+        TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateConnected, Ctx->Config.LinkSpeed);
+}
+
+_Requires_lock_not_held_(Ctx->PacketQueue.Lock)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunHandleClosed(_Inout_ TUN_CTX *Ctx)
+{
+    ASSERT(InterlockedGet64(&Ctx->Device.RefCount) > 0);
+    BOOLEAN last_handle = InterlockedDecrement64(&Ctx->Device.RefCount) <= 0;
+    TunRundownBarrier(Ctx); /* Ensure above change is visible to all readers. */
+    if (last_handle)
+    {
+        NDIS_HANDLE handle = InterlockedGetPointer(&Ctx->MiniportAdapterHandle);
+        if (handle)
+            TunIndicateStatus(handle, MediaConnectStateDisconnected, Ctx->Config.LinkSpeed);
+        TunQueueClear(Ctx, NDIS_STATUS_MEDIA_DISCONNECTED, FALSE);
+    }
+}
+
+/* Unsubscribes a mux handle that is being closed from the adapters still in it, and frees it. Clearing their Mux and
+ * the barrier in TunHandleClosed wait for any drainer that may still kick the mux. The adapters are only detached
+ * under the locks, and their handle counts dropped after, as that may well call back into protocol drivers. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunMuxClose(_In_ __drv_freesMem(Mem) TUN_MUX *Mux)
+{
+    TUN_CTX *detached = NULL;
+    KIRQL irql;
+    KeAcquireSpinLock(&TunAdaptersLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&Mux->Lock);
+    for (ULONG i = 0; i < Mux->Count; ++i)
+    {
+        TUN_CTX *ctx = Mux->Adapters[i].Ctx;
+        Mux->Adapters[i].Ctx = NULL;
+        if (!ctx)
+            continue;
+        InterlockedExchangePointer((PVOID *)&ctx->Mux, NULL);
+        /* Keeps the adapter from halting until its count is dropped. Halting only waits for the remove lock once
+         * TunMuxLeave has taken it out of its mux, which it still is in, so this cannot fail. */
+        IoAcquireRemoveLock(&ctx->Device.RemoveLock, Mux);
+        ctx->MuxDetached = detached;
+        detached = ctx;
+    }
+    KeReleaseSpinLockFromDpcLevel(&Mux->Lock);
+    KeReleaseSpinLock(&TunAdaptersLock, irql);
+
+    for (TUN_CTX *ctx = detached, *ctx_next; ctx; ctx = ctx_next)
+    {
+        ctx_next = ctx->MuxDetached;
+        TunHandleClosed(ctx);
+        IoReleaseRemoveLock(&ctx->Device.RemoveLock, Mux);
+    }
+    ExFreePoolWithTag(Mux, TUN_HTONL(TUN_MEMORY_TAG));
+}
+
+/* Takes a halting adapter out of the list mux handles subscribe from, and out of the mux it belongs to, if any. The
+ * barrier waits for its drainers that may still kick the mux, which may be freed once the adapter is out. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunMuxLeave(_Inout_ TUN_CTX *Ctx)
+{
+    KIRQL irql;
+    KeAcquireSpinLock(&TunAdaptersLock, &irql);
+    RemoveEntryList(&Ctx->Entry);
+    TUN_MUX *mux = InterlockedExchangePointer((PVOID *)&Ctx->Mux, NULL);
+    if (mux)
+    {
+        KeAcquireSpinLockAtDpcLevel(&mux->Lock);
+        for (ULONG i = 0; i < mux->Count; ++i)
+        {
+            if (mux->Adapters[i].Ctx == Ctx)
+                mux->Adapters[i].Ctx = NULL;
+        }
+        KeReleaseSpinLockFromDpcLevel(&mux->Lock);
+        InterlockedDecrement64(&Ctx->Device.RefCount);
+    }
+    KeReleaseSpinLock(&TunAdaptersLock, irql);
+    TunRundownBarrier(Ctx);
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunDispatchCreate(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS status;
+    TUN_FILE_CTX *file_ctx = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*file_ctx), TUN_HTONL(TUN_MEMORY_TAG));
+    if (!file_ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(file_ctx, sizeof(*file_ctx));
+    ExInitializeFastMutex(&file_ctx->ReadBuffer.InitializationComplete);
+    ExInitializeFastMutex(&file_ctx->WriteBuffer.InitializationComplete);
+    file_ctx->Format = TUN_EXCH_FORMAT_V1;
+    file_ctx->Locking = TUN_LOCKING_HANDLE;
+    file_ctx->Processor = -1;
+    file_ctx->Node = -1;
+    KeInitializeSpinLock(&file_ctx->Tap.Lock);
+
+    KIRQL irql = TunRundownAcquire(Ctx);
+    LONG flags = ReadNoFence(&Ctx->Flags);
+    if ((status = STATUS_DELETE_PENDING, !(flags & TUN_FLAGS_PRESENT)))
+        goto cleanup_TunRundownRelease;
+
+    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
+    if (!NT_SUCCESS(status = IoAcquireRemoveLock(&Ctx->Device.RemoveLock, stack->FileObject)))
+        goto cleanup_TunRundownRelease;
+    stack->FileObject->FsContext = file_ctx;
+    file_ctx->FileObject = stack->FileObject;
+    file_ctx->Process = PsGetCurrentProcess();
+    ObReferenceObject(file_ctx->Process);
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLockAtDpcLevel(&Ctx->Device.Files.Lock, &lqh);
+    InsertTailList(&Ctx->Device.Files.List, &file_ctx->Entry);
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lqh);
+
+    TunHandleOpened(Ctx);
+
+    status = STATUS_SUCCESS;
+
+cleanup_TunRundownRelease:
+    TunRundownRelease(Ctx, irql);
+    TunCompleteRequest(Ctx, Irp, status, IO_NO_INCREMENT);
+    if (!NT_SUCCESS(status))
+        ExFreePoolWithTag(file_ctx, TUN_HTONL(TUN_MEMORY_TAG));
+    return status;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static void
+TunDispatchClose(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)stack->FileObject->FsContext;
+    if (!file_ctx->Tap.Flags) /* Taps gave up their count when they became one. */
+        TunHandleClosed(Ctx);
+    if (file_ctx->Mux)
+        TunMuxClose(file_ctx->Mux);
+    KLOCK_QUEUE_HANDLE lqh;
+    KeAcquireInStackQueuedSpinLock(&Ctx->Device.Files.Lock, &lqh);
+    RemoveEntryList(&file_ctx->Entry);
+    KeReleaseInStackQueuedSpinLock(&lqh);
+    ObDereferenceObject(file_ctx->Process);
+    if (file_ctx->Processor >= 0)
+        InterlockedDecrement(&Ctx->Affinity.Handles);
+    TunUnmapUbuffer(Ctx, &file_ctx->ReadBuffer);
+    TunUnmapUbuffer(Ctx, &file_ctx->WriteBuffer);
+    if (file_ctx->Filter)
+        ExFreePoolWithTag(file_ctx->Filter, TUN_HTONL(TUN_MEMORY_TAG));
+    if (file_ctx->Tap.Flags)
+        InterlockedDecrement(&Ctx->Device.Taps);
+    if (file_ctx->Tap.Ring.Buffer)
+        ExFreePoolWithTag(file_ctx->Tap.Ring.Buffer, TUN_HTONL(TUN_MEMORY_TAG));
+    ExFreePoolWithTag(file_ctx, TUN_HTONL(TUN_MEMORY_TAG));
+    IoReleaseRemoveLock(&Ctx->Device.RemoveLock, stack->FileObject);
+}
+
+static IO_COMPLETION_ROUTINE TunSubmitWriteComplete;
+_Use_decl_annotations_
+static NTSTATUS
+TunSubmitWriteComplete(DEVICE_OBJECT *DeviceObject, IRP *Irp, PVOID Context)
+{
+    ObDereferenceObject((FILE_OBJECT *)Context);
+    IoFreeIrp(Irp);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/* Writes a run of slots through a write IRP of our own, which completes whenever the network stack returns the last
+ * of its packets, independently of the device control that submitted it. */
+_IRQL_requires_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunSubmitWrite(_Inout_ TUN_CTX *Ctx, _In_ FILE_OBJECT *FileObject, _In_ const TUN_SUBMIT_WRITE *Write)
+{
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)FileObject->FsContext;
+    UCHAR *user_address = InterlockedGetPointer(&file_ctx->WriteBuffer.UserAddress);
+    ULONG first, last;
+    if (!file_ctx->WriteSlots.Count || !user_address)
+        return STATUS_INVALID_DEVICE_STATE;
+    if (!TunSubmitWriteSlots(
+            Write, file_ctx->WriteSlots.Size, file_ctx->WriteBuffer.Size / file_ctx->WriteSlots.Size, &first, &last))
+        return STATUS_INVALID_USER_BUFFER;
+
+    IRP *irp = IoAllocateIrp(Ctx->Device.Object->StackSize, FALSE);
+    if (!irp)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    irp->UserBuffer = user_address + Write->Offset;
+    irp->RequestorMode = UserMode;
+    irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    IO_STACK_LOCATION *stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_WRITE;
+    stack->Parameters.Write.Length = Write->Size;
+    stack->FileObject = FileObject;
+    /* The submitting handle may well be closed before the stack returns the packets. */
+    ObReferenceObject(FileObject);
+    IoSetCompletionRoutine(irp, TunSubmitWriteComplete, FileObject, TRUE, TRUE, TRUE);
+    return IoCallDriver(Ctx->Device.Object, irp);
+}
+
+/* Settings that change how a handle's buffers are used may only change before either is mapped. Holding both mapping
+ * locks, no read or write can start meanwhile. Returns with the locks held if neither buffer is mapped yet. */
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+TunBuffersLockUnmapped(_Inout_ TUN_FILE_CTX *FileCtx)
+{
+    ExAcquireFastMutex(&FileCtx->ReadBuffer.InitializationComplete);
+    ExAcquireFastMutex(&FileCtx->WriteBuffer.InitializationComplete);
+    if (!InterlockedGetPointer(&FileCtx->ReadBuffer.UserAddress) &&
+        !InterlockedGetPointer(&FileCtx->WriteBuffer.UserAddress) && !ReadNoFence(&FileCtx->Locked))
+        return TRUE;
+    ExReleaseFastMutex(&FileCtx->WriteBuffer.InitializationComplete);
+    ExReleaseFastMutex(&FileCtx->ReadBuffer.InitializationComplete);
+    return FALSE;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+static void
+TunBuffersUnlock(_Inout_ TUN_FILE_CTX *FileCtx)
+{
+    ExReleaseFastMutex(&FileCtx->WriteBuffer.InitializationComplete);
+    ExReleaseFastMutex(&FileCtx->ReadBuffer.InitializationComplete);
+}
+
+/* Returns the NUMA node of a processor, or -1 if it is not active. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static LONG
+TunProcessorNode(_In_ const PROCESSOR_NUMBER *Processor)
+{
+    for (USHORT node = 0, highest = KeQueryHighestNodeNumber(); node <= highest; ++node)
+    {
+        GROUP_AFFINITY affinity;
+        KeQueryNodeActiveAffinity(node, &affinity, NULL);
+        if (affinity.Group == Processor->Group && affinity.Mask & ((KAFFINITY)1 << Processor->Number))
+            return node;
+    }
+    return -1;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunSetAffinity(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_FILE_CTX *FileCtx, _In_ const TUN_AFFINITY *Affinity)
+{
+    PROCESSOR_NUMBER processor = Affinity->Processor;
+    LONG index = -1, node = -1;
+    switch (Affinity->Type)
+    {
+    case TUN_AFFINITY_NONE:
+        break;
+
+    case TUN_AFFINITY_PROCESSOR:
+        if (processor.Number >= sizeof(KAFFINITY) * 8 || (node = TunProcessorNode(&processor)) < 0)
+            return STATUS_INVALID_PARAMETER;
+        break;
+
+    case TUN_AFFINITY_NODE: {
+        GROUP_AFFINITY affinity;
+        if (Affinity->Node > KeQueryHighestNodeNumber())
+            return STATUS_INVALID_PARAMETER;
+        KeQueryNodeActiveAffinity(Affinity->Node, &affinity, NULL);
+        if (!affinity.Mask)
+            return STATUS_INVALID_PARAMETER;
+        /* Any processor of the node will do, and the lowest numbered one is the least likely to be parked. */
+        RtlZeroMemory(&processor, sizeof(processor));
+        processor.Group = affinity.Group;
+        while (!(affinity.Mask & ((KAFFINITY)1 << processor.Number)))
+            ++processor.Number;
+        node = Affinity->Node;
+        break;
+    }
+
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (node >= 0)
+    {
+        ULONG i = KeGetProcessorIndexFromNumber(&processor);
+        if (i == INVALID_PROCESSOR_INDEX || i >= Ctx->NumCpus)
+            return STATUS_INVALID_PARAMETER;
+        index = (LONG)i;
+    }
+
+    InterlockedExchange(&FileCtx->Node, node);
+    LONG old_index = InterlockedExchange(&FileCtx->Processor, index);
+    if (old_index < 0 && index >= 0)
+        InterlockedIncrement(&Ctx->Affinity.Handles);
+    else if (old_index >= 0 && index < 0)
+        InterlockedDecrement(&Ctx->Affinity.Handles);
+    return STATUS_SUCCESS;
+}
+
+/* Subscribes a handle that has neither read nor written yet to the adapters of LuidIndices, none of which may belong
+ * to another mux already. Each counts the subscription as a handle of its own, so it stays connected. As in
+ * TunMuxClose, only the counts change under the locks, and the connections are indicated after. */
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunMuxSet(
+    _Inout_ TUN_CTX *Ctx,
+    _Inout_ TUN_FILE_CTX *FileCtx,
+    _In_reads_(Count) const ULONG *LuidIndices,
+    _In_ ULONG Count)
+{
+    NTSTATUS status;
+    TUN_MUX *mux = ExAllocatePoolWithTag(
+        NonPagedPoolNx, sizeof(*mux) + Count * sizeof(mux->Adapters[0]), TUN_HTONL(TUN_MEMORY_TAG));
+    if (!mux)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(mux, sizeof(*mux) + Count * sizeof(mux->Adapters[0]));
+    mux->Ctx = Ctx;
+    mux->FileObject = FileCtx->FileObject;
+    KeInitializeSpinLock(&mux->Lock);
+    mux->Count = Count;
+    /* Sorted, for TunMuxFind to bisect. */
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        ULONG j = i;
+        for (; j && mux->Adapters[j - 1].LuidIndex > LuidIndices[i]; --j)
+            mux->Adapters[j].LuidIndex = mux->Adapters[j - 1].LuidIndex;
+        mux->Adapters[j].LuidIndex = LuidIndices[i];
+    }
+
+    if (status = STATUS_INVALID_DEVICE_STATE, !TunBuffersLockUnmapped(FileCtx))
+        goto cleanup_ExFreePoolWithTag;
+    if (FileCtx->Mux || ReadNoFence(&FileCtx->Tap.Flags) || FileCtx->Format != TUN_EXCH_FORMAT_V1)
+        goto cleanup_TunBuffersUnlock;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&TunAdaptersLock, &irql);
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        if (status = STATUS_INVALID_PARAMETER, i && mux->Adapters[i].LuidIndex == mux->Adapters[i - 1].LuidIndex)
+            goto cleanup_KeReleaseSpinLock;
+        for (LIST_ENTRY *entry = TunAdapters.Flink; entry != &TunAdapters; entry = entry->Flink)
+        {
+            TUN_CTX *ctx = CONTAINING_RECORD(entry, TUN_CTX, Entry);
+            if (ctx->LuidIndex == mux->Adapters[i].LuidIndex)
+            {
+                mux->Adapters[i].Ctx = ctx;
+                break;
+            }
+        }
+        if (status = STATUS_NOT_FOUND, !mux->Adapters[i].Ctx)
+            goto cleanup_KeReleaseSpinLock;
+        if (status = STATUS_DEVICE_BUSY, ReadPointerNoFence((PVOID *)&mux->Adapters[i].Ctx->Mux))
+            goto cleanup_KeReleaseSpinLock;
+    }
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        TUN_CTX *ctx = mux->Adapters[i].Ctx;
+        InterlockedExchangePointer((PVOID *)&ctx->Mux, mux);
+        if (InterlockedIncrement64(&ctx->Device.RefCount) != 1)
+            continue;
+        /* Keeps the adapter from halting until it is indicated connected. As it is still listed, halting has yet to
+         * wait for the remove lock, so this cannot fail. */
+        IoAcquireRemoveLock(&ctx->Device.RemoveLock, mux);
+        mux->Adapters[i].Connect = ctx;
+    }
+    KeReleaseSpinLock(&TunAdaptersLock, irql);
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        TUN_CTX *ctx = mux->Adapters[i].Connect;
+        if (!ctx)
+            continue;
+        mux->Adapters[i].Connect = NULL;
+        NDIS_HANDLE handle = InterlockedGetPointer(&ctx->MiniportAdapterHandle);
+        if (handle)
+            TunIndicateStatus(handle, MediaConnectStateConnected, ctx->Config.LinkSpeed);
+        IoReleaseRemoveLock(&ctx->Device.RemoveLock, mux);
+    }
+    InterlockedExchangePointer((PVOID *)&FileCtx->Mux, mux);
+    TunBuffersUnlock(FileCtx);
+    return STATUS_SUCCESS;
+
+cleanup_KeReleaseSpinLock:
+    KeReleaseSpinLock(&TunAdaptersLock, irql);
+cleanup_TunBuffersUnlock:
+    TunBuffersUnlock(FileCtx);
+cleanup_ExFreePoolWithTag:
+    ExFreePoolWithTag(mux, TUN_HTONL(TUN_MEMORY_TAG));
+    return status;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunDispatchDeviceControl(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS status;
+    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
+    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)stack->FileObject->FsContext;
+    VOID *buffer = Irp->AssociatedIrp.SystemBuffer;
+
+    switch (stack->Parameters.DeviceIoControl.IoControlCode)
+    {
+    case TUN_IOCTL_SET_AFFINITY: {
+        TUN_AFFINITY affinity;
+        if (status = STATUS_INVALID_PARAMETER,
+            stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(TUN_AFFINITY))
+            break;
+        RtlCopyMemory(&affinity, buffer, sizeof(affinity));
+        status = TunSetAffinity(Ctx, file_ctx, &affinity);
+        break;
+    }
+
+    case TUN_IOCTL_SET_FILTER: {
+        ULONG size = stack->Parameters.DeviceIoControl.InputBufferLength;
+        TUN_FILTER_PROG *filter = NULL;
+        if (size)
+        {
+            if (status = STATUS_INVALID_PARAMETER, size % sizeof(TUN_FILTER_INSN) ||
+                                                       !TunFilterValidate(buffer, size / sizeof(TUN_FILTER_INSN)))
+                break;
+            if (status = STATUS_INSUFFICIENT_RESOURCES,
+                (filter = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*filter), TUN_HTONL(TUN_MEMORY_TAG))) == NULL)
+                break;
+            RtlZeroMemory(filter, sizeof(*filter));
+            filter->Count = size / sizeof(TUN_FILTER_INSN);
+            RtlCopyMemory(filter->Insns, buffer, size);
+        }
+        TUN_FILTER_PROG *old_filter = InterlockedExchangePointer((PVOID *)&file_ctx->Filter, filter);
+        if (old_filter)
+        {
+            TunRundownBarrier(Ctx); /* Wait for reads still filtering with the old program. */
+            ExFreePoolWithTag(old_filter, TUN_HTONL(TUN_MEMORY_TAG));
+        }
+        status = STATUS_SUCCESS;
+        break;
+    }
+
+    case TUN_IOCTL_GET_FILTER_DROPS: {
+        /* Keeps a concurrent TUN_IOCTL_SET_FILTER from freeing the program while we copy its counters. */
+        KIRQL irql = TunRundownAcquire(Ctx);
+        const TUN_FILTER_PROG *filter = ReadPointerNoFence((PVOID *)&file_ctx->Filter);
+        ULONG count = filter ? filter->Count : 0;
+        if (status = STATUS_BUFFER_TOO_SMALL,
+            stack->Parameters.DeviceIoControl.OutputBufferLength < count * sizeof(ULONG64))
+        {
+            TunRundownRelease(Ctx, irql);
+            break;
+        }
+        for (ULONG i = 0; i < count; ++i)
+            ((ULONG64 *)buffer)[i] = InterlockedGet64((LONG64 *)&filter->Drops[i]);
+        TunRundownRelease(Ctx, irql);
+        Irp->IoStatus.Information = count * sizeof(ULONG64);
+        status = STATUS_SUCCESS;
+        break;
+    }
+
+    case TUN_IOCTL_SET_FORMAT: {
+        ULONG format;
+        if (status = STATUS_INVALID_PARAMETER, stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(ULONG))
+            break;
+        RtlCopyMemory(&format, buffer, sizeof(format));
+        if (format != TUN_EXCH_FORMAT_V1 && format != TUN_EXCH_FORMAT_V2)
+            break;
+        if (status = STATUS_INVALID_DEVICE_STATE, !TunBuffersLockUnmapped(file_ctx))
+            break;
+        /* Mux handles exchange runs of packets in the default format only, and taps need it for the original size. */
+        if ((!file_ctx->Mux && !file_ctx->Tap.Flags) || format == TUN_EXCH_FORMAT_V1)
+        {
+            file_ctx->Format = (LONG)format;
+            status = STATUS_SUCCESS;
+        }
+        TunBuffersUnlock(file_ctx);
+        break;
+    }
+
+    case TUN_IOCTL_SET_LOCKING: {
+        ULONG locking;
+        if (status = STATUS_INVALID_PARAMETER, stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(ULONG))
+            break;
+        RtlCopyMemory(&locking, buffer, sizeof(locking));
+        if (locking != TUN_LOCKING_HANDLE && locking != TUN_LOCKING_CALL)
+            break;
+        if (status = STATUS_INVALID_DEVICE_STATE, !TunBuffersLockUnmapped(file_ctx))
+            break;
+        file_ctx->Locking = (LONG)locking;
+        TunBuffersUnlock(file_ctx);
+        status = STATUS_SUCCESS;
+        break;
+    }
 
-        ethtypeidx_t idx;
-        if (p->Size >= 20 && p->Data[0] >> 4 == 4)
-            idx = ethtypeidx_ipv4;
-        else if (p->Size >= 40 && p->Data[0] >> 4 == 6)
-            idx = ethtypeidx_ipv6;
-        else
+    case TUN_IOCTL_SET_WRITE_SLOTS: {
+        TUN_WRITE_SLOTS slots;
+        if (status = STATUS_INVALID_PARAMETER,
+            stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(TUN_WRITE_SLOTS))
+            break;
+        RtlCopyMemory(&slots, buffer, sizeof(slots));
+        if (!slots.SlotCount || slots.SlotCount > TUN_EXCH_MAX_WRITE_SLOTS || slots.SlotSize < sizeof(TUN_PACKET) ||
+            slots.SlotSize % TUN_EXCH_ALIGNMENT || slots.SlotSize > Ctx->Config.MaxBufferSize / slots.SlotCount ||
+            slots.Address != (ULONG_PTR)slots.Address)
+            break;
+        ExAcquireFastMutex(&file_ctx->WriteBuffer.InitializationComplete);
+        if (status = STATUS_INVALID_DEVICE_STATE,
+            InterlockedGetPointer(&file_ctx->WriteBuffer.UserAddress) || file_ctx->Locking != TUN_LOCKING_HANDLE)
         {
-            status = STATUS_INVALID_USER_BUFFER;
-            goto cleanup_nbl_queues;
+            ExReleaseFastMutex(&file_ctx->WriteBuffer.InitializationComplete);
+            break;
         }
+        /* Writes racing with this one see a slotted buffer that is not mapped yet, which none of them fall into. */
+        file_ctx->WriteSlots.Size = slots.SlotSize;
+        InterlockedExchange((LONG *)&file_ctx->WriteSlots.Count, (LONG)slots.SlotCount);
+        status = TunMapUbufferLocked(
+            Ctx, &file_ctx->WriteBuffer, (VOID *)(ULONG_PTR)slots.Address, slots.SlotSize * slots.SlotCount);
+        if (!NT_SUCCESS(status))
+            InterlockedExchange((LONG *)&file_ctx->WriteSlots.Count, 0);
+        ExReleaseFastMutex(&file_ctx->WriteBuffer.InitializationComplete);
+        break;
+    }
 
-        NET_BUFFER_LIST *nbl =
-            NdisAllocateNetBufferAndNetBufferList(Ctx->NBLPool, 0, 0, ubuffer->Mdl, (ULONG)(p->Data - buffer), p->Size);
-        if (!nbl)
+    case TUN_IOCTL_SUBMIT_WRITES: {
+        ULONG count = stack->Parameters.DeviceIoControl.InputBufferLength / sizeof(TUN_SUBMIT_WRITE);
+        if (status = STATUS_INVALID_PARAMETER,
+            !count || count > TUN_EXCH_MAX_WRITE_SLOTS ||
+                stack->Parameters.DeviceIoControl.InputBufferLength % sizeof(TUN_SUBMIT_WRITE))
+            break;
+        if (status = STATUS_BUFFER_TOO_SMALL,
+            stack->Parameters.DeviceIoControl.OutputBufferLength < count * sizeof(NTSTATUS))
+            break;
+        /* Statuses are smaller than writes, so each one only overwrites writes already submitted. */
+        for (ULONG i = 0; i < count; ++i)
         {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto cleanup_nbl_queues;
+            TUN_SUBMIT_WRITE write = ((const TUN_SUBMIT_WRITE *)buffer)[i];
+            ((NTSTATUS *)buffer)[i] = TunSubmitWrite(Ctx, stack->FileObject, &write);
         }
-
-        nbl->SourceHandle = Ctx->MiniportAdapterHandle;
-        NdisSetNblFlag(nbl, ether_const[idx].nbl_flags);
-        NET_BUFFER_LIST_INFO(nbl, NetBufferListFrameType) = (PVOID)ether_const[idx].nbl_proto;
-        NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SUCCESS;
-        NET_BUFFER_LIST_IRP(nbl) = Irp;
-        TunAppendNBL(&nbl_queue[idx].head, &nbl_queue[idx].tail, nbl);
-        nbl_queue[idx].count++;
-        nbl_count++;
-        b += p_size;
-    }
-
-    if ((ULONG)(b - buffer) != size)
-    {
-        status = STATUS_INVALID_USER_BUFFER;
-        goto cleanup_nbl_queues;
-    }
-    Irp->IoStatus.Information = size;
-
-    if (!nbl_count)
-    {
+        Irp->IoStatus.Information = count * sizeof(NTSTATUS);
         status = STATUS_SUCCESS;
-        goto cleanup_ExReleaseSpinLockShared;
+        break;
     }
-    if (!(flags & TUN_FLAGS_RUNNING))
-    {
-        InterlockedAdd64((LONG64 *)&Ctx->Statistics.ifInDiscards, nbl_count);
-        InterlockedAdd64((LONG64 *)&Ctx->Statistics.ifInErrors, nbl_count);
+
+    case TUN_IOCTL_GET_WRITE_SLOTS: {
+        ULONG size = (file_ctx->WriteSlots.Count + 31) / 32 * sizeof(ULONG);
+        if (status = STATUS_BUFFER_TOO_SMALL, stack->Parameters.DeviceIoControl.OutputBufferLength < size)
+            break;
+        for (ULONG i = 0; i < size / sizeof(ULONG); ++i)
+            ((ULONG *)buffer)[i] = (ULONG)ReadNoFence(&file_ctx->WriteSlots.Busy[i]);
+        Irp->IoStatus.Information = size;
         status = STATUS_SUCCESS;
-        goto cleanup_nbl_queues;
+        break;
     }
 
-    InterlockedAdd64(&Ctx->ActiveNBLCount, nbl_count);
-    InterlockedExchange(IRP_REFCOUNT(Irp), nbl_count);
-    IoMarkIrpPending(Irp);
-
-    if (nbl_queue[ethtypeidx_ipv4].head)
-        NdisMIndicateReceiveNetBufferLists(
-            Ctx->MiniportAdapterHandle,
-            nbl_queue[ethtypeidx_ipv4].head,
-            NDIS_DEFAULT_PORT_NUMBER,
-            nbl_queue[ethtypeidx_ipv4].count,
-            NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
-    if (nbl_queue[ethtypeidx_ipv6].head)
-        NdisMIndicateReceiveNetBufferLists(
-            Ctx->MiniportAdapterHandle,
-            nbl_queue[ethtypeidx_ipv6].head,
-            NDIS_DEFAULT_PORT_NUMBER,
-            nbl_queue[ethtypeidx_ipv6].count,
-            NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
-
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, irql);
-    TunCompletePause(Ctx, TRUE);
-    return STATUS_PENDING;
-
-cleanup_nbl_queues:
-    for (ethtypeidx_t idx = ethtypeidx_start; idx < ethtypeidx_end; idx++)
-    {
-        for (NET_BUFFER_LIST *nbl = nbl_queue[idx].head, *nbl_next; nbl; nbl = nbl_next)
+    case TUN_IOCTL_SET_TAP: {
+        TUN_TAP tap;
+        if (status = STATUS_INVALID_PARAMETER, stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(TUN_TAP))
+            break;
+        RtlCopyMemory(&tap, buffer, sizeof(tap));
+        if (!tap.Flags || tap.Flags & ~(TUN_TAP_TRANSMIT | TUN_TAP_RECEIVE) ||
+            tap.MaxPackets > TUN_QUEUE_MAX_NBLS_LIMIT)
+            break;
+        if (status = STATUS_INVALID_DEVICE_STATE, !TunBuffersLockUnmapped(file_ctx))
+            break;
+        /* Copies cut to the snap length carry their original size, which the compact format has no room for. */
+        if (file_ctx->Mux || file_ctx->Format != TUN_EXCH_FORMAT_V1)
         {
-            nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
-            NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
-            NdisFreeNetBufferList(nbl);
+            TunBuffersUnlock(file_ctx);
+            break;
+        }
+        ULONG snap_length = tap.SnapLength && tap.SnapLength < Ctx->Config.MaxIpPacketSize
+                                ? tap.SnapLength
+                                : Ctx->Config.MaxIpPacketSize;
+        LONG max_packets = tap.MaxPackets ? (LONG)tap.MaxPackets : (LONG)Ctx->Config.QueueMaxNbls;
+        /* Fits at least one copy of the snap length, as TUN_TAP_MAX_RING_SIZE always does. */
+        ULONG ring_size = (ULONG)min((ULONG64)max_packets * TunCopyFootprint(snap_length), TUN_TAP_MAX_RING_SIZE);
+        UCHAR *ring = ExAllocatePoolWithTag(NonPagedPoolNx, ring_size, TUN_HTONL(TUN_MEMORY_TAG));
+        if (status = STATUS_INSUFFICIENT_RESOURCES, !ring)
+        {
+            TunBuffersUnlock(file_ctx);
+            break;
+        }
+        /* Packets may be copied for the tap meanwhile, so the ring is swapped under its lock, dropping what it held. */
+        KLOCK_QUEUE_HANDLE lqh;
+        KeAcquireInStackQueuedSpinLock(&file_ctx->Tap.Lock, &lqh);
+        UCHAR *ring_old = file_ctx->Tap.Ring.Buffer;
+        InterlockedAdd64(&Ctx->Device.TapDrops, file_ctx->Tap.Ring.Count);
+        file_ctx->Tap.SnapLength = snap_length;
+        TunCopyRingInit(&file_ctx->Tap.Ring, ring, ring_size, max_packets);
+        BOOLEAN was_tap = !!InterlockedExchange(&file_ctx->Tap.Flags, (LONG)tap.Flags);
+        KeReleaseInStackQueuedSpinLock(&lqh);
+        if (ring_old)
+            ExFreePoolWithTag(ring_old, TUN_HTONL(TUN_MEMORY_TAG));
+        TunBuffersUnlock(file_ctx);
+        /* Taps only watch, so they do not keep the adapter connected. */
+        if (!was_tap)
+        {
+            InterlockedIncrement(&Ctx->Device.Taps);
+            TunHandleClosed(Ctx);
         }
+        status = STATUS_SUCCESS;
+        break;
     }
-cleanup_ExReleaseSpinLockShared:
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, irql);
-cleanup_CompleteRequest:
-    TunCompleteRequest(Ctx, Irp, status, IO_NO_INCREMENT);
-    TunCompletePause(Ctx, TRUE);
-    return status;
-}
-
-static MINIPORT_RETURN_NET_BUFFER_LISTS TunReturnNetBufferLists;
-_Use_decl_annotations_
-static void
-TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST NetBufferLists, ULONG ReturnFlags)
-{
-    TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
 
-    LONG64 stat_size = 0, stat_p_ok = 0, stat_p_err = 0;
-    for (NET_BUFFER_LIST *nbl = NetBufferLists, *nbl_next; nbl; nbl = nbl_next)
-    {
-        nbl_next = NET_BUFFER_LIST_NEXT_NBL(nbl);
-        NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
+    case TUN_IOCTL_SET_MUX: {
+        ULONG size = stack->Parameters.DeviceIoControl.InputBufferLength;
+        if (status = STATUS_INVALID_PARAMETER,
+            !size || size % sizeof(ULONG) || size / sizeof(ULONG) > TUN_MUX_MAX_ADAPTERS)
+            break;
+        status = TunMuxSet(Ctx, file_ctx, buffer, size / sizeof(ULONG));
+        break;
+    }
 
-        IRP *irp = NET_BUFFER_LIST_IRP(nbl);
-        if (NT_SUCCESS(NET_BUFFER_LIST_STATUS(nbl)))
+    case TUN_IOCTL_GET_STATISTICS: {
+        TUN_STATISTICS stats;
+        if (status = STATUS_BUFFER_TOO_SMALL,
+            stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(TUN_STATISTICS))
+            break;
+        for (TUN_LANE_ID lane = 0; lane < TUN_LANE_COUNT; ++lane)
         {
-            ULONG p_size = NET_BUFFER_LIST_FIRST_NB(nbl)->DataLength;
-            stat_size += p_size;
-            stat_p_ok++;
+            stats.QueuedPackets[lane] = ReadNoFence64(&Ctx->PacketQueue.Lanes[lane].QueuedNbls);
+            stats.DroppedPackets[lane] = ReadNoFence64(&Ctx->PacketQueue.Lanes[lane].DroppedNbls);
         }
-        else
-            stat_p_err++;
-
-        NdisFreeNetBufferList(nbl);
-        TunCompletePause(ctx, TRUE);
-
-        ASSERT(InterlockedGet(IRP_REFCOUNT(irp)) > 0);
-        if (InterlockedDecrement(IRP_REFCOUNT(irp)) <= 0)
-            TunCompleteRequest(ctx, irp, STATUS_SUCCESS, IO_NETWORK_INCREMENT);
+        stats.CrossNodeCopies = InterlockedGet64(&Ctx->Affinity.CrossNodeCopies);
+        stats.SupersededAcks = ReadNoFence64(&Ctx->PacketQueue.AckFilter.Superseded);
+        stats.TapDrops = InterlockedGet64(&Ctx->Device.TapDrops);
+        stats.LockedBytes = InterlockedGet64(&Ctx->Device.LockedBytes);
+        stats.PeakLockedBytes = InterlockedGet64(&Ctx->Device.PeakLockedBytes);
+        RtlCopyMemory(buffer, &stats, sizeof(stats));
+        Irp->IoStatus.Information = sizeof(stats);
+        status = STATUS_SUCCESS;
+        break;
     }
 
-    InterlockedAdd64((LONG64 *)&ctx->Statistics.ifHCInOctets, stat_size);
-    InterlockedAdd64((LONG64 *)&ctx->Statistics.ifHCInUcastOctets, stat_size);
-    InterlockedAdd64((LONG64 *)&ctx->Statistics.ifHCInUcastPkts, stat_p_ok);
-    InterlockedAdd64((LONG64 *)&ctx->Statistics.ifInErrors, stat_p_err);
-}
-
-_IRQL_requires_max_(APC_LEVEL)
-_Must_inspect_result_
-static NTSTATUS
-TunDispatchCreate(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
-{
-    NTSTATUS status;
-    TUN_FILE_CTX *file_ctx = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*file_ctx), TUN_HTONL(TUN_MEMORY_TAG));
-    if (!file_ctx)
-        return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(file_ctx, sizeof(*file_ctx));
-    ExInitializeFastMutex(&file_ctx->ReadBuffer.InitializationComplete);
-    ExInitializeFastMutex(&file_ctx->WriteBuffer.InitializationComplete);
-
-    KIRQL irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-    LONG flags = InterlockedGet(&Ctx->Flags);
-    if ((status = STATUS_DELETE_PENDING, !(flags & TUN_FLAGS_PRESENT)))
-        goto cleanup_ExReleaseSpinLockShared;
-
-    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
-    if (!NT_SUCCESS(status = IoAcquireRemoveLock(&Ctx->Device.RemoveLock, stack->FileObject)))
-        goto cleanup_ExReleaseSpinLockShared;
-    stack->FileObject->FsContext = file_ctx;
-
-    if (InterlockedIncrement64(&Ctx->Device.RefCount) == 1)
-        TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateConnected);
-
-    status = STATUS_SUCCESS;
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
 
-cleanup_ExReleaseSpinLockShared:
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, irql);
     TunCompleteRequest(Ctx, Irp, status, IO_NO_INCREMENT);
-    if (!NT_SUCCESS(status))
-        ExFreePoolWithTag(file_ctx, TUN_HTONL(TUN_MEMORY_TAG));
     return status;
 }
 
-_IRQL_requires_max_(DISPATCH_LEVEL)
-static void
-TunDispatchClose(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
-{
-    IO_STACK_LOCATION *stack = IoGetCurrentIrpStackLocation(Irp);
-    ASSERT(InterlockedGet64(&Ctx->Device.RefCount) > 0);
-    BOOLEAN last_handle = InterlockedDecrement64(&Ctx->Device.RefCount) <= 0;
-    ExReleaseSpinLockExclusive(
-        &Ctx->TransitionLock,
-        ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-    if (last_handle)
-    {
-        NDIS_HANDLE handle = InterlockedGetPointer(&Ctx->MiniportAdapterHandle);
-        if (handle)
-            TunIndicateStatus(handle, MediaConnectStateDisconnected);
-        TunQueueClear(Ctx, NDIS_STATUS_MEDIA_DISCONNECTED);
-    }
-    TUN_FILE_CTX *file_ctx = (TUN_FILE_CTX *)stack->FileObject->FsContext;
-    TunUnmapUbuffer(&file_ctx->ReadBuffer);
-    TunUnmapUbuffer(&file_ctx->WriteBuffer);
-    ExFreePoolWithTag(file_ctx, TUN_HTONL(TUN_MEMORY_TAG));
-    IoReleaseRemoveLock(&Ctx->Device.RemoveLock, stack->FileObject);
-}
-
 static DRIVER_DISPATCH TunDispatch;
 _Use_decl_annotations_
 static NTSTATUS
@@ -1012,7 +3546,7 @@ TunDispatch(DEVICE_OBJECT *DeviceObject, IRP *Irp)
     NTSTATUS status = STATUS_SUCCESS;
 
     Irp->IoStatus.Information = 0;
-    TUN_CTX *ctx = NdisGetDeviceReservedExtension(DeviceObject);
+    TUN_CTX *ctx = TunCtxFromExtension(NdisGetDeviceReservedExtension(DeviceObject));
     if (!ctx)
     {
         status = STATUS_INVALID_HANDLE;
@@ -1037,6 +3571,11 @@ TunDispatch(DEVICE_OBJECT *DeviceObject, IRP *Irp)
             goto cleanup_complete_req;
         return TunDispatchCreate(ctx, Irp);
 
+    case IRP_MJ_DEVICE_CONTROL:
+        if (!NT_SUCCESS(status = IoAcquireRemoveLock(&ctx->Device.RemoveLock, Irp)))
+            goto cleanup_complete_req;
+        return TunDispatchDeviceControl(ctx, Irp);
+
     case IRP_MJ_CLOSE:
         TunDispatchClose(ctx, Irp);
         break;
@@ -1045,6 +3584,12 @@ TunDispatch(DEVICE_OBJECT *DeviceObject, IRP *Irp)
         for (IRP *pending_irp;
              (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.ReadQueue.Csq, stack->FileObject)) != NULL;)
             TunCompleteRequest(ctx, pending_irp, STATUS_CANCELLED, IO_NO_INCREMENT);
+        for (IRP *pending_irp;
+             (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.TapQueue.Csq, stack->FileObject)) != NULL;)
+            TunCompleteRequest(ctx, pending_irp, STATUS_CANCELLED, IO_NO_INCREMENT);
+        for (IRP *pending_irp;
+             (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.MuxQueue.Csq, stack->FileObject)) != NULL;)
+            TunCompleteRequest(ctx, pending_irp, STATUS_CANCELLED, IO_NO_INCREMENT);
         break;
 
     default:
@@ -1076,10 +3621,8 @@ TunDispatchPnP(DEVICE_OBJECT *DeviceObject, IRP *Irp)
         case IRP_MN_QUERY_REMOVE_DEVICE:
         case IRP_MN_SURPRISE_REMOVAL: {
             InterlockedAnd(&ctx->Flags, ~TUN_FLAGS_PRESENT);
-            ExReleaseSpinLockExclusive(
-                &ctx->TransitionLock,
-                ExAcquireSpinLockExclusive(&ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-            TunQueueClear(ctx, NDIS_STATUS_ADAPTER_REMOVED);
+            TunRundownBarrier(ctx); /* Ensure above change is visible to all readers. */
+            TunQueueClear(ctx, NDIS_STATUS_ADAPTER_REMOVED, FALSE);
             break;
         }
 
@@ -1099,9 +3642,14 @@ TunRestart(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_RESTART_PARAMETERS
 {
     TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
 
-    InterlockedExchange64(&ctx->ActiveNBLCount, 1);
+    InterlockedExchange64(&ctx->ActiveNBLCount, TUN_ACTIVE_NBL_BIAS + 1);
     InterlockedOr(&ctx->Flags, TUN_FLAGS_RUNNING);
 
+    /* Hand out whatever was parked over the pause to reads that are already waiting. */
+    KIRQL irql = TunRundownAcquire(ctx);
+    TunQueueKick(ctx);
+    TunRundownRelease(ctx, irql);
+
     return NDIS_STATUS_SUCCESS;
 }
 
@@ -1113,12 +3661,20 @@ TunPause(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_PAUSE_PARAMETERS Min
     TUN_CTX *ctx = (TUN_CTX *)MiniportAdapterContext;
 
     InterlockedAnd(&ctx->Flags, ~TUN_FLAGS_RUNNING);
-    ExReleaseSpinLockExclusive(
-        &ctx->TransitionLock,
-        ExAcquireSpinLockExclusive(&ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-    TunQueueClear(ctx, NDIS_STATUS_PAUSED);
+    TunRundownBarrier(ctx); /* Ensure above change is visible to all readers. */
 
-    return TunCompletePause(ctx, FALSE);
+    /* No processor touches its own count anymore, so fold them all into the central one along with the bias. */
+    LONG64 active_nbl_count = -TUN_ACTIVE_NBL_BIAS;
+    for (ULONG i = 0; i < ctx->NumCpus; ++i)
+    {
+        active_nbl_count += ctx->Cpus[i].ActiveNBLCount;
+        ctx->Cpus[i].ActiveNBLCount = 0;
+    }
+    InterlockedAdd64(&ctx->ActiveNBLCount, active_nbl_count);
+
+    TunQueueClear(ctx, NDIS_STATUS_PAUSED, ctx->Config.ParkOnPause);
+
+    return TunCompletePause(ctx, 1, FALSE);
 }
 
 static MINIPORT_DEVICE_PNP_EVENT_NOTIFY TunDevicePnPEventNotify;
@@ -1128,6 +3684,73 @@ TunDevicePnPEventNotify(NDIS_HANDLE MiniportAdapterContext, PNET_DEVICE_PNP_EVEN
 {
 }
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static ULONG
+TunReadConfigDword(
+    _In_ NDIS_HANDLE Config,
+    _In_ NDIS_STRING *Keyword,
+    _In_ ULONG Default,
+    _In_ ULONG Min,
+    _In_ ULONG Max)
+{
+    NDIS_STATUS status;
+    NDIS_CONFIGURATION_PARAMETER *param;
+    NdisReadConfiguration(&status, &param, Config, Keyword, NdisParameterInteger);
+    if (status != NDIS_STATUS_SUCCESS || param->ParameterType != NdisParameterInteger)
+        return Default;
+    return param->ParameterData.IntegerData < Min   ? Min
+           : param->ParameterData.IntegerData > Max ? Max
+                                                    : param->ParameterData.IntegerData;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static void
+TunReadConfig(_In_ NDIS_HANDLE MiniportAdapterHandle, _Out_ TUN_CONFIG *Config)
+{
+    Config->MaxPackets = TUN_EXCH_MAX_PACKETS;
+    Config->MaxPacketSize = TUN_EXCH_MAX_PACKET_SIZE;
+    Config->QueueMaxNbls = TUN_QUEUE_MAX_NBLS;
+    Config->LinkSpeed = TUN_LINK_SPEED;
+    Config->ParkOnPause = FALSE;
+    Config->AckFilter = FALSE;
+    Config->DeferSend = FALSE;
+
+    NDIS_CONFIGURATION_OBJECT config_obj = { .Header = { .Type = NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT,
+                                                         .Revision = NDIS_CONFIGURATION_OBJECT_REVISION_1,
+                                                         .Size = NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1 },
+                                             .NdisHandle = MiniportAdapterHandle };
+    NDIS_HANDLE config;
+    if (NdisOpenConfigurationEx(&config_obj, &config) == NDIS_STATUS_SUCCESS)
+    {
+        NDIS_STRING max_packets = NDIS_STRING_CONST("MaxPackets"),
+                    max_packet_size = NDIS_STRING_CONST("MaxPacketSize"),
+                    queue_max_nbls = NDIS_STRING_CONST("QueueMaxNbls"),
+                    link_speed = NDIS_STRING_CONST("LinkSpeed"), /* Mbps */
+                    park_on_pause = NDIS_STRING_CONST("ParkOnPause"),
+                    ack_filter = NDIS_STRING_CONST("AckFilter"),
+                    defer_send = NDIS_STRING_CONST("DeferSend");
+        Config->MaxPackets = TunReadConfigDword(config, &max_packets, Config->MaxPackets, 1, TUN_EXCH_MAX_PACKETS);
+        Config->MaxPacketSize = TunReadConfigDword(
+                                    config,
+                                    &max_packet_size,
+                                    Config->MaxPacketSize,
+                                    TUN_EXCH_MIN_PACKET_SIZE,
+                                    TUN_EXCH_MAX_PACKET_SIZE) &
+                                ~(ULONG)(TUN_EXCH_ALIGNMENT - 1);
+        Config->QueueMaxNbls =
+            TunReadConfigDword(config, &queue_max_nbls, Config->QueueMaxNbls, 1, TUN_QUEUE_MAX_NBLS_LIMIT);
+        Config->LinkSpeed =
+            TunReadConfigDword(config, &link_speed, (ULONG)(Config->LinkSpeed / 1000000), 1, MAXULONG) * 1000000ULL;
+        Config->ParkOnPause = (BOOLEAN)TunReadConfigDword(config, &park_on_pause, Config->ParkOnPause, 0, 1);
+        Config->AckFilter = (BOOLEAN)TunReadConfigDword(config, &ack_filter, Config->AckFilter, 0, 1);
+        Config->DeferSend = (BOOLEAN)TunReadConfigDword(config, &defer_send, Config->DeferSend, 0, 1);
+        NdisCloseConfiguration(config);
+    }
+
+    Config->MaxIpPacketSize = Config->MaxPacketSize - sizeof(TUN_PACKET);
+    Config->MaxBufferSize = Config->MaxPackets * Config->MaxPacketSize;
+}
+
 static MINIPORT_INITIALIZE TunInitializeEx;
 _Use_decl_annotations_
 static NDIS_STATUS
@@ -1172,7 +3795,7 @@ TunInitializeEx(
         NULL,        /* IRP_MJ_SET_VOLUME_INFORMATION   */
         NULL,        /* IRP_MJ_DIRECTORY_CONTROL        */
         NULL,        /* IRP_MJ_FILE_SYSTEM_CONTROL      */
-        NULL,        /* IRP_MJ_DEVICE_CONTROL           */
+        TunDispatch, /* IRP_MJ_DEVICE_CONTROL           */
         NULL,        /* IRP_MJ_INTERNAL_DEVICE_CONTROL  */
         NULL,        /* IRP_MJ_SHUTDOWN                 */
         NULL,        /* IRP_MJ_LOCK_CONTROL             */
@@ -1185,7 +3808,7 @@ TunInitializeEx(
         .DeviceName = &unicode_device_name,
         .SymbolicName = &unicode_symbolic_name,
         .MajorFunctions = dispatch_table,
-        .ExtensionSize = sizeof(TUN_CTX),
+        .ExtensionSize = TUN_CTX_EXTENSION_SIZE,
         .DefaultSDDLString = &SDDL_DEVOBJ_SYS_ALL /* Kernel, and SYSTEM: full control. Others: none */
     };
     NDIS_HANDLE handle;
@@ -1195,7 +3818,7 @@ TunInitializeEx(
 
     object->Flags &= ~(DO_BUFFERED_IO | DO_DIRECT_IO);
 
-    TUN_CTX *ctx = NdisGetDeviceReservedExtension(object);
+    TUN_CTX *ctx = TunCtxFromExtension(NdisGetDeviceReservedExtension(object));
     if (!ctx)
     {
         status = NDIS_STATUS_FAILURE;
@@ -1232,21 +3855,28 @@ TunInitializeEx(
         NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT |
         NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT;
 
+    ctx->RxChecksum = TUN_RX_CSUM_ALL;
+    TunReadConfig(MiniportAdapterHandle, &ctx->Config);
+
     ctx->Device.Handle = handle;
     ctx->Device.Object = object;
     IoInitializeRemoveLock(&ctx->Device.RemoveLock, TUN_HTONL(TUN_MEMORY_TAG), 0, 0);
-    KeInitializeSpinLock(&ctx->Device.ReadQueue.Lock);
-    IoCsqInitializeEx(
-        &ctx->Device.ReadQueue.Csq,
-        TunCsqInsertIrpEx,
-        TunCsqRemoveIrp,
-        TunCsqPeekNextIrp,
-        TunCsqAcquireLock,
-        TunCsqReleaseLock,
-        TunCsqCompleteCanceledIrp);
-    InitializeListHead(&ctx->Device.ReadQueue.List);
+    TunIrpQueueInit(&ctx->Device.ReadQueue, ctx);
+    TunIrpQueueInit(&ctx->Device.TapQueue, ctx);
+    TunIrpQueueInit(&ctx->Device.MuxQueue, ctx);
+    KeInitializeSpinLock(&ctx->Device.Files.Lock);
+    InitializeListHead(&ctx->Device.Files.List);
 
     KeInitializeSpinLock(&ctx->PacketQueue.Lock);
+    KeInitializeSpinLock(&ctx->Rundown.Lock);
+    KeInitializeSpinLock(&ctx->Receive.Lock);
+    KeInitializeDpc(&ctx->Receive.Dpc, TunReceiveDpc, ctx);
+    KeInitializeTimer(&ctx->Receive.Deadline);
+    KeInitializeDpc(&ctx->Receive.DeadlineDpc, TunReceiveDeadlineDpc, ctx);
+    /* Strict priority lets the high lane starve the others, so it only gets a quarter of the queue. */
+    ctx->PacketQueue.Lanes[TUN_LANE_HIGH].MaxNbls = max(ctx->Config.QueueMaxNbls / 4, 1);
+    ctx->PacketQueue.Lanes[TUN_LANE_NORMAL].MaxNbls = ctx->Config.QueueMaxNbls;
+    ctx->PacketQueue.Lanes[TUN_LANE_LOW].MaxNbls = ctx->Config.QueueMaxNbls;
 
     NET_BUFFER_LIST_POOL_PARAMETERS nbl_pool_param = {
         .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
@@ -1265,6 +3895,32 @@ TunInitializeEx(
         goto cleanup_NdisDeregisterDeviceEx;
     }
 
+    /* Sized for processors that may be hot-added later, since any of them may take a rundown reference. */
+    ctx->NumCpus = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ctx->Rss.NumQueues = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ctx->Cpus = ExAllocatePoolWithTag(
+        NonPagedPoolNxCacheAligned, sizeof(*ctx->Cpus) * ctx->NumCpus, TUN_HTONL(TUN_MEMORY_TAG));
+    if (!ctx->Cpus)
+    {
+        status = NDIS_STATUS_RESOURCES;
+        goto cleanup_NdisFreeNetBufferListPool;
+    }
+    NdisZeroMemory(ctx->Cpus, sizeof(*ctx->Cpus) * ctx->NumCpus);
+    for (ULONG i = 0; i < ctx->NumCpus; ++i)
+    {
+        TUN_RSS_QUEUE *queue = &ctx->Cpus[i].RssQueue;
+        PROCESSOR_NUMBER processor;
+        queue->Ctx = ctx;
+        KeInitializeSpinLock(&queue->Lock);
+        KeInitializeDpc(&queue->Dpc, TunRssDpc, queue);
+        KeInitializeDpc(&ctx->Cpus[i].DrainDpc, TunQueueDrainDpc, ctx);
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor)))
+        {
+            KeSetTargetProcessorDpcEx(&queue->Dpc, &processor);
+            KeSetTargetProcessorDpcEx(&ctx->Cpus[i].DrainDpc, &processor);
+        }
+    }
+
     NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES attr = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES,
                     .Revision = NdisVersion < NDIS_RUNTIME_VERSION_630
@@ -1281,7 +3937,7 @@ TunInitializeEx(
             status = NdisMSetMiniportAttributes(MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&attr)))
     {
         status = NDIS_STATUS_FAILURE;
-        goto cleanup_NdisFreeNetBufferListPool;
+        goto cleanup_ExFreePoolWithTag;
     }
 
     NDIS_PM_CAPABILITIES pmcap = {
@@ -1309,21 +3965,36 @@ TunInitializeEx(
                                         OID_GEN_STATISTICS,
                                         OID_GEN_INTERRUPT_MODERATION,
                                         OID_GEN_LINK_PARAMETERS,
+                                        OID_TCP_OFFLOAD_PARAMETERS,
+                                        OID_GEN_RECEIVE_SCALE_PARAMETERS,
                                         OID_PNP_SET_POWER,
                                         OID_PNP_QUERY_POWER };
+    NDIS_RECEIVE_SCALE_CAPABILITIES rss_cap = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_RSS_CAPABILITIES,
+                    .Revision = NdisVersion < NDIS_RUNTIME_VERSION_630 ? NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_1
+                                                                       : NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_2,
+                    .Size = NdisVersion < NDIS_RUNTIME_VERSION_630
+                                ? NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_1
+                                : NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_2 },
+        .CapabilitiesFlags = NDIS_RSS_CAPS_CLASSIFICATION_AT_DPC | NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV4 |
+                             NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6 | NdisHashFunctionToeplitz,
+        .NumberOfInterruptMessages = 1,
+        .NumberOfReceiveQueues = ctx->Rss.NumQueues,
+        .NumberOfIndirectionTableEntries = TUN_RSS_MAX_INDIRECTION
+    };
     NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES gen = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES,
                     .Revision = NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2,
                     .Size = NDIS_SIZEOF_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2 },
         .MediaType = NdisMediumIP,
         .PhysicalMediumType = NdisPhysicalMediumUnspecified,
-        .MtuSize = TUN_EXCH_MAX_IP_PACKET_SIZE,
-        .MaxXmitLinkSpeed = TUN_LINK_SPEED,
-        .MaxRcvLinkSpeed = TUN_LINK_SPEED,
-        .RcvLinkSpeed = TUN_LINK_SPEED,
-        .XmitLinkSpeed = TUN_LINK_SPEED,
+        .MtuSize = ctx->Config.MaxIpPacketSize,
+        .MaxXmitLinkSpeed = ctx->Config.LinkSpeed,
+        .MaxRcvLinkSpeed = ctx->Config.LinkSpeed,
+        .RcvLinkSpeed = ctx->Config.LinkSpeed,
+        .XmitLinkSpeed = ctx->Config.LinkSpeed,
         .MediaConnectState = MediaConnectStateDisconnected,
-        .LookaheadSize = TUN_EXCH_MAX_IP_PACKET_SIZE,
+        .LookaheadSize = ctx->Config.MaxIpPacketSize,
         .MacOptions =
             NDIS_MAC_OPTION_TRANSFERS_NOT_PEND | NDIS_MAC_OPTION_COPY_LOOKAHEAD_DATA | NDIS_MAC_OPTION_NO_LOOPBACK,
         .SupportedPacketFilters = NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_ALL_MULTICAST |
@@ -1341,23 +4012,48 @@ TunInitializeEx(
             NDIS_LINK_STATE_DUPLEX_AUTO_NEGOTIATED | NDIS_LINK_STATE_PAUSE_FUNCTIONS_AUTO_NEGOTIATED,
         .SupportedOidList = suported_oids,
         .SupportedOidListLength = sizeof(suported_oids),
+        .RecvScaleCapabilities = &rss_cap,
         .PowerManagementCapabilitiesEx = &pmcap
     };
     if (!NT_SUCCESS(
             status = NdisMSetMiniportAttributes(MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&gen)))
     {
         status = NDIS_STATUS_FAILURE;
-        goto cleanup_NdisFreeNetBufferListPool;
+        goto cleanup_ExFreePoolWithTag;
+    }
+
+    NDIS_OFFLOAD offload;
+    TunOffloadFill(&offload, TUN_RX_CSUM_ALL);
+    NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES offload_attr = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES,
+                    .Revision = NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1,
+                    .Size = NDIS_SIZEOF_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1 },
+        .DefaultOffloadConfiguration = &offload,
+        .HardwareOffloadCapabilities = &offload
+    };
+    if (!NT_SUCCESS(
+            status =
+                NdisMSetMiniportAttributes(MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&offload_attr)))
+    {
+        status = NDIS_STATUS_FAILURE;
+        goto cleanup_ExFreePoolWithTag;
     }
 
     /* A miniport driver can call NdisMIndicateStatusEx after setting its
      * registration attributes even if the driver is still in the context
      * of the MiniportInitializeEx function. */
-    TunIndicateStatus(MiniportAdapterHandle, MediaConnectStateDisconnected);
+    TunIndicateStatus(MiniportAdapterHandle, MediaConnectStateDisconnected, ctx->Config.LinkSpeed);
     InterlockedIncrement64(&TunAdapterCount);
+    ctx->LuidIndex = (ULONG)MiniportInitParameters->NetLuid.Info.NetLuidIndex;
+    KIRQL irql;
+    KeAcquireSpinLock(&TunAdaptersLock, &irql);
+    InsertTailList(&TunAdapters, &ctx->Entry);
+    KeReleaseSpinLock(&TunAdaptersLock, irql);
     InterlockedOr(&ctx->Flags, TUN_FLAGS_PRESENT);
     return NDIS_STATUS_SUCCESS;
 
+cleanup_ExFreePoolWithTag:
+    ExFreePoolWithTag(ctx->Cpus, TUN_HTONL(TUN_MEMORY_TAG));
 cleanup_NdisFreeNetBufferListPool:
     NdisFreeNetBufferListPool(ctx->NBLPool);
 cleanup_NdisDeregisterDeviceEx:
@@ -1391,9 +4087,55 @@ TunDeviceSetDenyAllDacl(_In_ DEVICE_OBJECT *DeviceObject)
     return status;
 }
 
+/* Closes the handles that the openers of our file objects still hold to them. Only their own handle tables are
+ * searched, so this is cheap regardless of how many handles the system has. Handles that were duplicated into other
+ * processes are left for TunForceHandlesClosedByScan(). Returns how many file objects are still open afterwards. */
 _IRQL_requires_max_(PASSIVE_LEVEL)
-static void
+static ULONG
 TunForceHandlesClosed(_Inout_ TUN_CTX *Ctx)
+{
+    for (;;)
+    {
+        FILE_OBJECT *file = NULL;
+        PEPROCESS process = NULL;
+        ULONG open = 0;
+        KLOCK_QUEUE_HANDLE lqh;
+        KeAcquireInStackQueuedSpinLock(&Ctx->Device.Files.Lock, &lqh);
+        for (LIST_ENTRY *entry = Ctx->Device.Files.List.Flink; entry != &Ctx->Device.Files.List; entry = entry->Flink)
+        {
+            TUN_FILE_CTX *file_ctx = CONTAINING_RECORD(entry, TUN_FILE_CTX, Entry);
+            ++open;
+            if (file_ctx->ForceClosing)
+                continue;
+            file_ctx->ForceClosing = TRUE;
+            /* Closing the last handle frees file_ctx, so hold on to what we need past that. */
+            file = file_ctx->FileObject;
+            process = file_ctx->Process;
+            ObReferenceObject(file);
+            ObReferenceObject(process);
+            break;
+        }
+        KeReleaseInStackQueuedSpinLock(&lqh);
+        if (!file)
+            return open; /* Every one left was visited, so the whole list was counted. */
+
+        KAPC_STATE apc_state;
+        HANDLE handle;
+        KeStackAttachProcess(process, &apc_state);
+        while (ObFindHandleForObject(process, file, *IoFileObjectType, NULL, &handle))
+        {
+            if (!NT_SUCCESS(ObCloseHandle(handle, UserMode)))
+                break;
+        }
+        KeUnstackDetachProcess(&apc_state);
+        ObDereferenceObject(process);
+        ObDereferenceObject(file);
+    }
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static void
+TunForceHandlesClosedByScan(_Inout_ TUN_CTX *Ctx)
 {
     NTSTATUS status;
     PEPROCESS process;
@@ -1473,22 +4215,35 @@ TunHaltEx(NDIS_HANDLE MiniportAdapterContext, NDIS_HALT_ACTION HaltAction)
                                                       * active NBLs present. */
 
     InterlockedAnd(&ctx->Flags, ~TUN_FLAGS_PRESENT);
-    ExReleaseSpinLockExclusive(
-        &ctx->TransitionLock,
-        ExAcquireSpinLockExclusive(&ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
+    TunRundownBarrier(ctx); /* Ensure above change is visible to all readers. */
+    TunMuxLeave(ctx);
 
     for (IRP *pending_irp; (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.ReadQueue.Csq, NULL)) != NULL;)
         TunCompleteRequest(ctx, pending_irp, STATUS_FILE_FORCED_CLOSED, IO_NO_INCREMENT);
+    for (IRP *pending_irp; (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.TapQueue.Csq, NULL)) != NULL;)
+        TunCompleteRequest(ctx, pending_irp, STATUS_FILE_FORCED_CLOSED, IO_NO_INCREMENT);
+    for (IRP *pending_irp; (pending_irp = IoCsqRemoveNextIrp(&ctx->Device.MuxQueue.Csq, NULL)) != NULL;)
+        TunCompleteRequest(ctx, pending_irp, STATUS_FILE_FORCED_CLOSED, IO_NO_INCREMENT);
 
     /* Setting a deny-all DACL we prevent userspace to open the device by symlink after TunForceHandlesClosed(). */
     TunDeviceSetDenyAllDacl(ctx->Device.Object);
 
-    if (InterlockedGet64(&ctx->Device.RefCount))
-        TunForceHandlesClosed(ctx);
+    /* Scanning every handle in the system is only worth it for file objects still open afterwards. */
+    if (TunForceHandlesClosed(ctx))
+        TunForceHandlesClosedByScan(ctx);
 
     /* Wait for processing IRP(s) to complete. */
     IoAcquireRemoveLock(&ctx->Device.RemoveLock, NULL);
     IoReleaseRemoveLockAndWait(&ctx->Device.RemoveLock, NULL);
+    TunQueueClear(ctx, NDIS_STATUS_ADAPTER_REMOVED, FALSE); /* Frees anything still parked */
+
+    /* Pausing already waited for every queued NBL to be returned, but their DPCs may still be on their way out, and the
+     * receive deadline may still be armed even though nothing is left staged for it. */
+    KeCancelTimer(&ctx->Receive.Deadline);
+    KeFlushQueuedDpcs();
+    ExFreePoolWithTag(ctx->Cpus, TUN_HTONL(TUN_MEMORY_TAG));
+    if (ctx->Rss.State)
+        ExFreePoolWithTag(ctx->Rss.State, TUN_HTONL(TUN_MEMORY_TAG));
     NdisFreeNetBufferListPool(ctx->NBLPool);
 
     /* MiniportAdapterHandle must not be used in TunDispatch(). After TunHaltEx() returns it is invalidated. */
@@ -1582,13 +4337,13 @@ TunOidQuery(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_MAXIMUM_TOTAL_SIZE:
     case OID_GEN_TRANSMIT_BLOCK_SIZE:
     case OID_GEN_RECEIVE_BLOCK_SIZE:
-        return TunOidQueryWrite(OidRequest, TUN_EXCH_MAX_IP_PACKET_SIZE);
+        return TunOidQueryWrite(OidRequest, ctx->Config.MaxIpPacketSize);
 
     case OID_GEN_TRANSMIT_BUFFER_SPACE:
-        return TunOidQueryWrite(OidRequest, TUN_EXCH_MAX_IP_PACKET_SIZE * TUN_QUEUE_MAX_NBLS);
+        return TunOidQueryWrite(OidRequest, ctx->Config.MaxIpPacketSize * ctx->Config.QueueMaxNbls);
 
     case OID_GEN_RECEIVE_BUFFER_SPACE:
-        return TunOidQueryWrite(OidRequest, TUN_EXCH_MAX_IP_PACKET_SIZE * TUN_EXCH_MAX_PACKETS);
+        return TunOidQueryWrite(OidRequest, ctx->Config.MaxIpPacketSize * ctx->Config.MaxPackets);
 
     case OID_GEN_VENDOR_ID:
         return TunOidQueryWrite(OidRequest, TUN_HTONL(TUN_VENDOR_ID));
@@ -1609,12 +4364,19 @@ TunOidQuery(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_RCV_OK:
         return TunOidQueryWrite32or64(
             OidRequest,
-            InterlockedGet64((LONG64 *)&ctx->Statistics.ifHCInUcastPkts) +
-                InterlockedGet64((LONG64 *)&ctx->Statistics.ifHCInMulticastPkts) +
-                InterlockedGet64((LONG64 *)&ctx->Statistics.ifHCInBroadcastPkts));
-
-    case OID_GEN_STATISTICS:
-        return TunOidQueryWriteBuf(OidRequest, &ctx->Statistics, (UINT)sizeof(ctx->Statistics));
+            InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInUcastPkts) +
+                InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInMulticastPkts) +
+                InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInBroadcastPkts));
+
+    case OID_GEN_STATISTICS: {
+        NDIS_STATISTICS_INFO statistics = ctx->Statistics;
+        statistics.ifInDiscards = InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifInDiscards);
+        statistics.ifInErrors = InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifInErrors);
+        statistics.ifHCInOctets = InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInOctets);
+        statistics.ifHCInUcastOctets = InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInUcastOctets);
+        statistics.ifHCInUcastPkts = InterlockedGet64((LONG64 *)&ctx->Receive.Statistics.ifHCInUcastPkts);
+        return TunOidQueryWriteBuf(OidRequest, &statistics, (UINT)sizeof(statistics));
+    }
 
     case OID_GEN_INTERRUPT_MODERATION: {
         static const NDIS_INTERRUPT_MODERATION_PARAMETERS intp = {
@@ -1635,6 +4397,144 @@ TunOidQuery(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     return NDIS_STATUS_NOT_SUPPORTED;
 }
 
+_IRQL_requires_same_ static LONG
+TunOffloadParameterApply(_In_ LONG RxChecksum, _In_ UCHAR Parameter, _In_ LONG Bits)
+{
+    switch (Parameter)
+    {
+    case NDIS_OFFLOAD_PARAMETERS_RX_ENABLED_TX_DISABLED:
+    case NDIS_OFFLOAD_PARAMETERS_TX_RX_ENABLED:
+        return RxChecksum | Bits;
+    case NDIS_OFFLOAD_PARAMETERS_TX_RX_DISABLED:
+    case NDIS_OFFLOAD_PARAMETERS_TX_ENABLED_RX_DISABLED:
+        return RxChecksum & ~Bits;
+    }
+    return RxChecksum;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NDIS_STATUS
+TunOidSetOffloadParameters(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
+{
+    if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1)
+    {
+        OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1;
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+    const NDIS_OFFLOAD_PARAMETERS *param = OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+    if (param->Header.Type != NDIS_OBJECT_TYPE_DEFAULT || param->Header.Revision < NDIS_OFFLOAD_PARAMETERS_REVISION_1 ||
+        param->Header.Size < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1)
+        return NDIS_STATUS_INVALID_DATA;
+
+    LONG rx_csum = InterlockedGet(&ctx->RxChecksum);
+    rx_csum = TunOffloadParameterApply(rx_csum, param->IPv4Checksum, TUN_RX_CSUM_IPV4);
+    rx_csum = TunOffloadParameterApply(rx_csum, param->TCPIPv4Checksum, TUN_RX_CSUM_TCP_IPV4);
+    rx_csum = TunOffloadParameterApply(rx_csum, param->UDPIPv4Checksum, TUN_RX_CSUM_UDP_IPV4);
+    rx_csum = TunOffloadParameterApply(rx_csum, param->TCPIPv6Checksum, TUN_RX_CSUM_TCP_IPV6);
+    rx_csum = TunOffloadParameterApply(rx_csum, param->UDPIPv6Checksum, TUN_RX_CSUM_UDP_IPV6);
+    InterlockedExchange(&ctx->RxChecksum, rx_csum);
+    OidRequest->DATA.SET_INFORMATION.BytesRead = NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1;
+
+    /* The protocol learns the resulting configuration from this indication, not from the OID completion. */
+    NDIS_OFFLOAD offload;
+    TunOffloadFill(&offload, rx_csum);
+    NDIS_STATUS_INDICATION t = { .Header = { .Type = NDIS_OBJECT_TYPE_STATUS_INDICATION,
+                                             .Revision = NDIS_STATUS_INDICATION_REVISION_1,
+                                             .Size = NDIS_SIZEOF_STATUS_INDICATION_REVISION_1 },
+                                 .SourceHandle = ctx->MiniportAdapterHandle,
+                                 .StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG,
+                                 .StatusBuffer = &offload,
+                                 .StatusBufferSize = sizeof(offload) };
+    NdisMIndicateStatusEx(ctx->MiniportAdapterHandle, &t);
+    return NDIS_STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NDIS_STATUS
+TunOidSetReceiveScaleParameters(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
+{
+    NDIS_STATUS status;
+    const UCHAR *buf = OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+    ULONG buf_size = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+    if (buf_size < NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1)
+    {
+        OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1;
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+    const NDIS_RECEIVE_SCALE_PARAMETERS *param = (const NDIS_RECEIVE_SCALE_PARAMETERS *)buf;
+    if (param->Header.Type != NDIS_OBJECT_TYPE_RSS_PARAMETERS ||
+        param->Header.Revision < NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_1 ||
+        param->Header.Size < NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1)
+        return NDIS_STATUS_INVALID_DATA;
+
+    /* OID requests are serialized, so nobody else replaces the state while we build the next one from it. */
+    TUN_RSS_STATE *old_state = ctx->Rss.State;
+    if (!old_state && (param->Flags & (NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED | NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED |
+                                       NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED)))
+        return NDIS_STATUS_INVALID_DATA;
+    TUN_RSS_STATE *state = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*state), TUN_HTONL(TUN_MEMORY_TAG));
+    if (!state)
+        return NDIS_STATUS_RESOURCES;
+    if (old_state)
+        RtlCopyMemory(state, old_state, FIELD_OFFSET(TUN_RSS_STATE, Toeplitz));
+    else
+        NdisZeroMemory(state, FIELD_OFFSET(TUN_RSS_STATE, Toeplitz));
+
+    status = NDIS_STATUS_INVALID_DATA;
+    if (!(param->Flags & NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED))
+    {
+        ULONG hash_info = param->HashInformation;
+        if (hash_info && (NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(hash_info) != NdisHashFunctionToeplitz ||
+                          (NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(hash_info) & ~TUN_RSS_HASH_TYPES)))
+            goto cleanup_ExFreePoolWithTag;
+        state->HashInformation = hash_info;
+    }
+    if (!(param->Flags & NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED))
+    {
+        /* NDIS 6.20 and later pass processor numbers, while earlier revisions pass CPU offsets from BaseCpuNumber. */
+        ULONG entry_size = param->Header.Revision >= NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_2 ? sizeof(PROCESSOR_NUMBER)
+                                                                                               : sizeof(UCHAR);
+        ULONG entries = param->IndirectionTableSize / entry_size;
+        if (param->IndirectionTableSize % entry_size || entries > TUN_RSS_MAX_INDIRECTION ||
+            (entries & (entries - 1)) || param->IndirectionTableOffset > buf_size ||
+            param->IndirectionTableSize > buf_size - param->IndirectionTableOffset)
+            goto cleanup_ExFreePoolWithTag;
+        for (ULONG i = 0; i < entries; ++i)
+        {
+            PROCESSOR_NUMBER processor = { 0 };
+            if (entry_size == sizeof(PROCESSOR_NUMBER))
+                RtlCopyMemory(&processor, buf + param->IndirectionTableOffset + i * entry_size, sizeof(processor));
+            else
+                processor.Number = (UCHAR)(buf[param->IndirectionTableOffset + i] + param->BaseCpuNumber);
+            ULONG index = KeGetProcessorIndexFromNumber(&processor);
+            if (index >= ctx->Rss.NumQueues)
+                goto cleanup_ExFreePoolWithTag;
+            state->IndirectionTable[i] = index;
+        }
+        state->IndirectionTableSize = entries;
+    }
+    if (!(param->Flags & NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED))
+    {
+        if (param->HashSecretKeySize != TUN_RSS_KEY_SIZE || param->HashSecretKeyOffset > buf_size ||
+            param->HashSecretKeySize > buf_size - param->HashSecretKeyOffset)
+            goto cleanup_ExFreePoolWithTag;
+        RtlCopyMemory(state->Key, buf + param->HashSecretKeyOffset, TUN_RSS_KEY_SIZE);
+    }
+    state->Enabled = !(param->Flags & NDIS_RSS_PARAM_FLAG_DISABLE_RSS) && state->IndirectionTableSize;
+    TunRssInitToeplitz(state);
+
+    InterlockedExchangePointer((PVOID *)&ctx->Rss.State, state);
+    TunRundownBarrier(ctx); /* Wait for writers still hashing with the old state. */
+    if (old_state)
+        ExFreePoolWithTag(old_state, TUN_HTONL(TUN_MEMORY_TAG));
+    OidRequest->DATA.SET_INFORMATION.BytesRead = buf_size;
+    return NDIS_STATUS_SUCCESS;
+
+cleanup_ExFreePoolWithTag:
+    ExFreePoolWithTag(state, TUN_HTONL(TUN_MEMORY_TAG));
+    return status;
+}
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static NDIS_STATUS
 TunOidSet(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
@@ -1662,6 +4562,12 @@ TunOidSet(_Inout_ TUN_CTX *ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_INTERRUPT_MODERATION:
         return NDIS_STATUS_INVALID_DATA;
 
+    case OID_TCP_OFFLOAD_PARAMETERS:
+        return TunOidSetOffloadParameters(ctx, OidRequest);
+
+    case OID_GEN_RECEIVE_SCALE_PARAMETERS:
+        return TunOidSetReceiveScaleParameters(ctx, OidRequest);
+
     case OID_PNP_SET_POWER:
         if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength != sizeof(NDIS_DEVICE_POWER_STATE))
         {
@@ -1757,6 +4663,9 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
 {
     NTSTATUS status;
 
+    KeInitializeSpinLock(&TunAdaptersLock);
+    InitializeListHead(&TunAdapters);
+
     NdisVersion = NdisGetVersion();
     if (NdisVersion < NDIS_MINIPORT_VERSION_MIN)
         return NDIS_STATUS_UNSUPPORTED_REVISION;
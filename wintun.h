@@ -0,0 +1,598 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2019 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Exchange format shared by the driver and its userspace clients. Everything in here is header-only and allocation
+ * free: readers walk a completed ReadFile buffer in place, writers pack packets straight into the WriteFile buffer. */
+
+#pragma once
+
+#if defined(_KERNEL_MODE)
+/* The driver includes the WDK headers first. */
+#elif defined(_WIN32)
+#    include <windows.h>
+#    include <winioctl.h>
+#else
+/* Elsewhere, for instance on hosts that relay or test exchange buffers, the header stands on its own, with standard
+ * types in place of the Windows ones it uses and the annotations compiled out. */
+#    include <stddef.h>
+#    include <stdint.h>
+#    include <string.h>
+
+typedef void VOID;
+typedef uint8_t UCHAR;
+typedef uint8_t BOOLEAN;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t UINT;
+typedef uint64_t ULONG64;
+
+typedef struct _PROCESSOR_NUMBER
+{
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER;
+
+#    ifndef TRUE
+#        define TRUE 1
+#    endif
+#    ifndef FALSE
+#        define FALSE 0
+#    endif
+#    define FORCEINLINE inline __attribute__((always_inline))
+#    define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+
+#    define CTL_CODE(DeviceType, Function, Method, Access) \
+        (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#    define FILE_DEVICE_NETWORK 0x00000012
+#    define METHOD_BUFFERED 0
+#    define FILE_READ_DATA 0x0001
+#    define FILE_WRITE_DATA 0x0002
+
+#    define _In_
+#    define _Inout_
+#    define _Out_
+#    define _Out_opt_
+#    define _In_reads_bytes_(size)
+#    define _Out_writes_bytes_(size)
+#    define _Field_size_bytes_(size)
+#endif
+
+#ifdef _MSC_VER
+#    define TUN_ALIGN(n) __declspec(align(n))
+#    pragma warning(push)
+#    pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
+#else
+#    define TUN_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+/* The limits below are upper bounds. Adapters may be configured to smaller MaxPackets and MaxPacketSize values. */
+
+/* Maximum number of full-sized exchange packets that can be exchanged in a single read/write. */
+#define TUN_EXCH_MAX_PACKETS 256
+/* Maximum exchange packet size - empirically determined by net buffer list (pool) limitations */
+#define TUN_EXCH_MAX_PACKET_SIZE 0xF000
+#define TUN_EXCH_ALIGNMENT 16 /* Memory alignment in exchange buffers */
+/* Maximum IP packet size (headers + payload) */
+#define TUN_EXCH_MAX_IP_PACKET_SIZE (TUN_EXCH_MAX_PACKET_SIZE - sizeof(TUN_PACKET))
+/* Maximum size of read/write exchange buffer */
+#define TUN_EXCH_MAX_BUFFER_SIZE (TUN_EXCH_MAX_PACKETS * TUN_EXCH_MAX_PACKET_SIZE)
+#define TUN_EXCH_MIN_BUFFER_SIZE_READ TUN_EXCH_MAX_PACKET_SIZE /* Minimum size of read exchange buffer */
+#define TUN_EXCH_MIN_BUFFER_SIZE_WRITE (sizeof(TUN_PACKET))    /* Minimum size of write exchange buffer */
+
+typedef enum _TUN_PACKET_FLAGS
+{
+    /* Written packets only: the IPv4 header checksum and the TCP/UDP checksum are already known to be good, so the
+     * network stack need not verify them again. */
+    TUN_PACKET_FLAG_CHECKSUM_VALID = 1 << 0,
+    /* Tap reads only: the packet was cut to the tap's snap length. */
+    TUN_PACKET_FLAG_TRUNCATED = 1 << 1,
+} TUN_PACKET_FLAGS;
+
+typedef struct _TUN_PACKET
+{
+    ULONG Size;  /* Size of packet data (TUN_EXCH_MAX_IP_PACKET_SIZE max) */
+    ULONG Flags; /* TUN_PACKET_FLAGS, zero when unused */
+    /* Read packets only: 802.1p user priority, or else IP precedence, the packet was queued by (0-7). Higher
+     * priorities are handed out before lower ones. Zero on write. */
+    UCHAR Priority;
+    UCHAR Reserved; /* Zero */
+    /* With TUN_PACKET_FLAG_TRUNCATED: size of the packet before it was cut. Zero otherwise. */
+    USHORT OriginalSize;
+    _Field_size_bytes_(Size) TUN_ALIGN(TUN_EXCH_ALIGNMENT) UCHAR Data[]; /* Packet data */
+} TUN_PACKET;
+
+#define TunPacketAlign(size) (((UINT)(size) + (UINT)(TUN_EXCH_ALIGNMENT - 1)) & ~(UINT)(TUN_EXCH_ALIGNMENT - 1))
+
+/* Returns the IP version of packet data if it is large enough to carry the matching header, or 0 if it is malformed. */
+static FORCEINLINE UCHAR
+TunIpVersion(_In_reads_bytes_(Size) const UCHAR *Data, _In_ ULONG Size)
+{
+    if (Size >= 20 && Data[0] >> 4 == 4)
+        return 4;
+    if (Size >= 40 && Data[0] >> 4 == 6)
+        return 6;
+    return 0;
+}
+
+static FORCEINLINE UCHAR
+TunPacketIpVersion(_In_ const TUN_PACKET *Packet)
+{
+    return TunIpVersion(Packet->Data, Packet->Size);
+}
+
+typedef struct _TUN_EXCH_READER
+{
+    const UCHAR *Next, *End;
+} TUN_EXCH_READER;
+
+static FORCEINLINE VOID
+TunExchReaderInit(_Out_ TUN_EXCH_READER *Reader, _In_reads_bytes_(Size) const VOID *Buffer, _In_ ULONG Size)
+{
+    Reader->Next = (const UCHAR *)Buffer;
+    Reader->End = (const UCHAR *)Buffer + Size;
+}
+
+/* Returns a view of the next packet, or NULL once the buffer is exhausted or the next packet would overrun it. */
+static FORCEINLINE const TUN_PACKET *
+TunExchReaderNext(_Inout_ TUN_EXCH_READER *Reader)
+{
+    if (Reader->End - Reader->Next < (ptrdiff_t)sizeof(TUN_PACKET))
+        return NULL;
+    const TUN_PACKET *p = (const TUN_PACKET *)Reader->Next;
+    ULONG p_size = p->Size;
+    if (p_size > TUN_EXCH_MAX_IP_PACKET_SIZE)
+        return NULL;
+    ULONG p_aligned = TunPacketAlign(sizeof(TUN_PACKET) + p_size);
+    if (Reader->End - Reader->Next < (ptrdiff_t)p_aligned)
+        return NULL;
+    Reader->Next += p_aligned;
+    return p;
+}
+
+typedef struct _TUN_EXCH_WRITER
+{
+    UCHAR *Buffer;
+    ULONG Size, Used, Count;
+} TUN_EXCH_WRITER;
+
+static FORCEINLINE VOID
+TunExchWriterInit(_Out_ TUN_EXCH_WRITER *Writer, _Out_writes_bytes_(Size) VOID *Buffer, _In_ ULONG Size)
+{
+    Writer->Buffer = (UCHAR *)Buffer;
+    Writer->Size = Size < TUN_EXCH_MAX_BUFFER_SIZE ? Size : TUN_EXCH_MAX_BUFFER_SIZE;
+    Writer->Used = 0;
+    Writer->Count = 0;
+}
+
+/* Reserves room for a packet of PacketSize bytes and returns where its data goes, or NULL if the bundle is full.
+ * The header and trailing alignment padding are filled in here, so the caller only copies the packet itself. */
+static FORCEINLINE UCHAR *
+TunExchWriterReserve(_Inout_ TUN_EXCH_WRITER *Writer, _In_ ULONG PacketSize, _In_ ULONG Flags)
+{
+    if (PacketSize > TUN_EXCH_MAX_IP_PACKET_SIZE)
+        return NULL;
+    ULONG p_aligned = TunPacketAlign(sizeof(TUN_PACKET) + PacketSize);
+    if (Writer->Size - Writer->Used < p_aligned)
+        return NULL;
+    TUN_PACKET *p = (TUN_PACKET *)(Writer->Buffer + Writer->Used);
+    RtlZeroMemory(p, sizeof(TUN_PACKET));
+    RtlZeroMemory(p->Data + PacketSize, p_aligned - sizeof(TUN_PACKET) - PacketSize);
+    p->Size = PacketSize;
+    p->Flags = Flags;
+    Writer->Used += p_aligned;
+    Writer->Count++;
+    return p->Data;
+}
+
+#define TUN_EXCH_VALIDATE_BATCH 64
+
+/* Checks the IP versions and sizes gathered from a batch of packets, as TunPacketIpVersion does for each. The loop
+ * carries no dependency and has no branches, so compilers vectorize it. */
+static FORCEINLINE BOOLEAN
+TunExchValidateBatch(_In_ const ULONG *Sizes, _In_ const UCHAR *Versions, _In_ ULONG Count)
+{
+    ULONG invalid = 0;
+    for (ULONG i = 0; i < Count; ++i)
+        invalid |= !(((Versions[i] == 4) & (Sizes[i] >= 20)) | ((Versions[i] == 6) & (Sizes[i] >= 40)));
+    return !invalid;
+}
+
+/* Validates a whole write bundle by the same rules the driver applies, optionally returning its packet count. Walking
+ * the sizes is a serial dependency, so only that is done packet by packet, and the rest batch by batch, as the driver
+ * does too. */
+static FORCEINLINE BOOLEAN
+TunExchValidate(_In_reads_bytes_(Size) const VOID *Buffer, _In_ ULONG Size, _Out_opt_ ULONG *Count)
+{
+    ULONG offset = 0, count = 0;
+    if (Size > TUN_EXCH_MAX_BUFFER_SIZE)
+        return FALSE;
+    while (Size - offset >= sizeof(TUN_PACKET))
+    {
+        ULONG sizes[TUN_EXCH_VALIDATE_BATCH], n = 0;
+        UCHAR versions[TUN_EXCH_VALIDATE_BATCH];
+        for (; n < TUN_EXCH_VALIDATE_BATCH && Size - offset >= sizeof(TUN_PACKET); ++n)
+        {
+            const TUN_PACKET *p = (const TUN_PACKET *)((const UCHAR *)Buffer + offset);
+            ULONG p_size = p->Size;
+            if (p_size > TUN_EXCH_MAX_IP_PACKET_SIZE)
+                return FALSE;
+            ULONG p_aligned = TunPacketAlign(sizeof(TUN_PACKET) + p_size);
+            if (Size - offset < p_aligned)
+                return FALSE;
+            sizes[n] = p_size;
+            versions[n] = p_size ? p->Data[0] >> 4 : 0;
+            offset += p_aligned;
+        }
+        if (!TunExchValidateBatch(sizes, versions, n))
+            return FALSE;
+        count += n;
+    }
+    if (offset != Size)
+        return FALSE;
+    if (Count)
+        *Count = count;
+    return TRUE;
+}
+
+/* Compact exchange format, which a handle may switch to with TUN_IOCTL_SET_FORMAT before its first read or write.
+ * Packets carry a 4-byte header and are only aligned to TUN_EXCH_V2_ALIGNMENT, and every completed read buffer ends
+ * with an index of where its packets start, so that the packets can be handed out to several threads without walking
+ * them first:
+ *
+ *   packet_0 ... packet_n-1 | offset_0 ... offset_n-1 | n
+ *
+ * The offsets and n are ULONGs, and the offsets count from the start of the buffer. Write bundles carry no index.
+ * The limits above apply unchanged. */
+#define TUN_EXCH_FORMAT_V1 1
+#define TUN_EXCH_FORMAT_V2 2
+#define TUN_EXCH_V2_ALIGNMENT 4
+
+typedef struct _TUN_PACKET_V2
+{
+    USHORT Size;    /* Size of packet data (TUN_EXCH_MAX_IP_PACKET_SIZE max) */
+    UCHAR Flags;    /* TUN_PACKET_FLAGS, zero when unused */
+    UCHAR Priority; /* As in TUN_PACKET */
+    _Field_size_bytes_(Size) UCHAR Data[]; /* Packet data */
+} TUN_PACKET_V2;
+
+#define TunPacketV2Align(size) \
+    (((UINT)(size) + (UINT)(TUN_EXCH_V2_ALIGNMENT - 1)) & ~(UINT)(TUN_EXCH_V2_ALIGNMENT - 1))
+
+/* Returns the offset index of a completed v2 read buffer and sets Count to the number of packets it lists, or returns
+ * NULL if the buffer cannot hold the index it claims to end with. */
+static FORCEINLINE const ULONG *
+TunExchV2Index(_In_reads_bytes_(Size) const VOID *Buffer, _In_ ULONG Size, _Out_ ULONG *Count)
+{
+    if (Size < sizeof(ULONG) || Size % sizeof(ULONG))
+        return NULL;
+    const ULONG *end = (const ULONG *)((const UCHAR *)Buffer + Size) - 1;
+    ULONG count = *end;
+    if (count > Size / sizeof(ULONG) - 1)
+        return NULL;
+    *Count = count;
+    return end - count;
+}
+
+/* Returns a view of the packet at Offset, as listed in Index, or NULL if it would overrun the packets of the buffer.
+ * Packets can be looked up in any order and from any thread. */
+static FORCEINLINE const TUN_PACKET_V2 *
+TunExchV2Packet(_In_ const VOID *Buffer, _In_ const ULONG *Index, _In_ ULONG Offset)
+{
+    ULONG end = (ULONG)((const UCHAR *)Index - (const UCHAR *)Buffer);
+    if (Offset % TUN_EXCH_V2_ALIGNMENT || Offset > end || end - Offset < sizeof(TUN_PACKET_V2))
+        return NULL;
+    const TUN_PACKET_V2 *p = (const TUN_PACKET_V2 *)((const UCHAR *)Buffer + Offset);
+    if (end - Offset - sizeof(TUN_PACKET_V2) < p->Size)
+        return NULL;
+    return p;
+}
+
+/* As TunExchWriterReserve, but packing the bundle in the v2 format. */
+static FORCEINLINE UCHAR *
+TunExchV2WriterReserve(_Inout_ TUN_EXCH_WRITER *Writer, _In_ ULONG PacketSize, _In_ ULONG Flags)
+{
+    if (PacketSize > TUN_EXCH_MAX_IP_PACKET_SIZE)
+        return NULL;
+    ULONG p_aligned = TunPacketV2Align(sizeof(TUN_PACKET_V2) + PacketSize);
+    if (Writer->Size - Writer->Used < p_aligned)
+        return NULL;
+    TUN_PACKET_V2 *p = (TUN_PACKET_V2 *)(Writer->Buffer + Writer->Used);
+    RtlZeroMemory(p->Data + PacketSize, p_aligned - sizeof(TUN_PACKET_V2) - PacketSize);
+    p->Size = (USHORT)PacketSize;
+    p->Flags = (UCHAR)Flags;
+    p->Priority = 0;
+    Writer->Used += p_aligned;
+    Writer->Count++;
+    return p->Data;
+}
+
+/* As TunExchValidate, but for a v2 write bundle. */
+static FORCEINLINE BOOLEAN
+TunExchV2Validate(_In_reads_bytes_(Size) const VOID *Buffer, _In_ ULONG Size, _Out_opt_ ULONG *Count)
+{
+    ULONG offset = 0, count = 0;
+    if (Size > TUN_EXCH_MAX_BUFFER_SIZE)
+        return FALSE;
+    while (Size - offset >= sizeof(TUN_PACKET_V2))
+    {
+        ULONG sizes[TUN_EXCH_VALIDATE_BATCH], n = 0;
+        UCHAR versions[TUN_EXCH_VALIDATE_BATCH];
+        for (; n < TUN_EXCH_VALIDATE_BATCH && Size - offset >= sizeof(TUN_PACKET_V2); ++n)
+        {
+            const TUN_PACKET_V2 *p = (const TUN_PACKET_V2 *)((const UCHAR *)Buffer + offset);
+            ULONG p_size = p->Size;
+            if (p_size > TUN_EXCH_MAX_IP_PACKET_SIZE)
+                return FALSE;
+            ULONG p_aligned = TunPacketV2Align(sizeof(TUN_PACKET_V2) + p_size);
+            if (Size - offset < p_aligned)
+                return FALSE;
+            sizes[n] = p_size;
+            versions[n] = p_size ? p->Data[0] >> 4 : 0;
+            offset += p_aligned;
+        }
+        if (!TunExchValidateBatch(sizes, versions, n))
+            return FALSE;
+        count += n;
+    }
+    if (offset != Size)
+        return FALSE;
+    if (Count)
+        *Count = count;
+    return TRUE;
+}
+
+/* Mux exchange format, used by handles subscribed to several adapters with TUN_IOCTL_SET_MUX. Read and write buffers
+ * are a sequence of runs, each a TUN_MUX_RUN header followed by Size bytes of packets in the default format, all of
+ * one adapter, which the header names by its LUID index:
+ *
+ *   run_0 | packets_0 | run_1 | packets_1 | ...
+ *
+ * Consecutive runs may name the same adapter. Reads take packets from each adapter in turn, so that no adapter has
+ * more than a few packets in a read before each of the others that has packets waiting had its turn. */
+typedef struct _TUN_MUX_RUN
+{
+    ULONG LuidIndex; /* NetLuidIndex of the adapter the packets come from or go to */
+    ULONG Size;      /* Bytes of packets following the header */
+    ULONG Count;     /* Read runs only: number of packets following the header. Zero on write. */
+    ULONG Reserved;  /* Zero */
+} TUN_MUX_RUN;
+
+/* A mux read buffer must hold a run of one packet of any adapter's largest size. */
+#define TUN_EXCH_MIN_BUFFER_SIZE_MUX_READ (sizeof(TUN_MUX_RUN) + TUN_EXCH_MAX_PACKET_SIZE)
+
+/* Returns the header of the next run of a mux buffer and sets Packets up to walk its packets with TunExchReaderNext,
+ * or returns NULL once the buffer is exhausted or the next run would overrun it. */
+static FORCEINLINE const TUN_MUX_RUN *
+TunExchMuxReaderNext(_Inout_ TUN_EXCH_READER *Reader, _Out_ TUN_EXCH_READER *Packets)
+{
+    if (Reader->End - Reader->Next < (ptrdiff_t)sizeof(TUN_MUX_RUN))
+        return NULL;
+    const TUN_MUX_RUN *run = (const TUN_MUX_RUN *)Reader->Next;
+    ULONG size = run->Size;
+    if (Reader->End - Reader->Next - (ptrdiff_t)sizeof(TUN_MUX_RUN) < (ptrdiff_t)size)
+        return NULL;
+    TunExchReaderInit(Packets, run + 1, size);
+    Reader->Next += sizeof(TUN_MUX_RUN) + size;
+    return run;
+}
+
+/* Starts a run of a mux write bundle for the adapter of LuidIndex, setting Run to where its header is, for
+ * TunExchMuxWriterEnd, or returns FALSE if the bundle is full. Packets reserved with TunExchWriterReserve up to then
+ * go to that adapter. */
+static FORCEINLINE BOOLEAN
+TunExchMuxWriterBegin(_Inout_ TUN_EXCH_WRITER *Writer, _In_ ULONG LuidIndex, _Out_ ULONG *Run)
+{
+    if (Writer->Size - Writer->Used < sizeof(TUN_MUX_RUN))
+        return FALSE;
+    TUN_MUX_RUN *run = (TUN_MUX_RUN *)(Writer->Buffer + Writer->Used);
+    run->LuidIndex = LuidIndex;
+    run->Size = 0;
+    run->Count = 0;
+    run->Reserved = 0;
+    *Run = Writer->Used;
+    Writer->Used += sizeof(TUN_MUX_RUN);
+    return TRUE;
+}
+
+/* Closes the run started at Run by TunExchMuxWriterBegin, dropping it again if no packet made it in. */
+static FORCEINLINE VOID
+TunExchMuxWriterEnd(_Inout_ TUN_EXCH_WRITER *Writer, _In_ ULONG Run)
+{
+    ULONG size = Writer->Used - Run - sizeof(TUN_MUX_RUN);
+    if (!size)
+        Writer->Used = Run;
+    else
+        ((TUN_MUX_RUN *)(Writer->Buffer + Run))->Size = size;
+}
+
+/* Device controls, issued with DeviceIoControl on an open adapter handle. */
+
+/* Input: TUN_AFFINITY. Declares where this handle's reads are serviced. */
+#define TUN_IOCTL_SET_AFFINITY CTL_CODE(FILE_DEVICE_NETWORK, 0x800, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+/* Output: TUN_STATISTICS. */
+#define TUN_IOCTL_GET_STATISTICS CTL_CODE(FILE_DEVICE_NETWORK, 0x801, METHOD_BUFFERED, FILE_READ_DATA)
+
+typedef enum _TUN_AFFINITY_TYPE
+{
+    TUN_AFFINITY_NONE = 0,  /* Reads are serviced on whichever processor queued or requested packets */
+    TUN_AFFINITY_PROCESSOR, /* Reads are serviced on Processor */
+    TUN_AFFINITY_NODE,      /* Reads are serviced on a processor of NUMA node Node */
+} TUN_AFFINITY_TYPE;
+
+typedef struct _TUN_AFFINITY
+{
+    ULONG Type; /* TUN_AFFINITY_TYPE */
+    USHORT Node;
+    PROCESSOR_NUMBER Processor;
+} TUN_AFFINITY;
+
+#define TUN_PRIORITY_LANES 3 /* High, normal and low, in that order */
+
+typedef struct _TUN_STATISTICS
+{
+    ULONG64 QueuedPackets[TUN_PRIORITY_LANES];  /* Packet lists accepted into each transmit lane */
+    ULONG64 DroppedPackets[TUN_PRIORITY_LANES]; /* Packet lists dropped from each transmit lane when it was full */
+    ULONG64 CrossNodeCopies; /* Packets copied into a read buffer on a different node than its handle's affinity */
+    ULONG64 SupersededAcks;  /* Queued pure TCP ACKs dropped for a later one of the flow acknowledging more */
+    ULONG64 TapDrops;        /* Packet copies dropped because a tap handle's queue was full */
+    ULONG64 LockedBytes;     /* Bytes of exchange buffers currently locked into memory, across handles */
+    ULONG64 PeakLockedBytes; /* Most bytes of exchange buffers ever locked into memory at once */
+} TUN_STATISTICS;
+
+/* Input: an array of TUN_FILTER_INSN, or nothing to remove the filter. Attaches a filter program to this handle. */
+#define TUN_IOCTL_SET_FILTER CTL_CODE(FILE_DEVICE_NETWORK, 0x802, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+/* Output: a ULONG64 per instruction of the attached filter, counting the packets each return instruction dropped. */
+#define TUN_IOCTL_GET_FILTER_DROPS CTL_CODE(FILE_DEVICE_NETWORK, 0x803, METHOD_BUFFERED, FILE_READ_DATA)
+/* Input: a ULONG TUN_EXCH_FORMAT_*. Selects the exchange format of this handle, before it first reads or writes. */
+#define TUN_IOCTL_SET_FORMAT CTL_CODE(FILE_DEVICE_NETWORK, 0x804, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+/* Input: TUN_TAP. Turns this handle into a tap, before it first reads or writes. Taps use TUN_EXCH_FORMAT_V1 only. */
+#define TUN_IOCTL_SET_TAP CTL_CODE(FILE_DEVICE_NETWORK, 0x805, METHOD_BUFFERED, FILE_READ_DATA)
+/* Input: a ULONG TUN_LOCKING_*. Selects how this handle's buffers are locked into memory, before it first reads or
+ * writes. */
+#define TUN_IOCTL_SET_LOCKING CTL_CODE(FILE_DEVICE_NETWORK, 0x809, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* By default, the buffer of a handle's first read, and that of its first write, stay locked until the handle is
+ * closed, and later calls must pass the same buffer or a prefix of it. With TUN_LOCKING_CALL, each call's buffer is
+ * locked only while the call is in flight instead, and may be anywhere, so that memory is only pinned for the calls
+ * outstanding, and a caller can size its calls by how much traffic it sees. Write slots need TUN_LOCKING_HANDLE. */
+#define TUN_LOCKING_HANDLE 1
+#define TUN_LOCKING_CALL 2
+
+/* Input: TUN_WRITE_SLOTS. Maps the write buffer up front, before this handle first writes, as a row of equally sized
+ * slots. Each WriteFile call may then pass any run of whole slots, and several such calls may be in flight at once, so
+ * that slots whose packets the network stack has returned can be written again while others are still held. */
+#define TUN_IOCTL_SET_WRITE_SLOTS CTL_CODE(FILE_DEVICE_NETWORK, 0x806, METHOD_BUFFERED, FILE_WRITE_DATA)
+/* Output: one bit per slot, in ULONGs, set for the slots of writes still in flight. */
+#define TUN_IOCTL_GET_WRITE_SLOTS CTL_CODE(FILE_DEVICE_NETWORK, 0x807, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define TUN_EXCH_MAX_WRITE_SLOTS 1024
+
+typedef struct _TUN_WRITE_SLOTS
+{
+    ULONG64 Address;  /* Start of the write buffer, which must stay the same for the handle's lifetime */
+    ULONG SlotSize;   /* A multiple of TUN_EXCH_ALIGNMENT */
+    ULONG SlotCount;  /* At most TUN_EXCH_MAX_WRITE_SLOTS */
+} TUN_WRITE_SLOTS;
+
+/* Input: an array of TUN_SUBMIT_WRITE. Output: an NTSTATUS for each, in the same buffer. Writes several runs of slots
+ * of a slotted write buffer in a single call, each as if passed to WriteFile on its own. STATUS_PENDING means that the
+ * run's slots stay in flight until the network stack returns their packets, as TUN_IOCTL_GET_WRITE_SLOTS reports.
+ * Only writes are submitted this way: a single ReadFile already returns as many queued packets as fit its buffer, so
+ * read descriptors would only split it up. */
+#define TUN_IOCTL_SUBMIT_WRITES CTL_CODE(FILE_DEVICE_NETWORK, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+typedef struct _TUN_SUBMIT_WRITE
+{
+    ULONG Offset; /* Into the write buffer, at the start of a slot */
+    ULONG Size;   /* Bytes of packets, spanning one or more slots */
+} TUN_SUBMIT_WRITE;
+
+/* Finds the slots a write of a slotted buffer spans, by the same rules the driver applies, or returns FALSE if it is
+ * empty, does not start at a slot, or runs past the buffer. */
+static FORCEINLINE BOOLEAN
+TunSubmitWriteSlots(
+    _In_ const TUN_SUBMIT_WRITE *Write,
+    _In_ ULONG SlotSize,
+    _In_ ULONG SlotCount,
+    _Out_ ULONG *First,
+    _Out_ ULONG *Last)
+{
+    ULONG size = SlotSize * SlotCount;
+    if (!Write->Size || Write->Offset > size || size - Write->Offset < Write->Size || Write->Offset % SlotSize)
+        return FALSE;
+    *First = Write->Offset / SlotSize;
+    *Last = (Write->Offset + Write->Size - 1) / SlotSize;
+    return TRUE;
+}
+
+/* A tap handle reads copies of the packets going through the adapter, without taking them from whichever handle
+ * reads or writes them. Copies are queued for the tap separately, and dropped when the tap falls behind. Taps cannot
+ * write. */
+typedef enum _TUN_TAP_FLAGS
+{
+    TUN_TAP_TRANSMIT = 1 << 0, /* Packets the network stack sends through the adapter, for ordinary handles to read */
+    TUN_TAP_RECEIVE = 1 << 1,  /* Packets ordinary handles write, for the network stack to receive */
+} TUN_TAP_FLAGS;
+
+typedef struct _TUN_TAP
+{
+    ULONG Flags;      /* TUN_TAP_FLAGS, at least one */
+    ULONG SnapLength; /* Packets are cut to this many bytes, or not at all if zero */
+    ULONG MaxPackets; /* Copies queued before further ones are dropped, or zero for the adapter's QueueMaxNbls */
+} TUN_TAP;
+
+/* Input: an array of ULONG LUID indices, of at most TUN_MUX_MAX_ADAPTERS adapters. Turns this handle into a mux for
+ * those adapters, before it first reads or writes. Reads then return packets the network stack sends through any of
+ * them, and writes may address any of them, in the mux exchange format. Each adapter may only belong to one mux at a
+ * time, and drops out of it when it is removed. */
+#define TUN_IOCTL_SET_MUX CTL_CODE(FILE_DEVICE_NETWORK, 0x80A, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define TUN_MUX_MAX_ADAPTERS 1024
+
+/* Filter programs are classic BPF, encoded as on Linux and the BSDs, so `tcpdump -dd` output can be used as is. They
+ * run on each outgoing packet before it is copied into one of the handle's reads, starting at the IP header, and
+ * drop the packet when they return 0. Only the first TUN_FILTER_MAX_BYTES bytes of a packet can be loaded, and loads
+ * beyond those or beyond the packet end also drop it. */
+#define TUN_FILTER_MAX_INSNS 64
+#define TUN_FILTER_MAX_BYTES 256
+#define TUN_FILTER_MEMWORDS 16
+
+typedef struct _TUN_FILTER_INSN
+{
+    USHORT Code;
+    UCHAR Jt, Jf;
+    ULONG K;
+} TUN_FILTER_INSN;
+
+/* Instruction classes */
+#define TUN_BPF_LD 0x00
+#define TUN_BPF_LDX 0x01
+#define TUN_BPF_ST 0x02
+#define TUN_BPF_STX 0x03
+#define TUN_BPF_ALU 0x04
+#define TUN_BPF_JMP 0x05
+#define TUN_BPF_RET 0x06
+#define TUN_BPF_MISC 0x07
+/* Load sizes */
+#define TUN_BPF_W 0x00
+#define TUN_BPF_H 0x08
+#define TUN_BPF_B 0x10
+/* Load modes */
+#define TUN_BPF_IMM 0x00
+#define TUN_BPF_ABS 0x20
+#define TUN_BPF_IND 0x40
+#define TUN_BPF_MEM 0x60
+#define TUN_BPF_LEN 0x80
+#define TUN_BPF_MSH 0xa0
+/* ALU and jump operations */
+#define TUN_BPF_ADD 0x00
+#define TUN_BPF_SUB 0x10
+#define TUN_BPF_MUL 0x20
+#define TUN_BPF_DIV 0x30
+#define TUN_BPF_OR 0x40
+#define TUN_BPF_AND 0x50
+#define TUN_BPF_LSH 0x60
+#define TUN_BPF_RSH 0x70
+#define TUN_BPF_NEG 0x80
+#define TUN_BPF_MOD 0x90
+#define TUN_BPF_XOR 0xa0
+#define TUN_BPF_JA 0x00
+#define TUN_BPF_JEQ 0x10
+#define TUN_BPF_JGT 0x20
+#define TUN_BPF_JGE 0x30
+#define TUN_BPF_JSET 0x40
+/* Operand sources */
+#define TUN_BPF_K 0x00
+#define TUN_BPF_X 0x08
+#define TUN_BPF_A 0x10 /* Return value */
+/* Miscellaneous operations */
+#define TUN_BPF_TAX 0x00
+#define TUN_BPF_TXA 0x80
+
+#ifdef _MSC_VER
+#    pragma warning(pop)
+#endif